@@ -0,0 +1,38 @@
+#include "hello.h"
+
+import std;
+
+// Serves as usual with every thread pinned and connections steered to the core that took their
+// packets, printing what each core did every second, to check the balance under a load generator
+// such as wrk. Run as `xmake run balance [seconds]`, 0 serves until SIGINT or SIGTERM.
+int main(int argc, char* argv[]){
+	std::size_t seconds = argc > 1 ? std::stoul(argv[1]) : 0;
+
+	Server server{"127.0.0.1", 8000, std::thread::hardware_concurrency()};
+	server.placement({.pin = true, .steer = true, .prefill = 16});
+
+	std::jthread report([&server, seconds](std::stop_token stop){
+		std::vector<Server::CoreLoad> last;
+		for(std::size_t tick = 1; !stop.stop_requested(); ++tick){
+			for(int i = 0; i < 10 && !stop.stop_requested(); ++i) std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			auto loads = server.coreLoads();
+			if(last.size() != loads.size()) last.assign(loads.size(), {});
+			std::uint64_t total = 0;
+			for(std::size_t i = 0; i < loads.size(); ++i) total += loads[i].answered - last[i].answered;
+			std::println("{}s: {} requests/s", tick, total);
+			for(std::size_t i = 0; i < loads.size(); ++i){
+				auto& now = loads[i];
+				auto answered = now.answered - last[i].answered;
+				std::println("  cpu {:>3}: {:>9} requests/s {:>5.1f}%, {} connections accepted, {:.0f}% on the cpu of their packets",
+					now.cpu, answered, total ? 100.0 * answered / total : 0.0, now.accepted,
+					now.accepted ? 100.0 * now.steered / now.accepted : 0.0);
+			}
+			last = std::move(loads);
+			if(seconds && tick == seconds){
+				server.drain(std::chrono::seconds(1));
+				return;
+			}
+		}
+	});
+	server.run(Bench::hello);
+}
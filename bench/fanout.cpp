@@ -0,0 +1,63 @@
+#include "asio/io_context.hpp"
+#include "asio/co_spawn.hpp"
+#include "asio/detached.hpp"
+
+#include "hub.h"
+
+import std;
+import webSocket;
+
+// One publisher and subscribers that only take their messages off their queues: the cost of
+// fanning out, without the socket writes. Run as `xmake run fanout [subscribers] [messages]`.
+int main(int argc, char* argv[]){
+	std::size_t subscribers = argc > 1 ? std::stoul(argv[1]) : 50000;
+	std::size_t messages = std::max<std::size_t>(argc > 2 ? std::stoul(argv[2]) : 1000, 1);
+	std::size_t numThreads = std::thread::hardware_concurrency();
+
+	WebSocket::Hub hub{{.queue = {.maxMessages = 64, .overflow = WebSocket::Overflow::Coalesce}}};
+	std::vector<std::unique_ptr<asio::io_context>> contexts;
+	for(std::size_t i = 0; i < numThreads; ++i) contexts.emplace_back(std::make_unique<asio::io_context>(1));
+
+	std::atomic<std::uint64_t> received{0};
+	for(std::size_t i = 0; i < subscribers; ++i){
+		asio::co_spawn(*contexts[i % numThreads], [&hub, &received, messages, deflate = i % 2 == 0]() -> asio::awaitable<void> {
+			WebSocket::Hub::Subscriber subscriber{hub, co_await asio::this_coro::executor, deflate};
+			std::uint64_t count = 0;
+			for(;;){
+				auto message = co_await subscriber.next();
+				if(!message) break;
+				++count;
+				// the last message always arrives, under Coalesce the oldest ones make room for it
+				std::uint64_t seq;
+				std::memcpy(&seq, message->payload.data(), sizeof(seq));
+				if(seq == messages - 1) break;
+			}
+			received.fetch_add(count, std::memory_order_relaxed);
+		}, asio::detached);
+	}
+
+	std::vector<std::jthread> threads;
+	for(auto& context : contexts) threads.emplace_back([&context]{ context->run(); });
+	while(hub.subscribers() < subscribers) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	std::string payload(8, '\0');
+	payload += "{\"tile\":{\"z\":12,\"x\":1203,\"y\":1544},\"layer\":\"roads\",\"state\":\"updated\",\"features\":[";
+	for(int f = 0; f < 16; ++f) payload += std::format("{}{{\"id\":{},\"kind\":\"primary\"}}", f ? "," : "", f);
+	payload += "]}";
+
+	auto start = std::chrono::steady_clock::now();
+	for(std::uint64_t seq = 0; seq < messages; ++seq){
+		std::memcpy(payload.data(), &seq, sizeof(seq));
+		hub.publish(WebSocket::Opcode::Binary, std::as_bytes(std::span{payload}));
+	}
+	auto published = std::chrono::steady_clock::now();
+	threads.clear();
+	auto finished = std::chrono::steady_clock::now();
+
+	auto seconds = std::chrono::duration<double>(finished - start).count();
+	auto stats = hub.stats();
+	std::println("{} subscribers on {} threads, {} messages of {} bytes", subscribers, numThreads, messages, payload.size());
+	std::println("published in {:.3f}s, delivered in {:.3f}s", std::chrono::duration<double>(published - start).count(), seconds);
+	std::println("{} taken off the queues, {:.0f} per second", received.load(), received.load() / seconds);
+	std::println("queued {}, coalesced {}, dropped {}, disconnected {}", stats.queued, stats.coalesced, stats.dropped, stats.disconnected);
+}
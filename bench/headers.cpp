@@ -0,0 +1,71 @@
+import std;
+import simd;
+
+// Finds the end of a browser's and an API client's request header, iterations times each, with
+// Simd::findHeaderEnd and with the per-byte state machine it replaced. Run as
+// `xmake run headers [iterations]`.
+int main(int argc, char* argv[]){
+	std::size_t iterations = argc > 1 ? std::stoul(argv[1]) : 10'000'000;
+
+	static constexpr std::string_view browser{
+		"GET /static/tiles/12/1203/1544.png HTTP/1.1\r\n"
+		"Host: maps.example.com\r\n"
+		"Connection: keep-alive\r\n"
+		"sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+		"sec-ch-ua-mobile: ?0\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+		"sec-ch-ua-platform: \"Linux\"\r\n"
+		"Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+		"Sec-Fetch-Site: same-origin\r\n"
+		"Sec-Fetch-Mode: no-cors\r\n"
+		"Sec-Fetch-Dest: image\r\n"
+		"Referer: https://maps.example.com/\r\n"
+		"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+		"Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+		"Cookie: session=4f2a9c0d1e7b3a5f8c6d2e0b9a7f3c1d; theme=dark; consent=1; _ga=GA1.1.1234567890.1700000000\r\n"
+		"\r\n"};
+	static constexpr std::string_view api{
+		"POST /upload HTTP/1.1\r\n"
+		"Host: api.example.com\r\n"
+		"User-Agent: curl/8.5.0\r\n"
+		"Accept: */*\r\n"
+		"Content-Type: application/json\r\n"
+		"Content-Length: 128\r\n"
+		"\r\n"};
+
+	// the scan Request::consumeHeaderSome did before, one byte at a time
+	auto perByte = [](std::span<const std::byte> data) -> std::size_t {
+		char last = 0;
+		unsigned found = 0;
+		for(std::size_t i = 0; i < data.size(); ++i){
+			char c = static_cast<char>(data[i]);
+			if(c == '\r' && last != '\r') ++found;
+			else if(c == '\n' && last == '\r') ++found;
+			else found = 0;
+			last = c;
+			if(found == 4) return i + 1;
+		}
+		return std::string_view::npos;
+	};
+	auto simd = [](std::span<const std::byte> data) { return Simd::findHeaderEnd(data); };
+
+	auto run = [iterations](std::string_view name, std::string_view header, auto scan){
+		auto data = std::as_bytes(std::span{header});
+		std::size_t sum = 0;
+		auto start = std::chrono::steady_clock::now();
+		for(std::size_t i = 0; i < iterations; ++i){
+			// an opaque pointer, so the scan is not hoisted out of the loop
+			auto* p = data.data();
+			asm volatile("" : "+r"(p));
+			sum += scan(std::span{p, data.size()});
+		}
+		auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if(sum != iterations * header.size()) std::println("{}: wrong end found", name);
+		std::println("  {:<9} {:>7.1f} ns per header, {:>6.2f} GB/s", name, seconds * 1e9 / iterations, header.size() * iterations / seconds / 1e9);
+	};
+	for(auto [name, header] : {std::pair{"browser", browser}, std::pair{"api", api}}){
+		std::println("{} header of {} bytes:", name, header.size());
+		run("per byte", header, perByte);
+		run("simd", header, simd);
+	}
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "connection.h"
+#include "server.h"
+
+import std;
+import http;
+import error;
+import buffer;
+
+// What the benchmarks against a server of their own process share: a connection loop answering
+// every request with the same short body, pipelined ones in one write, and a blocking client
+// counting those answers.
+namespace Bench{
+
+inline constexpr std::string_view request{"GET /abc/one/12/1203/1544 HTTP/1.1\r\nHost: localhost\r\nUser-Agent: bench\r\n\r\n"};
+inline constexpr std::string_view body{"Hello twooo2234567!"};
+
+inline constexpr std::size_t maxPipelineDepth = 16;
+inline constexpr std::size_t resHeadSize = 256;
+inline constexpr std::size_t maxHeaderSize = 16384;
+
+// Reads requests while complete ones are buffered, up to maxPipelineDepth, and writes their
+// answers before waiting on the socket. Header storage is borrowed from the pool per batch.
+inline asio::awaitable<void> hello(Connection conn){
+	PoolBlock resHeadBuff;
+	std::vector<Http::Response> batch;
+	// counted like the server's own requests, for admission control and Server::coreLoads
+	Admission::InFlight inFlight;
+
+	auto flush = [&]() -> asio::awaitable<Error> {
+		if(batch.empty()) co_return Error{};
+		auto err = co_await conn.write(std::span{batch});
+		inFlight.done(batch.size());
+		batch.clear();
+		resHeadBuff.reset();
+		co_return err;
+	};
+
+	for(;;){
+		Http::Request req{maxHeaderSize};
+		auto [err, complete] = conn.readBuffered(req);
+		if(!err && !complete){
+			err = co_await flush();
+			if(!err) err = co_await conn.read(req);
+		}
+		if(err) break;
+		inFlight.add();
+
+		if(!resHeadBuff) resHeadBuff = PoolBlock{maxPipelineDepth * resHeadSize};
+		auto& res = batch.emplace_back(Http::Status::OK, req.version(), resHeadBuff.span().subspan(batch.size() * resHeadSize, resHeadSize));
+		res.set(Http::Field::ContentType, "text/plain");
+		res.set(Http::Field::Connection, "keep-alive");
+		res.setBody(std::string{body});
+		if(batch.size() == maxPipelineDepth && co_await flush()) break;
+	}
+	co_await flush();
+}
+
+class Client{
+	asio::ip::tcp::socket socket_;
+	std::string pending_;
+	std::array<char, 16384> buffer_;
+public:
+	explicit Client(asio::io_context& io): socket_(io) {}
+
+	std::error_code connect(std::uint16_t port){
+		std::error_code ec;
+		socket_.connect({asio::ip::make_address("127.0.0.1"), port}, ec);
+		return ec;
+	}
+	std::error_code send(std::string_view data){
+		std::error_code ec;
+		asio::write(socket_, asio::buffer(data), ec);
+		return ec;
+	}
+	// reads until n more answers came in
+	std::error_code receive(std::size_t n){
+		while(n > 0){
+			std::error_code ec;
+			std::size_t read = socket_.read_some(asio::buffer(buffer_), ec);
+			if(ec) return ec;
+			pending_.append(buffer_.data(), read);
+			std::size_t consumed = 0;
+			for(std::size_t at; n > 0 && (at = pending_.find(body, consumed)) != std::string::npos; --n) consumed = at + body.size();
+			pending_.erase(0, consumed);
+		}
+		return {};
+	}
+};
+
+}
@@ -0,0 +1,70 @@
+#include "asio/steady_timer.hpp"
+#include "asio/this_coro.hpp"
+
+#include "hello.h"
+
+import std;
+import buffer;
+
+// Opens connections that each send one request and then stay idle, against a server on one
+// thread, and prints the bytes of its BufferPool in use before and after: with the buffers only
+// borrowed while a message is in flight, idle connections hold next to none of them. Run as
+// `xmake run idle [connections]`, with a file limit above twice that.
+int main(int argc, char* argv[]){
+	static constexpr std::uint16_t port = 8002;
+	std::size_t connections = argc > 1 ? std::stoul(argv[1]) : 1000;
+
+	Server server{"127.0.0.1", port, 1};
+	// the pool is per thread, it is read on the server's one
+	std::atomic<std::size_t> inUse{0}, cached{0};
+	std::atomic<bool> sampling{false};
+	std::jthread serving([&]{
+		server.run([&](Connection conn) -> asio::awaitable<void> {
+			if(!sampling.exchange(true)){
+				asio::co_spawn(co_await asio::this_coro::executor, [&inUse, &cached]() -> asio::awaitable<void> {
+					asio::steady_timer timer{co_await asio::this_coro::executor};
+					for(;;){
+						inUse.store(BufferPool::local().inUseBytes(), std::memory_order_relaxed);
+						cached.store(BufferPool::local().cachedBytes(), std::memory_order_relaxed);
+						timer.expires_after(std::chrono::milliseconds(50));
+						auto [ec] = co_await timer.async_wait(asio::as_tuple(asio::use_awaitable));
+						if(ec) co_return;
+					}
+				}, asio::detached);
+			}
+			co_await Bench::hello(std::move(conn));
+		});
+	});
+	auto settle = []{ std::this_thread::sleep_for(std::chrono::milliseconds(200)); };
+
+	asio::io_context io;
+	std::vector<std::unique_ptr<Bench::Client>> clients;
+	clients.push_back(std::make_unique<Bench::Client>(io));
+	if(clients.back()->connect(port) || clients.back()->send(Bench::request) || clients.back()->receive(1)){
+		std::println("no answer from the server");
+		server.drain(std::chrono::seconds(1));
+		return 1;
+	}
+	settle();
+	std::size_t baseline = inUse.load();
+	for(std::size_t i = 1; i < connections; ++i){
+		auto client = std::make_unique<Bench::Client>(io);
+		auto ec = client->connect(port);
+		if(!ec) ec = client->send(Bench::request);
+		if(!ec) ec = client->receive(1);
+		if(ec){
+			std::println("stopped at {} connections: {}", clients.size(), ec.message());
+			break;
+		}
+		clients.push_back(std::move(client));
+	}
+	settle();
+	std::size_t idle = inUse.load();
+
+	std::println("{} idle connections on one server thread", clients.size());
+	std::println("pool bytes in use: {} with one, {} with all, {:.1f} per connection", baseline, idle,
+		static_cast<double>(idle) / clients.size());
+	std::println("pool bytes cached for the next messages: {}", cached.load());
+	clients.clear();
+	server.drain(std::chrono::seconds(1));
+}
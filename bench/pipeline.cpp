@@ -0,0 +1,46 @@
+#include "hello.h"
+
+import std;
+
+// Clients that each send depth requests at once and read all the answers before sending more,
+// against a server on one thread: what answering a pipelined batch with one write gives. Run as
+// `xmake run pipeline [connections] [seconds] [depth]`, depth 1 for the baseline without.
+int main(int argc, char* argv[]){
+	static constexpr std::uint16_t port = 8001;
+	std::size_t connections = argc > 1 ? std::stoul(argv[1]) : 8;
+	std::size_t seconds = argc > 2 ? std::stoul(argv[2]) : 10;
+	std::size_t depth = std::max<std::size_t>(argc > 3 ? std::stoul(argv[3]) : Bench::maxPipelineDepth, 1);
+
+	Server server{"127.0.0.1", port, 1};
+	std::jthread serving([&server]{ server.run(Bench::hello); });
+
+	std::string burst;
+	for(std::size_t i = 0; i < depth; ++i) burst += Bench::request;
+	std::atomic<std::uint64_t> answered{0};
+	std::atomic<bool> stop{false};
+	auto start = std::chrono::steady_clock::now();
+	{
+		std::vector<std::jthread> clients;
+		for(std::size_t c = 0; c < connections; ++c){
+			clients.emplace_back([&]{
+				asio::io_context io;
+				Bench::Client client{io};
+				if(auto ec = client.connect(port)){
+					std::println("connect: {}", ec.message());
+					return;
+				}
+				while(!stop.load(std::memory_order_relaxed)){
+					if(client.send(burst) || client.receive(depth)) return;
+					answered.fetch_add(depth, std::memory_order_relaxed);
+				}
+			});
+		}
+		std::this_thread::sleep_for(std::chrono::seconds(seconds));
+		stop = true;
+	}
+	auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	server.drain(std::chrono::seconds(1));
+
+	std::println("{} connections, {} requests in flight each, one server thread", connections, depth);
+	std::println("{} requests in {:.2f}s, {:.0f} per second", answered.load(), elapsed, answered.load() / elapsed);
+}
@@ -0,0 +1,54 @@
+#include "asio/awaitable.hpp"
+
+import std;
+import http;
+
+// Registers routes static, with captures and with a wildcard in turn, compiles them and matches
+// lookups paths spread over all of them, a tenth of them unknown. Run as
+// `xmake run routes [routes] [lookups]`.
+int main(int argc, char* argv[]){
+	std::size_t routes = std::max<std::size_t>(argc > 1 ? std::stoul(argv[1]) : 5000, 1);
+	std::size_t lookups = argc > 2 ? std::stoul(argv[2]) : 10'000'000;
+
+	// only matched, the handlers never run
+	Http::Router<asio::awaitable<int>()> router;
+	auto handler = []() -> asio::awaitable<int> { co_return 1; };
+	auto start = std::chrono::steady_clock::now();
+	for(std::size_t i = 0; i < routes; ++i){
+		switch(i % 3){
+		case 0: router.add(Http::Method::Get, std::format("/api/v{}/resource{}/list", i % 4, i), handler); break;
+		case 1: router.add(Http::Method::Get, std::format("/api/v{}/resource{}/:id/items/:item", i % 4, i), handler); break;
+		default: router.add(Http::Method::Get, std::format("/files{}/*", i), handler); break;
+		}
+	}
+	auto added = std::chrono::steady_clock::now();
+	router.compile();
+	auto compiled = std::chrono::steady_clock::now();
+
+	std::minstd_rand random{42};
+	std::vector<std::string> paths;
+	for(std::size_t n = 0; n < 4096; ++n){
+		std::size_t i = random() % routes;
+		if(n % 10 == 9) paths.push_back(std::format("/api/v{}/missing{}/list", i % 4, i));
+		else if(i % 3 == 0) paths.push_back(std::format("/api/v{}/resource{}/list", i % 4, i));
+		else if(i % 3 == 1) paths.push_back(std::format("/api/v{}/resource{}/{}/items/{}", i % 4, i, n, n * 7));
+		else paths.push_back(std::format("/files{}/tiles/12/{}/{}.png", i, n, n * 3));
+	}
+	std::vector<std::vector<std::string_view>> segments;
+	for(auto& path : paths){
+		auto& split = segments.emplace_back();
+		for(auto part : std::views::split(std::string_view{path}.substr(1), '/')) split.emplace_back(part.begin(), part.end());
+	}
+
+	std::size_t matched = 0;
+	auto matching = std::chrono::steady_clock::now();
+	for(std::size_t n = 0; n < lookups; ++n){
+		Http::RouteParams params;
+		matched += router.match(Http::Method::Get, segments[n % segments.size()], params) != nullptr;
+	}
+	auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - matching).count();
+
+	auto ms = [](auto duration){ return std::chrono::duration<double, std::milli>(duration).count(); };
+	std::println("{} routes added in {:.1f}ms, compiled in {:.1f}ms", routes, ms(added - start), ms(compiled - added));
+	std::println("{} lookups, {} matched, {:.1f} ns each", lookups, matched, seconds * 1e9 / std::max<std::size_t>(lookups, 1));
+}
@@ -1 +1,3 @@
-add_requires("asio", "glaze", "gdal")
+add_requires("asio", "glaze", "gdal", "liburing", "zlib")
+-- the targets define CO_SERVER_ZSTD and CO_SERVER_BROTLI for those found, see xmake.lua
+add_requires("zstd", "brotli", {optional = true})
@@ -37,3 +37,274 @@ public:
 		}
 	}
 };
+
+// Per-thread cache of byte blocks in a few size classes. Every io_context runs on its own
+// thread, so this is the pool of that context and needs no locking. Blocks larger than the
+// biggest class are plain allocations that are freed instead of cached.
+export
+class BufferPool final {
+public:
+	static constexpr std::array<std::size_t, 4> sizeClasses{1024, 4096, 16384, 65536};
+	static constexpr std::size_t maxCachedBytes = 16 * 1024 * 1024;
+
+	static BufferPool& local() {
+		thread_local BufferPool pool;
+		return pool;
+	}
+
+	BufferPool() = default;
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+	~BufferPool() { trim(); }
+
+	std::span<std::byte> acquire(std::size_t minSize) {
+		std::size_t cls = classOf_(minSize);
+		if(cls == sizeClasses.size()) return {new std::byte[minSize], minSize};
+
+		++inUse_[cls];
+		auto& list = free_[cls];
+		if(list.empty()) return {new std::byte[sizeClasses[cls]], sizeClasses[cls]};
+		std::byte* data = list.back();
+		list.pop_back();
+		cachedBytes_ -= sizeClasses[cls];
+		return {data, sizeClasses[cls]};
+	}
+
+	void release(std::span<std::byte> block) noexcept {
+		if(block.empty()) return;
+		std::size_t cls = classOf_(block.size());
+		if(cls == sizeClasses.size() || sizeClasses[cls] != block.size()){
+			delete[] block.data();
+			return;
+		}
+		--inUse_[cls];
+		if(cachedBytes_ + block.size() > maxCachedBytes){
+			delete[] block.data();
+			return;
+		}
+		try{
+			free_[cls].push_back(block.data());
+			cachedBytes_ += block.size();
+		} catch (...) {
+			delete[] block.data();
+		}
+	}
+
+	// Caches up to perClass blocks of every size class, written once so their pages are faulted
+	// in now. On a thread pinned to a CPU they are then on that CPU's NUMA node.
+	void prefill(std::size_t perClass){
+		for(std::size_t cls = 0; cls < sizeClasses.size(); ++cls){
+			for(std::size_t n = free_[cls].size(); n < perClass && cachedBytes_ + sizeClasses[cls] <= maxCachedBytes; ++n){
+				auto* data = new std::byte[sizeClasses[cls]];
+				std::memset(data, 0, sizeClasses[cls]);
+				try{
+					free_[cls].push_back(data);
+				} catch (...) {
+					delete[] data;
+					throw;
+				}
+				cachedBytes_ += sizeClasses[cls];
+			}
+		}
+	}
+
+	// frees every cached block, e.g. after a traffic spike
+	void trim() noexcept {
+		for(auto& list : free_){
+			for(auto* data : list) delete[] data;
+			list.clear();
+		}
+		cachedBytes_ = 0;
+	}
+
+	std::size_t cachedBytes() const noexcept { return cachedBytes_; }
+	// blocks may be given back on another thread than they came from, so this is an estimate
+	std::size_t inUseBytes() const noexcept {
+		std::ptrdiff_t total = 0;
+		for(std::size_t i = 0; i < sizeClasses.size(); ++i) total += inUse_[i] * static_cast<std::ptrdiff_t>(sizeClasses[i]);
+		return total > 0 ? static_cast<std::size_t>(total) : 0;
+	}
+
+private:
+	std::array<std::vector<std::byte*>, sizeClasses.size()> free_;
+	std::array<std::ptrdiff_t, sizeClasses.size()> inUse_{};
+	std::size_t cachedBytes_ = 0;
+
+	static std::size_t classOf_(std::size_t size) noexcept {
+		for(std::size_t i = 0; i < sizeClasses.size(); ++i)
+			if(size <= sizeClasses[i]) return i;
+		return sizeClasses.size();
+	}
+};
+
+// A block borrowed from the BufferPool of the current thread, given back on destruction.
+export
+class PoolBlock final {
+	std::span<std::byte> block_;
+public:
+	PoolBlock() = default;
+	explicit PoolBlock(std::size_t minSize): block_(BufferPool::local().acquire(minSize)) {}
+	PoolBlock(const PoolBlock&) = delete;
+	PoolBlock& operator=(const PoolBlock&) = delete;
+	PoolBlock(PoolBlock&& other) noexcept : block_(std::exchange(other.block_, {})) {}
+	PoolBlock& operator=(PoolBlock&& other) noexcept {
+		if(this != &other){
+			reset();
+			block_ = std::exchange(other.block_, {});
+		}
+		return *this;
+	}
+	~PoolBlock() { reset(); }
+
+	std::byte* data() const noexcept { return block_.data(); }
+	std::size_t size() const noexcept { return block_.size(); }
+	std::span<std::byte> span() const noexcept { return block_; }
+	explicit operator bool() const noexcept { return !block_.empty(); }
+
+	void reset() noexcept {
+		BufferPool::local().release(block_);
+		block_ = {};
+	}
+
+	// moves to a block of at least minSize, keeping the first keep bytes
+	void grow(std::size_t minSize, std::size_t keep) {
+		PoolBlock bigger{minSize};
+		if(keep > 0) std::memcpy(bigger.data(), block_.data(), keep);
+		*this = std::move(bigger);
+	}
+};
+
+// Same interface as StaticBuffer, but storage is only borrowed from the pool while it holds
+// data. It starts at minSize and grows up to maxSize when a message needs it.
+export
+class PooledBuffer final {
+	PoolBlock block_;
+	std::size_t read_ = 0;
+	std::size_t write_ = 0;
+	std::size_t minSize_;
+	std::size_t maxSize_;
+	bool pinned_ = false;
+
+public:
+	PooledBuffer(std::size_t minSize, std::size_t maxSize): minSize_(minSize), maxSize_(std::max(minSize, maxSize)) {}
+
+	std::size_t size() const noexcept {
+		return write_ - read_;
+	}
+
+	bool empty() const noexcept {
+		return size() == 0;
+	}
+
+	bool holding() const noexcept {
+		return static_cast<bool>(block_);
+	}
+
+	std::size_t capacity() const noexcept {
+		return block_.size();
+	}
+
+	std::span<std::byte> writableSpan() noexcept {
+		return {block_.data() + write_, block_.size() - write_};
+	}
+	void commit(std::size_t size) noexcept {
+		write_ += size;
+		if (write_ > block_.size()) write_ = block_.size(); // safety clamp
+	}
+
+	// Makes room to write into: borrows a block if needed, moves unread bytes to the front
+	// when the end is reached, and grows once that is not enough. Empty only at maxSize,
+	// or at the end of the block while pinned.
+	std::span<std::byte> prepare() {
+		if(!block_) block_ = PoolBlock{minSize_};
+		if(pinned_) return writableSpan();
+		if(write_ == block_.size() && read_ > 0){
+			std::memmove(block_.data(), block_.data() + read_, write_ - read_);
+			write_ -= read_;
+			read_ = 0;
+		}
+		if(write_ == block_.size() && block_.size() < maxSize_){
+			block_.grow(std::min(block_.size() * 2, maxSize_), write_);
+		}
+		return writableSpan();
+	}
+
+	std::span<const std::byte> readableSpan() const noexcept {
+		return {block_.data() + read_, write_ - read_};
+	}
+	// for decoding in place, e.g. a chunked body, before the bytes are consumed
+	std::span<std::byte> readableSpan() noexcept {
+		return {block_.data() + read_, write_ - read_};
+	}
+	void consume(std::size_t size) noexcept {
+		read_ += size;
+		if(read_ >= write_ && !pinned_){ //no more data, reset the buffer
+			read_ = 0;
+			write_ = 0;
+		}
+	}
+
+	// While pinned, bytes already written stay where they are: nothing is reset, moved or
+	// released, so views into consumed data remain valid until unpin().
+	void pin() noexcept { pinned_ = true; }
+	void unpin() noexcept {
+		pinned_ = false;
+		if(read_ >= write_){
+			read_ = 0;
+			write_ = 0;
+		}
+	}
+	bool pinned() const noexcept { return pinned_; }
+
+	// gives the block back once there is nothing left in it
+	void release() noexcept {
+		if(!empty() || pinned_) return;
+		block_.reset();
+		read_ = 0;
+		write_ = 0;
+	}
+};
+
+// Immutable bytes behind an atomic reference count, so one payload can back any number of
+// messages on any thread. Copies share the bytes; building one copies or adopts them once.
+export
+class SharedBuffer final {
+	std::shared_ptr<const std::byte> data_;
+	std::size_t size_ = 0;
+public:
+	SharedBuffer() = default;
+	explicit SharedBuffer(std::span<const std::byte> data): size_(data.size()) {
+		auto block = std::make_shared_for_overwrite<std::byte[]>(size_);
+		std::byte* bytes = block.get();
+		if(size_ > 0) std::memcpy(bytes, data.data(), size_);
+		data_ = std::shared_ptr<const std::byte>(std::move(block), bytes);
+	}
+	explicit SharedBuffer(std::string_view data): SharedBuffer(std::as_bytes(std::span{data})) {}
+	explicit SharedBuffer(std::vector<std::byte>&& data) {
+		auto owner = std::make_shared<const std::vector<std::byte>>(std::move(data));
+		size_ = owner->size();
+		data_ = std::shared_ptr<const std::byte>(owner, owner->data());
+	}
+	explicit SharedBuffer(std::string&& data) {
+		auto owner = std::make_shared<const std::string>(std::move(data));
+		size_ = owner->size();
+		data_ = std::shared_ptr<const std::byte>(owner, reinterpret_cast<const std::byte*>(owner->data()));
+	}
+
+	const std::byte* data() const noexcept { return data_.get(); }
+	std::size_t size() const noexcept { return size_; }
+	bool empty() const noexcept { return size_ == 0; }
+	std::span<const std::byte> span() const noexcept { return {data_.get(), size_}; }
+	explicit operator bool() const noexcept { return data_ != nullptr; }
+	// length bytes from offset, sharing these bytes instead of copying them
+	SharedBuffer slice(std::size_t offset, std::size_t length) const noexcept {
+		offset = std::min(offset, size_);
+		SharedBuffer part;
+		part.size_ = std::min(length, size_ - offset);
+		part.data_ = std::shared_ptr<const std::byte>(data_, data_.get() + offset);
+		return part;
+	}
+	// expires with the last SharedBuffer of these bytes, lets a cache tell a live body from a new
+	// one that happens to reuse its address
+	std::weak_ptr<const std::byte> weak() const noexcept { return data_; }
+};
@@ -6,6 +6,18 @@
 #include "asio/use_awaitable.hpp"
 #include "asio/ip/tcp.hpp"
 #include "asio/as_tuple.hpp"
+#include "asio/bind_cancellation_slot.hpp"
+#include "asio/cancellation_signal.hpp"
+#include "asio/write.hpp"
+#include "asio/post.hpp"
+#include "asio/append.hpp"
+#include "asio/co_spawn.hpp"
+#include "asio/any_completion_handler.hpp"
+
+#include "uring.h"
+
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
 
 // import <asio.hpp>;
 
@@ -14,6 +26,8 @@
 // import asio;
 import error;
 import buffer;
+import http;
+import timerWheel;
 import std;
 
 // export
@@ -29,79 +43,691 @@ concept MessageLike = requires(
 	{ t.produceBodySome(out) }   -> std::same_as<std::tuple<Error, bool, std::size_t>>;
 };
 
+// Messages that can hand out their serialized header and body as buffers they own,
+// these are written with one gathered write instead of being copied through writeBuffer_.
+// export
+template <typename T>
+concept GatherMessageLike = MessageLike<T> && requires(
+	T t,
+	std::span<std::span<const std::byte>> out
+) {
+	{ t.produceBuffers(out) } -> std::same_as<std::tuple<Error, std::size_t>>;
+};
+
+// Messages that can parse their header straight out of the connection's read buffer. The buffer
+// stays pinned until the next message is read, or detachHeader() when the buffer has to move.
+// export
+template <typename T>
+concept InPlaceMessageLike = MessageLike<T> && requires(
+	T t,
+	std::span<const std::byte> in
+) {
+	{ t.consumeHeaderInPlace(in) } -> std::same_as<std::tuple<Error, bool, std::size_t>>;
+	{ t.detachHeader() } -> std::same_as<Error>;
+};
+
+// Messages whose body can be handed out piece by piece straight from the read buffer.
+// export
+template <typename T>
+concept StreamBodyMessageLike = MessageLike<T> && requires(
+	T t,
+	std::span<std::byte> in
+) {
+	{ t.consumeBodyInPlace(in) } -> std::same_as<std::tuple<Error, bool, std::size_t, std::span<const std::byte>>>;
+};
+
+// Messages whose body may come from an Http::BodyStream while it is written, framed with
+// chunked coding when chunked() says so and otherwise delimited by closing the connection.
+// export
+template <typename T>
+concept StreamMessageLike = MessageLike<T> && requires(T t) {
+	{ t.stream() } -> std::same_as<Http::BodyStream*>;
+	{ t.chunked() } -> std::same_as<bool>;
+};
+
+// Messages whose body may be a file range, sent from the descriptor after the gathered header.
+// export
+template <typename T>
+concept FileMessageLike = GatherMessageLike<T> && requires(T t) {
+	{ t.file() } -> std::same_as<const Http::FileRange*>;
+};
+
+// Messages whose body may be a list of parts, each a header followed by shared bytes or a file
+// range, as a multipart/byteranges response is.
+// export
+template <typename T>
+concept PartsMessageLike = GatherMessageLike<T> && requires(T t) {
+	{ t.parts() } -> std::same_as<std::span<const Http::BodyPart>>;
+};
+
+// Adapts producer to an Http::BodyStream. producer takes the span to fill and returns
+// std::tuple<Error, std::size_t, bool>, the bytes written and whether that was the last piece,
+// either directly or as an asio::awaitable that is run on executor.
+// export
+template <typename Producer>
+class BodyStreamAdapter final : public Http::BodyStream {
+	using Result = std::tuple<Error, std::size_t, bool>;
+	asio::any_io_executor executor_;
+	Producer producer_;
+public:
+	BodyStreamAdapter(asio::any_io_executor executor, Producer producer):
+		executor_(std::move(executor)), producer_(std::move(producer)) {}
+
+	void pull(std::span<std::byte> out, Done done) override {
+		if constexpr (std::same_as<std::invoke_result_t<Producer&, std::span<std::byte>>, asio::awaitable<Result>>) {
+			asio::co_spawn(executor_, producer_(out), [done](std::exception_ptr e, Result result){
+				if(e) done(Error{ErrorCode::PRODUCER_ERROR}, 0, true);
+				else std::apply(done, result);
+			});
+		} else {
+			std::apply(done, producer_(out));
+		}
+	}
+};
+
+// export
+template <typename Producer>
+std::unique_ptr<Http::BodyStream> makeBodyStream(asio::any_io_executor executor, Producer producer){
+	return std::make_unique<BodyStreamAdapter<Producer>>(std::move(executor), std::move(producer));
+}
+
+// export
+enum class Transport { REACTOR, IO_URING };
+
+// How long a connection may take, each enforced by a deadline on the TimerWheel of its thread
+// that cancels the read or write in flight. Zero is no limit.
+// export
+struct Timeouts{
+	// for the first byte of the next message
+	std::chrono::steady_clock::duration idle = std::chrono::seconds(60);
+	// from the first byte of a header to its end, however it trickles in
+	std::chrono::steady_clock::duration header = std::chrono::seconds(10);
+	// for each next piece of a body
+	std::chrono::steady_clock::duration body = std::chrono::seconds(30);
+	// for each write, a streamed or file body is written in pieces
+	std::chrono::steady_clock::duration write = std::chrono::seconds(30);
+};
+
+class Connection;
+
+// The connections of this thread that wait for their next message, and whether the server is
+// draining. Once it is, a connection takes no message that has not begun to arrive, and those
+// waiting are ended by shutting down their read side: bytes already received are still read and
+// answered, and responses can still be written. Every io_context runs on its own thread, so
+// this needs no locking.
+// export
+class Drain{
+	std::vector<Connection*> idle_;
+	bool draining_ = false;
+
+	friend class Connection;
+	void add_(Connection* conn);
+	void remove_(Connection* conn) noexcept;
+public:
+	static Drain& local(){
+		thread_local Drain drain;
+		return drain;
+	}
+
+	bool draining() const noexcept { return draining_; }
+	void start() noexcept;
+};
+
+// An Http::Upgrade the connection loop runs once the 101 went out, with the connection and the
+// request that asked for it, until it returns.
+// export
+class ConnectionUpgrade : public Http::Upgrade {
+public:
+	virtual asio::awaitable<void> run(Connection& conn, const Http::Request& req) = 0;
+};
+
 // export
 class Connection{
 	enum class ReadState { START, READ_HEADER, READ_BODY };
 	enum class WriteState { START, WRITE_HEADER, WRITE_BODY };
 
-	asio::ip::tcp::socket socket_;
-	StaticBuffer<4096> readBuffer_;
-	StaticBuffer<4096> writeBuffer_;
+	std::variant<asio::ip::tcp::socket, UringSocket> socket_;
+	// borrowed from the BufferPool of this io_context only while bytes are in flight
+	PooledBuffer readBuffer_{4096, 65536};
+	PooledBuffer writeBuffer_{4096, 4096};
 	ReadState readState_ = ReadState::START;
 	WriteState writeState_ = WriteState::START;
+	// nothing of the next message has arrived yet, a wait now is an idle one
+	bool awaitingMessage_ = false;
+	// place in Drain::idle_ while waiting idle
+	std::size_t idleIdx_ = std::numeric_limits<std::size_t>::max();
+	bool drained_ = false;
+
+	// The deadlines of the read and the write in flight. On the heap so the timers and signals
+	// stay put when the connection is moved; a connection only moves while nothing is in flight.
+	struct Deadlines_{
+		TimerWheel::Timer read{&Deadlines_::expireRead_, this};
+		TimerWheel::Timer write{&Deadlines_::expireWrite_, this};
+		asio::cancellation_signal readCancel;
+		asio::cancellation_signal writeCancel;
+		// kept apart, so a write that timed out does not fail the read in flight with TIMED_OUT
+		bool readTimedOut = false;
+		bool writeTimedOut = false;
+
+		static void expireRead_(void* ctx){
+			auto* self = static_cast<Deadlines_*>(ctx);
+			self->readTimedOut = true;
+			self->readCancel.emit(asio::cancellation_type::terminal);
+		}
+		static void expireWrite_(void* ctx){
+			auto* self = static_cast<Deadlines_*>(ctx);
+			self->writeTimedOut = true;
+			self->writeCancel.emit(asio::cancellation_type::terminal);
+		}
+	};
+	Timeouts timeouts_;
+	std::unique_ptr<Deadlines_> deadlines_ = std::make_unique<Deadlines_>();
+	// when the header of the message being read must be in
+	std::chrono::steady_clock::time_point headerDeadline_;
+
+	struct Disarm_{
+		TimerWheel::Timer& timer;
+		~Disarm_() { timer.cancel(); }
+	};
+
+	// arms the deadline of the read fill_ is about to wait for
+	void armRead_(){
+		auto& wheel = TimerWheel::local();
+		deadlines_->readTimedOut = false;
+		if(awaitingMessage_){
+			if(timeouts_.idle > std::chrono::steady_clock::duration::zero()) wheel.arm(deadlines_->read, timeouts_.idle);
+		} else if(readState_ == ReadState::READ_HEADER){
+			if(timeouts_.header > std::chrono::steady_clock::duration::zero()) wheel.armAt(deadlines_->read, headerDeadline_);
+		} else if(timeouts_.body > std::chrono::steady_clock::duration::zero()){
+			wheel.arm(deadlines_->read, timeouts_.body);
+		}
+	}
+	void armWrite_(){
+		deadlines_->writeTimedOut = false;
+		if(timeouts_.write > std::chrono::steady_clock::duration::zero()) TimerWheel::local().arm(deadlines_->write, timeouts_.write);
+	}
+	// the first byte of a header is in, from now on it has timeouts_.header to complete
+	void startHeader_(){
+		headerDeadline_ = TimerWheel::local().time() + timeouts_.header;
+	}
+
+	Error readError_(const std::error_code& ec){
+		if(deadlines_->readTimedOut) return ErrorCode::TIMED_OUT;
+		std::println("socket read error: {}", ec.message());
+		return ErrorCode::SOCKET_READ_ERROR;
+	}
+	Error writeError_(const std::error_code& ec){
+		if(deadlines_->writeTimedOut) return ErrorCode::TIMED_OUT;
+		std::println("socket write error: {}", ec.message());
+		return ErrorCode::SOCKET_WRITE_ERROR;
+	}
+
+	friend class Drain;
+	int nativeHandle_(){
+		return std::visit([](auto& s){ return s.native_handle(); }, socket_);
+	}
+	// bytes received and not read yet
+	bool pending_(){
+		int n = 0;
+		return ::ioctl(nativeHandle_(), FIONREAD, &n) == 0 && n > 0;
+	}
+	void endIdle_() noexcept {
+		drained_ = true;
+		::shutdown(nativeHandle_(), SHUT_RD);
+	}
+
+	// socket operations are bound to the signal their deadline cancels them with
+	auto readToken_(){
+		return asio::bind_cancellation_slot(deadlines_->readCancel.slot(), asio::as_tuple(asio::use_awaitable));
+	}
+	auto writeToken_(){
+		return asio::bind_cancellation_slot(deadlines_->writeCancel.slot(), asio::as_tuple(asio::use_awaitable));
+	}
+	template <typename MutableBufferSequence>
+	auto readSome_(const MutableBufferSequence& buffers){
+		return std::visit([&](auto& s){ return s.async_read_some(buffers, readToken_()); }, socket_);
+	}
+	auto waitReadable_(){
+		return std::visit([&](auto& s){ return s.async_wait(asio::socket_base::wait_read, readToken_()); }, socket_);
+	}
+	template <typename ConstBufferSequence>
+	auto writeSome_(const ConstBufferSequence& buffers){
+		return std::visit([&](auto& s){ return s.async_write_some(buffers, writeToken_()); }, socket_);
+	}
+	template <typename ConstBufferSequence>
+	auto writeAll_(const ConstBufferSequence& buffers){
+		return std::visit([&](auto& s){ return asio::async_write(s, buffers, writeToken_()); }, socket_);
+	}
+
+	asio::any_io_executor executor_(){
+		return std::visit([](auto& s) -> asio::any_io_executor { return s.get_executor(); }, socket_);
+	}
+
+	static constexpr std::size_t maxGatherBuffers_ = 8;
+
+	std::vector<asio::const_buffer> gatherBuffers_;
+
+	template <GatherMessageLike M>
+	Error gather_(M& msg){
+		std::array<std::span<const std::byte>, maxGatherBuffers_> spans;
+		auto [err, count] = msg.produceBuffers(spans);
+		if(err) return err;
+		for(std::size_t i = 0; i < count; ++i) gatherBuffers_.push_back(asio::buffer(spans[i]));
+		return {};
+	}
+
+	asio::awaitable<Error> writeGathered_(){
+		writeState_ = WriteState::WRITE_BODY;
+		armWrite_();
+		auto [ec, n] = co_await writeAll_(gatherBuffers_);
+		deadlines_->write.cancel();
+		writeState_ = WriteState::START;
+		gatherBuffers_.clear();
+		if(ec) co_return writeError_(ec);
+		co_return Error{};
+	}
+
+	// Feeds the buffered bytes to msg without touching the socket, returns whether msg is complete,
+	// or with headerOnly whether its header is. The body is fed even from an empty buffer so a
+	// message without one completes right away.
+	template <MessageLike M>
+	std::tuple<Error, bool> consumeBuffered_(M& msg, bool headerOnly){
+		for(;;){
+			if(readState_ == ReadState::READ_HEADER){
+				if(readBuffer_.empty()) return {Error{}, false};
+				if constexpr (InPlaceMessageLike<M>) {
+					auto [err, complete, numBytes] = msg.consumeHeaderInPlace(readBuffer_.readableSpan());
+					if(err) return {err, true};
+					if(!complete) return {Error{}, false}; // nothing consumed, more bytes go behind these
+					readBuffer_.pin();
+					readBuffer_.consume(numBytes);
+				} else {
+					auto [err, complete, numBytes] = msg.consumeHeaderSome(readBuffer_.readableSpan());
+					if(err) return {err, true};
+					readBuffer_.consume(numBytes);
+					if(!complete) continue;
+				}
+				readState_ = ReadState::READ_BODY;
+			}
+			if(headerOnly) return {Error{}, true};
+
+			auto [err, complete, numBytes] = msg.consumeBodySome(readBuffer_.readableSpan());
+			if(err) return {err, true};
+			readBuffer_.consume(numBytes);
+			if(complete) {
+				readState_ = ReadState::START;
+				return {Error{}, true};
+			}
+			if(readBuffer_.empty()) return {Error{}, false};
+		}
+	}
+
+	// Makes room in readBuffer_ and reads into it, moving an in-place header out of the way first
+	// when it pins a full buffer.
+	template <MessageLike M>
+	asio::awaitable<Error> fill_(M& msg){
+		armRead_();
+		Disarm_ disarm{deadlines_->read};
+		if(readBuffer_.empty()){
+			// wait for the peer without holding a buffer, an idle socket pins no memory
+			readBuffer_.release();
+			bool idle = awaitingMessage_;
+			auto& drain = Drain::local();
+			if(idle && drain.draining() && !pending_()){
+				drained_ = true;
+				co_return Error{ErrorCode::CONNECTION_ENDED};
+			}
+			if(idle) drain.add_(this);
+			auto [ec] = co_await waitReadable_();
+			if(idle) drain.remove_(this);
+			if(ec) co_return readError_(ec);
+		}
+
+		auto writable = readBuffer_.prepare();
+		if constexpr (InPlaceMessageLike<M>) {
+			if(writable.empty() && readBuffer_.pinned()){
+				// the header views are in the way of the body, move the header into the message
+				auto err = msg.detachHeader();
+				if(err) co_return err;
+				readBuffer_.unpin();
+				writable = readBuffer_.prepare();
+			}
+		}
+		if(writable.empty()) co_return Error{ErrorCode::INVALID_MESSAGE}; // message does not fit the largest buffer
+		auto [ec, n] = co_await readSome_(asio::buffer(writable));
+		if(ec || n == 0) {
+			if(n == 0) co_return Error{ErrorCode::CONNECTION_ENDED};
+			co_return readError_(ec);
+		}
+		readBuffer_.commit(n);
+		if(awaitingMessage_) startHeader_();
+		awaitingMessage_ = false;
+		co_return Error{};
+	}
+
+	template <MessageLike M>
+	asio::awaitable<Error> read_(M& msg, bool headerOnly){
+		if(readState_ == ReadState::START) {
+			readBuffer_.unpin(); // the previous message is done with its views
+			readState_ = ReadState::READ_HEADER;
+			awaitingMessage_ = readBuffer_.empty();
+			if(!awaitingMessage_) startHeader_();
+		}
+
+		for(;;){
+			if(!readBuffer_.empty() || readState_ == ReadState::READ_BODY){
+				auto [err, complete] = consumeBuffered_(msg, headerOnly);
+				if(err) co_return err;
+				if(complete) {
+					readBuffer_.release();
+					co_return Error{};
+				}
+			}
+
+			auto err = co_await fill_(msg);
+			if(err) co_return err;
+		}
+	}
+
+	template <MessageLike M>
+	std::tuple<Error, bool> readBuffered_(M& msg, bool headerOnly){
+		if(readState_ == ReadState::START){
+			readBuffer_.unpin();
+			if(readBuffer_.empty()) return {Error{}, false};
+			readState_ = ReadState::READ_HEADER;
+			awaitingMessage_ = false;
+			startHeader_();
+		}
+		auto ret = consumeBuffered_(msg, headerOnly);
+		readBuffer_.release();
+		return ret;
+	}
+
+	// The pull in flight reports through pullDone_, which always posts the completion: the stream
+	// may answer from inside pull(), where the awaiting coroutine must not be resumed from its own
+	// call, or from another thread, which cannot tell it apart without racing with this one.
+	asio::any_completion_handler<void(Error, std::size_t, bool)> pullHandler_;
+
+	static void pullDone_(void* ctx, Error err, std::size_t size, bool last){
+		auto* self = static_cast<Connection*>(ctx);
+		auto handler = std::move(self->pullHandler_);
+		self->pullHandler_ = {};
+		asio::post(self->executor_(), asio::append(std::move(handler), err, size, last));
+	}
+
+	template <typename CompletionToken>
+	auto pull_(Http::BodyStream& stream, std::span<std::byte> out, CompletionToken&& token){
+		return asio::async_initiate<CompletionToken, void(Error, std::size_t, bool)>(
+			[this, &stream, out](auto handler){
+				pullHandler_ = std::move(handler);
+				stream.pull(out, {&Connection::pullDone_, this});
+			},
+			token
+		);
+	}
+
+	static constexpr std::size_t streamBlockSize_ = 16384;
+	// the least room worth pulling into, with less the block is written out first
+	static constexpr std::size_t minStreamPiece_ = 512;
+
+	asio::awaitable<Error> writeBlock_(PoolBlock& block, std::size_t& used){
+		armWrite_();
+		auto [ec, n] = co_await writeAll_(asio::buffer(block.data(), used));
+		deadlines_->write.cancel();
+		used = 0;
+		if(ec) co_return writeError_(ec);
+		co_return Error{};
+	}
+
+	// Writes the header of msg, then one piece of the body per pull, each written before the next
+	// is pulled. A pooled block holds the piece together with its chunk framing.
+	template <StreamMessageLike M>
+	asio::awaitable<Error> writeStream_(M& msg, Http::BodyStream& stream){
+		writeState_ = WriteState::WRITE_HEADER;
+		PoolBlock block{streamBlockSize_};
+		std::size_t used = 0;
+		// the header stays in the block and leaves with the first piece
+		for(bool complete = false; !complete;){
+			auto [err, done, n] = msg.produceHeaderSome(block.span().subspan(used));
+			if(err) co_return err;
+			used += n;
+			complete = done;
+			if(!complete){
+				err = co_await writeBlock_(block, used);
+				if(err) co_return err;
+			}
+		}
+
+		writeState_ = WriteState::WRITE_BODY;
+		const bool chunked = msg.chunked();
+		const std::size_t framing = chunked ? Http::Chunk::headerSize + Http::Chunk::trailer.size() + Http::Chunk::last.size() : 0;
+		for(bool last = false; !last;){
+			auto space = block.span().subspan(used);
+			if(space.size() < framing + minStreamPiece_){
+				auto err = co_await writeBlock_(block, used);
+				if(err) co_return err;
+				continue;
+			}
+
+			auto out = chunked ? space.subspan(Http::Chunk::headerSize, space.size() - framing) : space;
+			auto [err, n, isLast] = co_await pull_(stream, out, asio::as_tuple(asio::use_awaitable));
+			if(err) co_return err;
+			last = isLast;
+			if(chunked){
+				// an empty chunk would end the body, a piece without bytes just sends nothing
+				if(n > 0){
+					Http::Chunk::writeHeader(space, n);
+					std::memcpy(out.data() + n, Http::Chunk::trailer.data(), Http::Chunk::trailer.size());
+					used += Http::Chunk::headerSize + n + Http::Chunk::trailer.size();
+				}
+				if(last){
+					std::memcpy(block.data() + used, Http::Chunk::last.data(), Http::Chunk::last.size());
+					used += Http::Chunk::last.size();
+				}
+			} else {
+				used += n;
+			}
+
+			if(used > 0){
+				err = co_await writeBlock_(block, used);
+				if(err) co_return err;
+			}
+		}
+		writeState_ = WriteState::START;
+		co_return Error{};
+	}
+	// largest piece handed to one sendfile() call, so one big file does not hog the thread
+	static constexpr std::size_t maxSendfileSize_ = 1 << 20;
+
+	// Sends range with sendfile() on a reactor socket, waiting for room whenever the socket is
+	// full. The io_uring transport has no readiness wait for writing, so there the file is read
+	// into a pooled block and written from that instead.
+	asio::awaitable<Error> writeFile_(const Http::FileRange& range){
+		writeState_ = WriteState::WRITE_BODY;
+		off_t offset = static_cast<off_t>(range.offset);
+		std::uint64_t remaining = range.length;
+		if(auto* socket = std::get_if<asio::ip::tcp::socket>(&socket_)){
+			if(!socket->native_non_blocking()){
+				std::error_code ec;
+				socket->native_non_blocking(true, ec);
+				if(ec) co_return Error{ErrorCode::SOCKET_WRITE_ERROR};
+			}
+			while(remaining > 0){
+				ssize_t n = ::sendfile(socket->native_handle(), range.file->fd(), &offset, std::min<std::uint64_t>(remaining, maxSendfileSize_));
+				if(n > 0){
+					remaining -= static_cast<std::uint64_t>(n);
+					continue;
+				}
+				if(n < 0 && errno == EINTR) continue;
+				if(n < 0 && errno == EAGAIN){
+					armWrite_();
+					auto [ec] = co_await socket->async_wait(asio::socket_base::wait_write, writeToken_());
+					deadlines_->write.cancel();
+					if(ec) co_return writeError_(ec);
+					continue;
+				}
+				// the file shrank under us or the socket failed, the promised length cannot be kept
+				co_return Error{ErrorCode::SOCKET_WRITE_ERROR};
+			}
+		} else {
+			PoolBlock block{streamBlockSize_};
+			while(remaining > 0){
+				ssize_t n = ::pread(range.file->fd(), block.data(), std::min<std::uint64_t>(remaining, block.size()), offset);
+				if(n < 0 && errno == EINTR) continue;
+				if(n <= 0) co_return Error{ErrorCode::SOCKET_WRITE_ERROR};
+				std::size_t used = static_cast<std::size_t>(n);
+				auto err = co_await writeBlock_(block, used);
+				if(err) co_return err;
+				offset += n;
+				remaining -= static_cast<std::uint64_t>(n);
+			}
+		}
+		writeState_ = WriteState::START;
+		co_return Error{};
+	}
+
+	// Queues parts behind what is gathered already. Before a file part everything up to it is
+	// written, so the range follows in order; what comes after the last file part stays gathered.
+	asio::awaitable<Error> gatherParts_(std::span<const Http::BodyPart> parts){
+		for(const auto& part : parts){
+			gatherBuffers_.push_back(asio::buffer(part.header));
+			if(part.file.file){
+				auto err = co_await writeGathered_();
+				if(!err) err = co_await writeFile_(part.file);
+				if(err) co_return err;
+			} else if(!part.bytes.empty()){
+				gatherBuffers_.push_back(asio::buffer(part.bytes.span()));
+			}
+		}
+		co_return Error{};
+	}
 public:
 	explicit Connection(asio::ip::tcp::socket&& socket): socket_(std::move(socket)) {}
+	explicit Connection(UringSocket&& socket): socket_(std::move(socket)) {}
 
 	Connection(const Connection&) = delete;
 	Connection& operator=(const Connection&) = delete;
 	Connection(Connection&&) noexcept = default;
 	Connection& operator=(Connection&&) noexcept = default;
+	// a connection is only ever moved while it does not wait, so never while in Drain::idle_
+	~Connection(){
+		if(idleIdx_ != std::numeric_limits<std::size_t>::max()) Drain::local().remove_(this);
+	}
+
+	asio::any_io_executor executor(){
+		return executor_();
+	}
+
+	// from the next read or write on, e.g. longer idle time for a WebSocket
+	void timeouts(const Timeouts& timeouts) noexcept { timeouts_ = timeouts; }
+	const Timeouts& timeouts() const noexcept { return timeouts_; }
 
+	// whether the server is draining, a response should then close the connection
+	bool draining() const noexcept { return Drain::local().draining(); }
+	// whether the drain ended this connection while it waited for its next message
+	bool drained() const noexcept { return drained_; }
+	// nothing of the next message has arrived, e.g. when a read failed with TIMED_OUT because the
+	// peer stayed idle; reading again then waits for that message afresh
+	bool awaitingMessage() const noexcept { return awaitingMessage_; }
+
+	// Ends the connection both ways without closing the descriptor, so a read or write in flight
+	// on either transport completes, with end of stream or an error.
+	void shutdown() noexcept {
+		::shutdown(nativeHandle_(), SHUT_RDWR);
+	}
+
+	// Reads msg, continuing where readBuffered or readHeader left off if it stopped partway.
 	template <MessageLike M>
 	asio::awaitable<Error> read(M& msg){
-		if(readState_ != ReadState::START) co_return Error{ErrorCode::INVALID_STATE};
-		readState_ = ReadState::READ_HEADER;
-
-		bool doneRead = false;
-		while(!doneRead){
-			if(readBuffer_.empty()) {
-				// std::println("readable size: {}", readBuffer_.writableSpan().size());
-				auto [ec, n] = co_await socket_.async_read_some(asio::buffer(readBuffer_.writableSpan()), asio::as_tuple(asio::use_awaitable));
-				if(ec || n == 0) {
-					if(n == 0) co_return Error{ErrorCode::CONNECTION_ENDED};
-					std::println("socket read error: {}", ec.message());
-					co_return Error{ErrorCode::SOCKET_READ_ERROR};
-				}
-				readBuffer_.commit(n);
+		return read_(msg, false);
+	}
 
-				// std::string_view r{reinterpret_cast<const char*>(readBuffer_.readableSpan().data()), readBuffer_.readableSpan().size()};
-				// std::println("read:\n{}", r);
-			}
+	// Parses msg from bytes that already arrived, e.g. the next request of a pipelined batch.
+	// Returns false when more bytes are needed, in which case read(msg) picks up from there.
+	template <MessageLike M>
+	std::tuple<Error, bool> readBuffered(M& msg){
+		return readBuffered_(msg, false);
+	}
 
-			while(!readBuffer_.empty()){
-				if(readState_ == ReadState::READ_HEADER){
-					auto [err, complete, numBytes] = msg.consumeHeaderSome(readBuffer_.readableSpan());
-					if(err) co_return err;
-					readBuffer_.consume(numBytes);
-					if(complete) {
-						readState_ = ReadState::READ_BODY;
-					}
-				}
-				if(readState_ == ReadState::READ_BODY){
-					// std::println("read body");
-					auto [err, complete, numBytes] = msg.consumeBodySome(readBuffer_.readableSpan());
-					if(err) co_return err;
-					readBuffer_.consume(numBytes);
-					if(complete) {
-						readState_ = ReadState::START;
-						doneRead = true;
-						break;
-					}
-				}
-			}
+	// Like read and readBuffered but stop once the header is in. The body is then read with read,
+	// readBuffered or piece by piece with readBodySome.
+	template <MessageLike M>
+	asio::awaitable<Error> readHeader(M& msg){
+		return read_(msg, true);
+	}
+	template <MessageLike M>
+	std::tuple<Error, bool> readBufferedHeader(M& msg){
+		return readBuffered_(msg, true);
+	}
+
+	// Next piece of the body of msg, read after readHeader, and whether it was the last one. The
+	// piece is a view into the read buffer that stays valid until the next read of any kind, so a
+	// body of any size passes through without being held in memory. Once the body is done every
+	// further call gives an empty last piece.
+	template <StreamBodyMessageLike M>
+	asio::awaitable<std::tuple<Error, std::span<const std::byte>, bool>> readBodySome(M& msg){
+		if(readState_ != ReadState::READ_BODY) co_return std::tuple{Error{}, std::span<const std::byte>{}, true};
+		for(;;){
+			auto [err, complete, numBytes, piece] = msg.consumeBodyInPlace(readBuffer_.readableSpan());
+			if(err) co_return std::tuple{err, std::span<const std::byte>{}, true};
+			readBuffer_.consume(numBytes);
+			if(complete) readState_ = ReadState::START;
+			if(complete || !piece.empty()) co_return std::tuple{Error{}, piece, complete};
+
+			err = co_await fill_(msg);
+			if(err) co_return std::tuple{err, std::span<const std::byte>{}, true};
+		}
+	}
+
+	// Reads past whatever is left of the body of msg, e.g. after a handler that stopped early.
+	template <StreamBodyMessageLike M>
+	asio::awaitable<Error> discardBody(M& msg){
+		for(bool last = false; !last;){
+			auto [err, piece, isLast] = co_await readBodySome(msg);
+			if(err) co_return err;
+			last = isLast;
 		}
 		co_return Error{};
 	}
 
+	bool hasBuffered() const noexcept { return !readBuffer_.empty(); }
+
 	template <MessageLike M>
 	asio::awaitable<Error> write(M& msg){
 		if(writeState_ != WriteState::START) co_return Error{ErrorCode::INVALID_STATE};
+
+		if constexpr (StreamMessageLike<M>) {
+			if(auto* stream = msg.stream()) co_return co_await writeStream_(msg, *stream);
+		}
+
+		if constexpr (GatherMessageLike<M>) {
+			auto err = gather_(msg);
+			if(err) {
+				gatherBuffers_.clear();
+				co_return err;
+			}
+			if constexpr (PartsMessageLike<M>) {
+				if(auto parts = msg.parts(); !parts.empty()){
+					err = co_await gatherParts_(parts);
+					if(err) {
+						gatherBuffers_.clear();
+						co_return err;
+					}
+				}
+			}
+			err = co_await writeGathered_();
+			if constexpr (FileMessageLike<M>) {
+				if(auto* file = msg.file(); file && !err) err = co_await writeFile_(*file);
+			}
+			co_return err;
+		}
+
 		writeState_ = WriteState::WRITE_HEADER;
 
 		bool doneWrite = false;
 		while (!doneWrite) {
 			// Fill write buffer until either header/body complete or buffer full
-			while (writeBuffer_.writableSpan().size() > 0) {
+			while (writeBuffer_.prepare().size() > 0) {
 				if (writeState_ == WriteState::WRITE_HEADER){
 					auto [err, complete, numBytes] = msg.produceHeaderSome(writeBuffer_.writableSpan());
 					if(err) co_return err;
@@ -130,16 +756,97 @@ public:
 				// std::print("\n");
 
 				// std::println("writeBuf readableSpan: {}", writeBuffer_.readableSpan().size());
-				auto [ec, n] = co_await socket_.async_write_some(asio::buffer(writeBuffer_.readableSpan()), asio::as_tuple(asio::use_awaitable));
+				armWrite_();
+				auto [ec, n] = co_await writeSome_(asio::buffer(writeBuffer_.readableSpan()));
+				deadlines_->write.cancel();
 				if(ec || n == 0) {
 					if(n == 0) co_return Error{ErrorCode::CONNECTION_ENDED};
-					std::println("socket write error: {}", ec.message());
-					co_return Error{ErrorCode::SOCKET_WRITE_ERROR};
+					co_return writeError_(ec);
 				}
 				// std::println("writable: {}, written: {}", writeBuffer_.readableSpan().size(), n);
 				writeBuffer_.consume(n);
 			}
 		}
+		writeBuffer_.release();
 		co_return Error{};
 	}
+
+	// Writes a batch of responses, e.g. for pipelined requests, with one gathered write in order.
+	// A streamed or file body splits the batch: what came before it is written first, a file's
+	// header goes out together with that. Parts from files split it the same way.
+	template <GatherMessageLike M>
+	asio::awaitable<Error> write(std::span<M> msgs){
+		if(writeState_ != WriteState::START) co_return Error{ErrorCode::INVALID_STATE};
+		for(auto& msg : msgs){
+			if constexpr (StreamMessageLike<M>) {
+				if(auto* stream = msg.stream()){
+					if(!gatherBuffers_.empty()){
+						auto err = co_await writeGathered_();
+						if(err) co_return err;
+					}
+					auto err = co_await writeStream_(msg, *stream);
+					if(err) co_return err;
+					continue;
+				}
+			}
+			auto err = gather_(msg);
+			if(err) {
+				gatherBuffers_.clear();
+				co_return err;
+			}
+			if constexpr (PartsMessageLike<M>) {
+				if(auto parts = msg.parts(); !parts.empty()){
+					err = co_await gatherParts_(parts);
+					if(err) {
+						gatherBuffers_.clear();
+						co_return err;
+					}
+				}
+			}
+			if constexpr (FileMessageLike<M>) {
+				if(auto* file = msg.file()){
+					err = co_await writeGathered_();
+					if(!err) err = co_await writeFile_(*file);
+					if(err) co_return err;
+				}
+			}
+		}
+		if(gatherBuffers_.empty()) co_return Error{};
+		co_return co_await writeGathered_();
+	}
+};
+
+inline void Drain::add_(Connection* conn){
+	conn->idleIdx_ = idle_.size();
+	idle_.push_back(conn);
+}
+inline void Drain::remove_(Connection* conn) noexcept {
+	auto idx = std::exchange(conn->idleIdx_, std::numeric_limits<std::size_t>::max());
+	// a connection left waiting when its io_context was stopped is destroyed on another thread
+	if(idx >= idle_.size() || idle_[idx] != conn) return;
+	idle_[idx] = idle_.back();
+	idle_[idx]->idleIdx_ = idx;
+	idle_.pop_back();
+}
+inline void Drain::start() noexcept {
+	draining_ = true;
+	// the waits complete with the end of stream and take the connections off the list
+	for(auto* conn : idle_) conn->endIdle_();
+}
+
+// The body of one request for a handler that streams it, see Connection::readBodySome.
+// export
+template <StreamBodyMessageLike M>
+class BodyReader{
+	Connection& conn_;
+	M& msg_;
+public:
+	BodyReader(Connection& conn, M& msg) noexcept: conn_(conn), msg_(msg) {}
+
+	asio::awaitable<std::tuple<Error, std::span<const std::byte>, bool>> next(){
+		return conn_.readBodySome(msg_);
+	}
+	asio::awaitable<Error> discard(){
+		return conn_.discardBody(msg_);
+	}
 };
@@ -12,6 +12,10 @@ enum class ErrorCode{
 	SOCKET_READ_ERROR,
 	SOCKET_WRITE_ERROR,
 	CONNECTION_ENDED,
+	PRODUCER_ERROR,
+	BODY_TOO_LARGE,
+	COMPRESSION_ERROR,
+	TIMED_OUT,
 
 	NO_ERROR,
 	_count
@@ -25,6 +29,10 @@ static constexpr std::array<std::string_view, static_cast<std::size_t>(ErrorCode
 	"Socket Read Error",
 	"Socket Write Error",
 	"Connection Ended",
+	"Producer Error",
+	"Body Too Large",
+	"Compression Error",
+	"Timed Out",
 
 	"No Error"
 };
@@ -40,4 +48,5 @@ public:
 		return _ErrorCodeStr[idx];
 	}
 	explicit operator bool() const noexcept { return ec_.has_value(); }
+	bool operator==(ErrorCode ec) const noexcept { return ec_ == ec; }
 };
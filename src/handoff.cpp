@@ -0,0 +1,259 @@
+module;
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+export module handoff;
+
+import std;
+import error;
+
+// Passing listening sockets from a running server to its successor over a Unix socket, with
+// SCM_RIGHTS. The successor gets the very sockets the kernel queues connections on, so nothing
+// waiting in an accept queue is lost and the port is never unbound in between. Only a process
+// of the same user gets them: the socket is in a directory of that user, readable by no one else,
+// and the peer's credentials are checked before anything is sent. The old server keeps accepting
+// on them until the successor acknowledges that it does too, so a successor that dies on start
+// leaves nobody behind to drain.
+
+static constexpr std::size_t maxDescriptors_ = 256;
+
+static bool address_(std::string_view path, sockaddr_un& addr) noexcept {
+	addr = {};
+	addr.sun_family = AF_UNIX;
+	if(path.empty() || path.size() >= sizeof(addr.sun_path)) return false;
+	std::memcpy(addr.sun_path, path.data(), path.size());
+	return true;
+}
+
+// waits for the byte Taken::ack sends, EOF if the successor went away first
+static bool awaitAck_(int socket) noexcept {
+	char ack;
+	ssize_t n;
+	do n = ::recv(socket, &ack, 1, 0);
+	while(n < 0 && errno == EINTR);
+	return n == 1;
+}
+
+export
+namespace Handoff {
+	// Where to offer the sockets as name: in $XDG_RUNTIME_DIR, or else in a /tmp/co_server-<uid>
+	// directory created with mode 0700. A directory that someone else owns, or that others may
+	// enter, is refused.
+	std::tuple<Error, std::string> privatePath(std::string_view name){
+		std::string dir;
+		if(const char* runtime = std::getenv("XDG_RUNTIME_DIR"); runtime && *runtime) dir = runtime;
+		else{
+			dir = std::format("/tmp/co_server-{}", ::geteuid());
+			if(::mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) return {ErrorCode::INVALID_STATE, {}};
+		}
+		struct stat st;
+		if(::lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != ::geteuid() || (st.st_mode & 077))
+			return {ErrorCode::INVALID_STATE, {}};
+		return {Error{}, std::format("{}/{}", dir, name)};
+	}
+
+	// Sends fds over the connected Unix socket, with their count as the payload.
+	Error send(int socket, std::span<const int> fds) noexcept {
+		if(fds.size() > maxDescriptors_) return ErrorCode::INVALID_STATE;
+		std::uint32_t count = static_cast<std::uint32_t>(fds.size());
+		iovec iov{&count, sizeof(count)};
+		std::vector<std::byte> control(CMSG_SPACE(sizeof(int) * std::max<std::size_t>(fds.size(), 1)));
+		msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		if(!fds.empty()){
+			msg.msg_control = control.data();
+			msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+			cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+			std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+		}
+		for(;;){
+			ssize_t n = ::sendmsg(socket, &msg, MSG_NOSIGNAL);
+			if(n < 0 && errno == EINTR) continue;
+			if(n != static_cast<ssize_t>(sizeof(count))) return ErrorCode::SOCKET_WRITE_ERROR;
+			return {};
+		}
+	}
+
+	// Receives what send() sent. The descriptors are the caller's to close.
+	std::tuple<Error, std::vector<int>> receive(int socket) noexcept {
+		std::uint32_t count = 0;
+		iovec iov{&count, sizeof(count)};
+		alignas(cmsghdr) std::array<std::byte, CMSG_SPACE(sizeof(int) * maxDescriptors_)> control;
+		msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.data();
+		msg.msg_controllen = control.size();
+		ssize_t n;
+		do n = ::recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+		while(n < 0 && errno == EINTR);
+		if(n != static_cast<ssize_t>(sizeof(count))) return {ErrorCode::SOCKET_READ_ERROR, {}};
+
+		std::vector<int> fds;
+		for(cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+			if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+			std::size_t received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			std::size_t at = fds.size();
+			fds.resize(at + received);
+			std::memcpy(fds.data() + at, CMSG_DATA(cmsg), received * sizeof(int));
+		}
+		if((msg.msg_flags & MSG_CTRUNC) || fds.size() != count){
+			for(int fd : fds) ::close(fd);
+			return {ErrorCode::INVALID_MESSAGE, {}};
+		}
+		return {Error{}, std::move(fds)};
+	}
+
+	// The successor's end of a handoff: the listening sockets it took, and the connection to the
+	// server that had them, which goes on accepting until ack(). Dropped without an ack, the old
+	// server keeps the sockets to itself and offers them again.
+	class Taken{
+		int socket_ = -1;
+	public:
+		std::vector<int> fds;
+
+		Taken() = default;
+		Taken(int socket, std::vector<int> fds) noexcept: socket_(socket), fds(std::move(fds)) {}
+		Taken(Taken&& other) noexcept: socket_(std::exchange(other.socket_, -1)), fds(std::move(other.fds)) {}
+		Taken& operator=(Taken&& other) noexcept {
+			if(this != &other){
+				if(socket_ >= 0) ::close(socket_);
+				socket_ = std::exchange(other.socket_, -1);
+				fds = std::move(other.fds);
+			}
+			return *this;
+		}
+		~Taken() { if(socket_ >= 0) ::close(socket_); }
+
+		// Tells the old server that fds are accepted on here, it drains from then on.
+		Error ack() noexcept {
+			if(socket_ < 0) return ErrorCode::INVALID_STATE;
+			char ack = 1;
+			ssize_t n;
+			do n = ::send(socket_, &ack, 1, MSG_NOSIGNAL);
+			while(n < 0 && errno == EINTR);
+			::close(socket_);
+			socket_ = -1;
+			if(n != 1) return ErrorCode::SOCKET_WRITE_ERROR;
+			return {};
+		}
+	};
+
+	// The listening sockets of the server that offers them on path, none when nothing answers
+	// there, e.g. on a first start.
+	std::tuple<Error, Taken> take(std::string_view path) noexcept {
+		sockaddr_un addr;
+		if(!address_(path, addr)) return {ErrorCode::INVALID_STATE, Taken{}};
+		int socket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(socket < 0) return {ErrorCode::SOCKET_READ_ERROR, Taken{}};
+		if(::connect(socket, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0){
+			::close(socket);
+			return {ErrorCode::CONNECTION_ENDED, Taken{}};
+		}
+		auto [err, fds] = receive(socket);
+		if(err){
+			::close(socket);
+			return {err, Taken{}};
+		}
+		return {Error{}, Taken{socket, std::move(fds)}};
+	}
+
+	// A Unix socket on path where a successor asks for the listening sockets. A file left on path,
+	// by this server's predecessor or a crashed one, is replaced; the file is not removed again,
+	// by then it may be the successor's.
+	class Offer{
+		std::string path_;
+		// guards the sockets against stop() from another thread
+		std::mutex mutex_;
+		int socket_ = -1;
+		// the successor waited on for its ack
+		int peer_ = -1;
+		bool stopped_ = false;
+
+		Error bind_() noexcept {
+			sockaddr_un addr;
+			if(!address_(path_, addr)) return ErrorCode::INVALID_STATE;
+			close_();
+			socket_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			if(socket_ < 0) return ErrorCode::SOCKET_READ_ERROR;
+			::unlink(addr.sun_path);
+			// nobody can connect before listen(), the file is private by then whatever the umask
+			if(::bind(socket_, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0
+				|| ::chmod(addr.sun_path, 0600) != 0 || ::listen(socket_, 1) != 0){
+				close_();
+				return ErrorCode::SOCKET_READ_ERROR;
+			}
+			return {};
+		}
+		void close_() noexcept {
+			if(socket_ >= 0) ::close(socket_);
+			socket_ = -1;
+		}
+	public:
+		Offer() = default;
+		Offer(const Offer&) = delete;
+		Offer& operator=(const Offer&) = delete;
+		~Offer() { close(); }
+
+		Error open(std::string_view path) noexcept {
+			std::lock_guard lock{mutex_};
+			path_ = path;
+			stopped_ = false;
+			return bind_();
+		}
+
+		// Blocks until a successor connects, takes fds and acknowledges that it accepts on them; a
+		// peer running as another user gets nothing. A successor that goes away before its ack may
+		// have replaced the file on path already, the offer is made there again for the next one.
+		// Fails with CONNECTION_ENDED once stop() was called, from any thread.
+		Error serve(std::span<const int> fds) noexcept {
+			for(;;){
+				int peer = ::accept4(socket_, nullptr, nullptr, SOCK_CLOEXEC);
+				if(peer < 0){
+					if(errno == EINTR) continue;
+					return ErrorCode::CONNECTION_ENDED;
+				}
+				ucred cred{};
+				socklen_t length = sizeof(cred);
+				if(::getsockopt(peer, SOL_SOCKET, SO_PEERCRED, &cred, &length) != 0 || cred.uid != ::geteuid()){
+					::close(peer);
+					continue;
+				}
+				{
+					std::lock_guard lock{mutex_};
+					if(stopped_){
+						::close(peer);
+						return ErrorCode::CONNECTION_ENDED;
+					}
+					peer_ = peer;
+				}
+				bool acked = !send(peer, fds) && awaitAck_(peer);
+				std::lock_guard lock{mutex_};
+				peer_ = -1;
+				::close(peer);
+				if(acked) return {};
+				if(stopped_) return ErrorCode::CONNECTION_ENDED;
+				if(auto err = bind_()) return err;
+			}
+		}
+
+		// wakes a serve() in progress, also while it waits for an ack
+		void stop() noexcept {
+			std::lock_guard lock{mutex_};
+			stopped_ = true;
+			if(socket_ >= 0) ::shutdown(socket_, SHUT_RDWR);
+			if(peer_ >= 0) ::shutdown(peer_, SHUT_RDWR);
+		}
+
+		void close() noexcept {
+			std::lock_guard lock{mutex_};
+			close_();
+		}
+	};
+};
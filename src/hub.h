@@ -0,0 +1,218 @@
+#pragma once
+
+#include "webSocketConnection.h"
+#include "asio/post.hpp"
+#include "asio/steady_timer.hpp"
+
+import webSocket;
+import broadcast;
+import error;
+import buffer;
+import std;
+
+namespace WebSocket {
+
+// export
+struct HubOptions{
+	QueueLimits queue;
+	// deflate every message of at least deflateMinSize once, for all sockets that take it
+	bool deflate = true;
+	std::size_t deflateMinSize = 128;
+	int deflateLevel = 6;
+};
+
+// Publish/subscribe over WebSocket. A message is serialized once into a Broadcast and posted
+// once to every io_context with subscribers, where it is put on the send queue of each of them
+// without being copied. Subscribers are kept per thread and only ever touched by it, so fanning
+// out takes no locks and no atomics per socket. Slow sockets are handled by the Overflow policy of
+// their queues. The Hub must outlive its subscribers and the io_contexts they run on.
+// export
+class Hub{
+public:
+	class Subscriber;
+
+	struct Stats{
+		std::uint64_t published = 0;
+		std::uint64_t queued = 0;
+		std::uint64_t coalesced = 0;
+		std::uint64_t dropped = 0;
+		std::uint64_t disconnected = 0;
+	};
+
+private:
+	// the subscribers of one io_context
+	struct Shard_{
+		asio::any_io_executor executor;
+		std::vector<Subscriber*> subscribers;
+	};
+
+	HubOptions options_;
+	// no context takeover, so compressing uses the zlib state of the publishing thread
+	PerMessageDeflate deflate_;
+
+	std::mutex shardsMutex_;
+	std::vector<std::unique_ptr<Shard_>> shards_;
+
+	std::atomic<std::size_t> subscribers_{0};
+	std::atomic<std::uint64_t> published_{0};
+	std::atomic<std::uint64_t> queued_{0};
+	std::atomic<std::uint64_t> coalesced_{0};
+	std::atomic<std::uint64_t> dropped_{0};
+	std::atomic<std::uint64_t> disconnected_{0};
+
+	Shard_& shard_(const asio::any_io_executor& executor){
+		std::lock_guard lock{shardsMutex_};
+		for(auto& shard : shards_)
+			if(shard->executor == executor) return *shard;
+		return *shards_.emplace_back(std::make_unique<Shard_>(executor));
+	}
+
+	// on the thread of shard
+	void deliver_(Shard_& shard, const LocalBroadcast& message);
+
+public:
+	explicit Hub(const HubOptions& options = {}):
+		options_(options), deflate_(Extensions{.deflate = true, .serverContextTakeover = false, .clientContextTakeover = false}, options.deflateLevel) {}
+
+	Hub(const Hub&) = delete;
+	Hub& operator=(const Hub&) = delete;
+
+	// Sends payload to every subscriber, from any thread. Under Overflow::Coalesce a message with
+	// a nonzero key replaces one of the same key that is still queued, e.g. the state of one map
+	// tile superseding the last one.
+	Error publish(Opcode opcode, SharedBuffer payload, std::uint64_t key = 0){
+		auto message = std::make_shared<Broadcast>(opcode, std::move(payload), SharedBuffer{}, key);
+		if(options_.deflate && message->payload.size() >= options_.deflateMinSize){
+			std::vector<std::byte> deflated;
+			auto err = deflate_.compress(message->payload.span(), deflated);
+			if(err) return err;
+			if(deflated.size() < message->payload.size()) message->deflated = SharedBuffer{std::move(deflated)};
+		}
+		published_.fetch_add(1, std::memory_order_relaxed);
+
+		std::shared_ptr<const Broadcast> shared = std::move(message);
+		std::lock_guard lock{shardsMutex_};
+		for(auto& shard : shards_){
+			asio::post(shard->executor, [this, shard = shard.get(), shared]{
+				deliver_(*shard, LocalBroadcast{shared});
+			});
+		}
+		return {};
+	}
+	Error publish(Opcode opcode, std::span<const std::byte> payload, std::uint64_t key = 0){
+		return publish(opcode, SharedBuffer{payload}, key);
+	}
+	Error publish(std::string_view text, std::uint64_t key = 0){
+		return publish(Opcode::Text, std::as_bytes(std::span{text}), key);
+	}
+
+	std::size_t subscribers() const noexcept { return subscribers_.load(std::memory_order_relaxed); }
+	Stats stats() const noexcept {
+		return {
+			published_.load(std::memory_order_relaxed),
+			queued_.load(std::memory_order_relaxed),
+			coalesced_.load(std::memory_order_relaxed),
+			dropped_.load(std::memory_order_relaxed),
+			disconnected_.load(std::memory_order_relaxed),
+		};
+	}
+};
+
+// One subscription to a Hub, made and ended on the thread that takes its messages, typically in
+// the coroutine of a connection. Messages published from then on wait in its SendQueue until
+// next() takes them or run() sends them.
+// export
+class Hub::Subscriber{
+	friend class Hub;
+
+	Hub& hub_;
+	Shard_& shard_;
+	std::size_t index_;
+	SendQueue queue_;
+	// never expires, cancelled to wake next() when a message is queued
+	asio::steady_timer wake_;
+	bool waiting_ = false;
+	bool stopped_ = false;
+
+	PushResult push_(const LocalBroadcast& message){
+		auto result = queue_.push(message);
+		if(waiting_ && (result != PushResult::Dropped)) wake_.cancel();
+		return result;
+	}
+public:
+	// deflate is whether the deflated form of a Broadcast is taken, see Socket::takesShared
+	Subscriber(Hub& hub, asio::any_io_executor executor, bool deflate):
+		hub_(hub), shard_(hub.shard_(executor)), index_(shard_.subscribers.size()),
+		queue_(hub.options_.queue, deflate), wake_(executor, asio::steady_timer::time_point::max())
+	{
+		shard_.subscribers.push_back(this);
+		hub_.subscribers_.fetch_add(1, std::memory_order_relaxed);
+	}
+	explicit Subscriber(Hub& hub, Socket& ws): Subscriber(hub, ws.executor(), ws.takesShared()) {}
+
+	Subscriber(const Subscriber&) = delete;
+	Subscriber& operator=(const Subscriber&) = delete;
+
+	~Subscriber(){
+		auto& list = shard_.subscribers;
+		list[index_] = list.back();
+		list[index_]->index_ = index_;
+		list.pop_back();
+		hub_.subscribers_.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	// The next message, empty once stopped or, under Overflow::Disconnect, once the queue overflowed.
+	asio::awaitable<LocalBroadcast> next(){
+		while(queue_.empty() && !stopped_ && !queue_.overflowed()){
+			waiting_ = true;
+			co_await wake_.async_wait(asio::as_tuple(asio::use_awaitable));
+			waiting_ = false;
+		}
+		if(stopped_ || queue_.overflowed()) co_return LocalBroadcast{};
+		co_return queue_.pop();
+	}
+
+	// Sends the queued messages to ws until stop() or a failed write. A socket that overflowed its
+	// queue under Overflow::Disconnect is terminated, its reader then fails as well.
+	asio::awaitable<Error> run(Socket& ws){
+		for(;;){
+			auto message = co_await next();
+			if(!message){
+				if(!queue_.overflowed()) co_return Error{};
+				ws.terminate();
+				co_return Error{ErrorCode::CONNECTION_ENDED};
+			}
+			bool deflated = message->sendsDeflated(queue_.deflate());
+			Frame frame{message->opcode, deflated ? message->deflated.span() : message->payload.span(), true, deflated};
+			auto err = co_await ws.write(frame);
+			if(err) co_return err;
+		}
+	}
+
+	// ends next() and run(), from the thread of the subscriber
+	void stop() noexcept {
+		stopped_ = true;
+		wake_.cancel();
+	}
+
+	std::size_t queued() const noexcept { return queue_.size(); }
+	std::size_t queuedBytes() const noexcept { return queue_.bytes(); }
+};
+
+inline void Hub::deliver_(Shard_& shard, const LocalBroadcast& message){
+	Stats counts;
+	for(auto* subscriber : shard.subscribers){
+		switch(subscriber->push_(message)){
+		case PushResult::Queued: ++counts.queued; break;
+		case PushResult::Coalesced: ++counts.queued; ++counts.coalesced; break;
+		case PushResult::Dropped: ++counts.dropped; break;
+		case PushResult::Overflowed: ++counts.disconnected; break;
+		}
+	}
+	queued_.fetch_add(counts.queued, std::memory_order_relaxed);
+	coalesced_.fetch_add(counts.coalesced, std::memory_order_relaxed);
+	dropped_.fetch_add(counts.dropped, std::memory_order_relaxed);
+	disconnected_.fetch_add(counts.disconnected, std::memory_order_relaxed);
+}
+
+}
@@ -1,7 +1,13 @@
 #include "glaze/json.hpp"
 
+#include "asio/thread_pool.hpp"
+#include "asio/experimental/awaitable_operators.hpp"
+
 #include "connection.h"
 #include "server.h"
+#include "offload.h"
+#include "webSocketConnection.h"
+#include "hub.h"
 
 #include "gdal.h"
 // import client;
@@ -11,73 +17,337 @@
 // import asio;
 
 import binaryMessage;
+import staticFiles;
+import compression;
+import webSocket;
+import broadcast;
+import handoff;
 
 import std;
 
 import http;
 import error;
-
-// struct Chat{
-// 	std::awaitable<void> add();
-// };
+import buffer;
 
 // import <asio.hpp>
 
 
 struct TestServer{
 	using RetType = asio::awaitable<Http::Response>;
-	Http::Router<RetType(const Http::Request&, std::span<std::byte> resBuffer)> router;
+	using Body = BodyReader<Http::Request>;
+	Http::Router<RetType(const Http::Request&, std::span<std::byte> resBuffer, Body& body)> router;
 
 	std::atomic<int> i{1};
 
+	// header shape shared by the hello routes, formatted once
+	Http::ResponseTemplate okText{Http::Status::OK};
+	// served by every thread without being copied per response
+	SharedBuffer threeBody{std::string_view{"Hello three!"}};
+	// descriptors stay open across requests, bodies go out with sendfile
+	Http::StaticFiles publicFiles{"./public"};
+	// compressed variants of shared bodies are made once, big ones off the I/O threads
+	Http::Compressor compressor;
+	// heavy handlers and compression run here, work-stealing over all cores at a lower priority
+	ComputePool computePool;
+	SharedBuffer indexBody;
+	// map updates go out over /live, one WebSocket per client
+	WebSocket::Options liveOptions;
+	// a client that falls behind skips to the newest updates
+	WebSocket::Hub liveHub;
+
 
 	void addCors(Http::Response& res){
 		res.set("Access-Control-Allow-Origin", "*");
 	}
 
 	TestServer(){
-		router.add("/abc/one/:z/:x/:y", [](auto req, auto resBuffer) -> RetType{
-			Http::Response res{Http::Status::OK, req.version(), resBuffer};
+		okText.set(Http::Field::ContentType, "text/plain");
+		okText.set(Http::Field::Connection, "keep-alive");
+		publicFiles.precompressed(Http::allEncodings);
+
+		std::string index{"["};
+		for(int tile = 0; tile < 4096; ++tile) index += std::format("{}{{\"z\":12,\"x\":{},\"y\":{}}}", tile ? "," : "", tile % 64, tile / 64);
+		index += "]";
+		indexBody = SharedBuffer{std::move(index)};
+
+		router.add(Http::Method::Get, "/abc/one/:z/:x/:y", [this](const auto& req, auto resBuffer, auto&) -> RetType{
+			Http::Response res{okText, req.version(), resBuffer};
 			res.setBody("Hello twooo2234567!");
-			res.set(Http::Field::Connection, "keep-alive");
 
 			co_return res;
 		});
-		router.add("/*/three/*/a/b", [](auto req, auto resBuffer) -> RetType{
+		router.add("/*/three/*/a/b", [this](const auto& req, auto resBuffer, auto&) -> RetType{
+			Http::Response res{okText, req.version(), resBuffer};
+			res.setBody(threeBody);
+
+			co_return res;
+		});
+		router.add(Http::Method::Get, "/stream/:n", [](const auto& req, auto resBuffer, auto&, const Http::RouteParams& params) -> RetType{
+			std::size_t lines = 0;
+			auto n = *params.get("n");
+			std::from_chars(n.data(), n.data() + n.size(), lines);
+
+			Http::Response res{Http::Status::OK, req.version(), resBuffer};
+			res.set(Http::Field::ContentType, "text/plain");
+			// lines are made as the socket takes them, never the whole body at once
+			res.setBody(makeBodyStream(co_await asio::this_coro::executor, [i = std::size_t{0}, lines](std::span<std::byte> out) mutable {
+				static constexpr std::string_view prefix{"line "};
+				auto* p = reinterpret_cast<char*>(out.data());
+				auto* end = p + out.size();
+				while(i < lines && end - p >= 32){
+					std::memcpy(p, prefix.data(), prefix.size());
+					p = std::to_chars(p + prefix.size(), end, i++).ptr;
+					*p++ = '\n';
+				}
+				return std::tuple{Error{}, static_cast<std::size_t>(p - reinterpret_cast<char*>(out.data())), i == lines};
+			}));
+
+			co_return res;
+		});
+		// the body is counted as it arrives instead of being collected first
+		router.add(Http::Method::Post, "/upload", [](const auto& req, auto resBuffer, auto& body) -> RetType{
+			std::size_t received = 0;
+			for(bool last = false; !last;){
+				auto [err, piece, isLast] = co_await body.next();
+				if(err == ErrorCode::BODY_TOO_LARGE){
+					// the rest of the body is never read, so the connection cannot go on after this
+					Http::Response res{Http::Status::PayloadTooLarge, req.version(), resBuffer};
+					res.closeConnection();
+					co_return res;
+				}
+				if(err) co_return Http::Response{Http::Status::BadRequest, req.version(), resBuffer};
+				received += piece.size();
+				last = isLast;
+			}
+
 			Http::Response res{Http::Status::OK, req.version(), resBuffer};
-			res.setBody("Hello three!");
+			res.set(Http::Field::ContentType, "text/plain");
 			res.set(Http::Field::Connection, "keep-alive");
+			res.setBody(std::format("received {} bytes", received));
+			co_return res;
+		}, {.maxBodySize = std::size_t{1} << 32, .streamBody = true});
+		// rendering takes milliseconds of CPU, the connection's thread serves the others meanwhile
+		router.add(Http::Method::Get, "/render/:z/:x/:y", [](const auto& req, auto resBuffer, auto&, const Http::RouteParams& params) -> RetType{
+			int z = 0, x = 0, y = 0;
+			for(auto [name, value] : {std::pair{"z", &z}, std::pair{"x", &x}, std::pair{"y", &y}}){
+				auto param = *params.get(name);
+				std::from_chars(param.data(), param.data() + param.size(), *value);
+			}
+			co_return renderTile(req, resBuffer, std::clamp(z, 0, 30), x, y, params.head());
+		}, {.compute = true});
+		router.add(Http::Method::Get, "/static/*", [this](const auto& req, auto resBuffer, auto&, const Http::RouteParams& params) -> RetType{
+			co_return publicFiles.serve(req, resBuffer, params[0]);
+		});
+		router.add(Http::Method::Get, "/index.json", [this](const auto& req, auto resBuffer, auto&) -> RetType{
+			static constexpr std::string_view type{"application/json"};
+			// ranges are of the uncompressed index, sliced out of the shared body
+			if(auto range = req.get(Http::Field::Range)){
+				auto [status, ranges] = Http::parseRanges(*range, indexBody.size());
+				if(status == Http::RangeStatus::Unsatisfiable){
+					Http::Response res{Http::Status::RangeNotSatisfiable, req.version(), resBuffer};
+					res.set(Http::Field::ContentRange, std::format("bytes */{}", indexBody.size()));
+					co_return res;
+				}
+				if(status == Http::RangeStatus::Satisfiable){
+					Http::Response res{Http::Status::PartialContent, req.version(), resBuffer};
+					res.setBody(indexBody);
+					res.setRanges(ranges, type);
+					co_return res;
+				}
+			}
+			Http::Response res{Http::Status::OK, req.version(), resBuffer};
+			res.set(Http::Field::ContentType, type);
 
+			auto encoding = compressor.select(req, type, indexBody.size());
+			auto encoded = compressor.cached(indexBody, encoding);
+			if(!encoded){
+				auto [err, body] = compressor.shouldOffload(indexBody.size())
+					? co_await offload(computePool.get_executor(), [this, encoding]{ return compressor.encode(indexBody, encoding); })
+					: compressor.encode(indexBody, encoding);
+				if(err) co_return Http::Response{Http::Status::InternalServerError, req.version(), resBuffer};
+				encoded = std::move(body);
+			}
+			Http::Compressor::setBody(res, std::move(*encoded), encoding);
 			co_return res;
 		});
-		router.notFound([](auto req, auto resBuffer) -> RetType{
+		// revalidations of the index only cost the validator
+		router.add(Http::Method::Get, "/version", [this](const auto& req, auto resBuffer, auto&, const Http::RouteParams& params) -> RetType{
+			Http::Response res{okText, req.version(), resBuffer};
+			res.setValidators(params.validators());
+			res.setBody(std::format("index of {} bytes", indexBody.size()));
+			co_return res;
+		}, {.validator = [this](const Http::Request&, const Http::RouteParams&){
+			return Http::Validators{std::format("\"{:x}\"", indexBody.size()), std::nullopt};
+		}});
+		router.add(Http::Method::Get, "/live", [this](const auto& req, auto resBuffer, auto&) -> RetType{
+			co_return WebSocket::accept(req, resBuffer, liveOptions, [this](WebSocket::Socket& ws){ return live(ws); });
+		});
+		router.notFound([](const auto& req, auto resBuffer, auto&) -> RetType{
 			Http::Response res{Http::Status::NotFound, req.version(), resBuffer};
 			res.set(Http::Field::Connection, "keep-alive");
 			// res.setBody("not found");
 
 			co_return res;
 		});
+		router.methodNotAllowed([](const auto& req, auto resBuffer, auto&, const Http::RouteParams& params) -> RetType{
+			Http::Response res{Http::Status::MethodNotAllowed, req.version(), resBuffer};
+			res.set(Http::Field::Allow, params.allow());
+			res.set(Http::Field::Connection, "keep-alive");
+
+			co_return res;
+		});
+		router.precondition([](const auto& req, auto resBuffer, auto&, const Http::RouteParams& params) -> RetType{
+			if(params.precondition() == Http::Precondition::Failed)
+				co_return Http::Response{Http::Status::PreconditionFailed, req.version(), resBuffer};
+			Http::Response res{Http::Status::NotModified, req.version(), resBuffer};
+			res.setValidators(params.validators());
+			co_return res;
+		});
+		router.compile();
 	}
 
 
+	// A 256x256 greyscale tile of the Mandelbrot set as a binary PGM, a stand-in for real
+	// rendering. Its size is known up front, a HEAD gets it without the tile being rendered.
+	static Http::Response renderTile(const Http::Request& req, std::span<std::byte> resBuffer, int z, int x, int y, bool head = false){
+		static constexpr int size = 256;
+		static constexpr int maxIterations = 256;
+		std::string image = std::format("P5 {} {} 255\n", size, size);
+		std::size_t header = image.size();
+		if(head){
+			Http::Response res{Http::Status::OK, req.version(), resBuffer};
+			res.set(Http::Field::ContentType, "image/x-portable-graymap");
+			res.set(Http::Field::ContentLength, std::to_string(header + size * size));
+			return res;
+		}
+		image.resize(header + size * size);
+		double scale = 4.0 / (size * std::ldexp(1.0, z));
+		for(int py = 0; py < size; ++py){
+			for(int px = 0; px < size; ++px){
+				double cr = -2.0 + (static_cast<double>(x) * size + px) * scale;
+				double ci = -2.0 + (static_cast<double>(y) * size + py) * scale;
+				double zr = 0, zi = 0;
+				int i = 0;
+				for(; i < maxIterations && zr * zr + zi * zi <= 4.0; ++i){
+					double t = zr * zr - zi * zi + cr;
+					zi = 2 * zr * zi + ci;
+					zr = t;
+				}
+				image[header + py * size + px] = static_cast<char>(i == maxIterations ? 0 : 255 - i);
+			}
+		}
+		Http::Response res{Http::Status::OK, req.version(), resBuffer};
+		res.set(Http::Field::ContentType, "image/x-portable-graymap");
+		res.setBody(std::move(image));
+		return res;
+	}
+
+	// every message of a client goes to all clients of /live, until it closes
+	asio::awaitable<void> live(WebSocket::Socket& ws){
+		using namespace asio::experimental::awaitable_operators;
+		WebSocket::Hub::Subscriber subscriber{liveHub, ws};
+		co_await (publishLive(ws, subscriber) && subscriber.run(ws));
+	}
+	asio::awaitable<void> publishLive(WebSocket::Socket& ws, WebSocket::Hub::Subscriber& subscriber){
+		for(;;){
+			auto [err, opcode, payload] = co_await ws.read();
+			if(err) break;
+			liveHub.publish(opcode, payload);
+		}
+		subscriber.stop();
+	}
+
+	static constexpr std::size_t maxPipelineDepth = 16;
+	static constexpr std::size_t resHeadSize = 256;
+	static constexpr std::size_t maxHeaderSize = 16384;
+
 	asio::awaitable<void> connect(Connection conn){
 		Error err;
 		std::println("{} connections", i.fetch_add(1));
-		std::array<std::byte, 4096> headBuff;
+		// header storage is borrowed from the pool only while a request or batch is in flight
+		PoolBlock resHeadBuff;
+		std::vector<Http::Response> batch;
+		// requests read and not answered yet, the load admission control looks at
+		Admission::InFlight inFlight;
+
+		auto flush = [&]() -> asio::awaitable<Error> {
+			if(batch.empty()) co_return Error{};
+			auto err = co_await conn.write(std::span{batch});
+			inFlight.done(batch.size());
+			batch.clear();
+			resHeadBuff.reset();
+			co_return err;
+		};
 
 		for(;;){
-			Http::Request req{headBuff};
-			err = co_await conn.read(req);
+			Http::Request req{maxHeaderSize};
+			auto [bufErr, complete] = conn.readBufferedHeader(req);
+			err = bufErr;
 			if(err) break;
+			if(!complete){
+				// nothing more pipelined, answer what we have before waiting on the socket
+				err = co_await flush();
+				if(err) break;
+				err = co_await conn.readHeader(req);
+				if(err) break;
+			}
+			inFlight.add();
 
 			// std::println("method: {}, path: {}, params: {}", req.method(), req.path(), req.params());
 
-			auto res = co_await router.handle(req.path(), req, headBuff);
-			if(!res) break;
-
-			err = co_await conn.write(*res);
+			Http::RouteParams params;
+			const auto* route = router.match(req.methodId(), req.path(), params);
+			if(!route) break;
+			req.maxBodySize(route->options.maxBodySize);
+			if(route->options.streamBody){
+				// the handler waits on the socket for its body, the responses before it go out first
+				err = co_await flush();
+				if(err) break;
+			} else {
+				auto [bodyErr, bodyComplete] = conn.readBuffered(req);
+				err = bodyErr;
+				if(!err && !bodyComplete){
+					err = co_await flush();
+					if(!err) err = co_await conn.read(req);
+				}
+			}
+			if(!resHeadBuff) resHeadBuff = PoolBlock{maxPipelineDepth * resHeadSize};
+			auto resBuff = resHeadBuff.span().subspan(batch.size() * resHeadSize, resHeadSize);
+			if(err == ErrorCode::BODY_TOO_LARGE){
+				// the rest of the body is never read, so the connection cannot go on after this
+				batch.emplace_back(Http::Status::PayloadTooLarge, req.version(), resBuff);
+				batch.back().set(Http::Field::Connection, "close");
+				break;
+			}
 			if(err) break;
+
+			Body body{conn, req};
+			auto dispatched = router.dispatch(*route, params, req, resBuff, body);
+			// this thread serves its other connections while a compute route runs on the pool
+			batch.push_back(route->options.compute
+				? co_await offload(computePool.get_executor(), std::move(dispatched))
+				: co_await std::move(dispatched));
+			if(route->options.streamBody && !batch.back().closeAfter()){
+				// whatever the handler left unread is in front of the next request, if there is one
+				err = co_await body.discard();
+				if(err) break;
+			}
+			if(batch.back().switchingProtocols()){
+				// the connection speaks another protocol from here on, the route said what runs on it
+				auto upgrade = batch.back().takeUpgrade();
+				err = co_await flush();
+				if(auto* session = dynamic_cast<ConnectionUpgrade*>(upgrade.get()); session && !err) co_await session->run(conn, req);
+				break;
+			}
+			// the server is going away, the client is to send its next request elsewhere
+			if(conn.draining()) batch.back().closeConnection();
+			bool close = batch.back().closeAfter();
+			if(batch.size() == maxPipelineDepth || close){
+				err = co_await flush();
+				if(err || close) break;
+			}
 		}
+		if(!batch.empty()) co_await conn.write(std::span{batch});
 
 		if(err) std::println("error: {}", err.what());
 		co_return;
@@ -95,8 +365,19 @@ int main(int argc, char* argv[]){
 
 	TestServer t;
 
+	// a new build takes the listening sockets over from the one running, which then drains
+	auto [pathErr, handoffPath] = Handoff::privatePath("co_server.handoff");
+	Handoff::Taken inherited;
+	if(pathErr) std::println("no handoff: {}", pathErr.what());
+	else inherited = std::get<1>(Handoff::take(handoffPath));
+	if(!inherited.fds.empty()) std::println("took over {} listening sockets", inherited.fds.size());
+
 	auto numThread = std::thread::hardware_concurrency();
-	Server server{"127.0.0.1", 8000, numThread};
+	Server server{"127.0.0.1", 8000, numThread, Transport::REACTOR, std::move(inherited)};
+	if(!pathErr)
+		if(auto err = server.handoffOn(handoffPath)) std::println("no handoff: {}", err.what());
+	// past this a thread answers 503 instead of letting every connection wait longer
+	server.admissionControl({.maxConnectionsPerThread = 20000, .maxInFlight = 4096});
 
 	server.run(t);
 	// server.run(handleConnection);
@@ -8,6 +8,7 @@ export module binaryMessage;
 import msgpack23;
 import std;
 import error;
+import buffer;
 
 export
 template <typename T>
@@ -21,9 +22,17 @@ template <Packable T>
 class BinaryMessage{
 	std::uint64_t length_;
 	std::size_t headIdx_ = 0;
+	std::array<std::byte, sizeof(std::uint64_t)> headOut_;
 
 	std::vector<std::byte> buffer_;
 	std::size_t bodyIdx_ = 0;
+	SharedBuffer shared_; // packed bytes shared with other messages, sent instead of buffer_
+
+	std::span<const std::byte> body_() {
+		if(shared_) return shared_.span();
+		if(buffer_.size() != length_) buffer_.resize(length_);
+		return buffer_;
+	}
 
 	T value_;
 public:
@@ -31,6 +40,9 @@ public:
 	explicit BinaryMessage(const T& val) : value_(val) {}
 	explicit BinaryMessage(T&& val) noexcept(std::is_nothrow_move_constructible_v<T>)
 	: value_(std::move(val)) {}
+	// A message that sends bytes already packed by share(), e.g. one payload to many peers.
+	explicit BinaryMessage(SharedBuffer packed) noexcept
+	: length_(packed.size()), shared_(std::move(packed)) {}
 
 	const T& operator*() const noexcept { return value_; }
 	T& operator*() noexcept { return value_; }
@@ -44,6 +56,7 @@ public:
 		headIdx_ = 0;
 		buffer_.clear();
 		bodyIdx_ = 0;
+		shared_ = {};
 
 		msgpack23::Packer packer{std::back_insert_iterator(buffer_)};
 		try{
@@ -55,6 +68,12 @@ public:
 		length_ = buffer_.size();
 		return {};
 	}
+	// Hands the packed bytes over to a SharedBuffer, which this message then sends from too.
+	SharedBuffer share(){
+		if(!shared_) shared_ = SharedBuffer{std::move(buffer_)};
+		buffer_ = {};
+		return shared_;
+	}
 	Error unpack(){
 		msgpack23::Unpacker unpacker{buffer_};
 		try{
@@ -108,15 +127,28 @@ public:
 		return {{}, finished, numCopy};
 	}
 	std::tuple<Error, bool, std::size_t> produceBodySome(std::span<std::byte> out){
-		if(buffer_.size() != length_) buffer_.resize(length_);
+		auto body = body_();
 		std::size_t remaining = length_ - bodyIdx_;
 		std::size_t numCopy = std::min(out.size(), remaining);
 
-		std::memcpy(out.data(), buffer_.data() + bodyIdx_, numCopy);
+		std::memcpy(out.data(), body.data() + bodyIdx_, numCopy);
 		bodyIdx_ += numCopy;
 
 		bool finished = bodyIdx_ >= length_;
 		if (finished) bodyIdx_ = 0;
 		return {{}, finished, numCopy};
 	}
+	std::tuple<Error, std::size_t> produceBuffers(std::span<std::span<const std::byte>> out){
+		if(out.size() < 2) return {ErrorCode::INVALID_STATE, 0};
+		auto body = body_();
+
+		std::uint64_t lengthVal = length_;
+		if constexpr (std::endian::native != std::endian::big) lengthVal = temp::byteswap(length_);
+		std::memcpy(headOut_.data(), &lengthVal, sizeof(lengthVal));
+
+		out[0] = headOut_;
+		if(body.empty()) return {Error{}, 1};
+		out[1] = body;
+		return {Error{}, 2};
+	}
 };
@@ -0,0 +1,159 @@
+export module broadcast;
+
+import std;
+import buffer;
+import webSocket;
+
+export
+namespace WebSocket {
+	// One message for many sockets, serialized once: the payload and, when it was worth
+	// compressing, its permessage-deflate form made without context takeover, which any socket
+	// that agreed to deflate without server context takeover can send as it is.
+	struct Broadcast{
+		Opcode opcode = Opcode::Text;
+		SharedBuffer payload;
+		SharedBuffer deflated;
+		// under Overflow::Coalesce a message supersedes a queued one of the same nonzero key
+		std::uint64_t key = 0;
+
+		// whether a socket that takes the deflated form gets it for this message
+		bool sendsDeflated(bool deflate) const noexcept { return deflate && deflated; }
+		// what the message holds in the queue of such a socket
+		std::size_t size(bool deflate) const noexcept { return sendsDeflated(deflate) ? deflated.size() : payload.size(); }
+	};
+
+	// A Broadcast as the queues of one thread hold it. The thread takes a single share in the
+	// message and counts its own references without atomics, so handing the message to thousands
+	// of sockets never touches a cache line the other threads write.
+	class LocalBroadcast{
+		struct Block_{
+			std::shared_ptr<const Broadcast> message;
+			std::size_t refs;
+		};
+		Block_* block_ = nullptr;
+
+		void release_() noexcept {
+			if(block_ && --block_->refs == 0) delete block_;
+			block_ = nullptr;
+		}
+	public:
+		LocalBroadcast() = default;
+		explicit LocalBroadcast(std::shared_ptr<const Broadcast> message): block_(new Block_{std::move(message), 1}) {}
+		LocalBroadcast(const LocalBroadcast& other) noexcept: block_(other.block_) {
+			if(block_) ++block_->refs;
+		}
+		LocalBroadcast& operator=(const LocalBroadcast& other) noexcept {
+			if(block_ != other.block_){
+				release_();
+				block_ = other.block_;
+				if(block_) ++block_->refs;
+			}
+			return *this;
+		}
+		LocalBroadcast(LocalBroadcast&& other) noexcept: block_(std::exchange(other.block_, nullptr)) {}
+		LocalBroadcast& operator=(LocalBroadcast&& other) noexcept {
+			if(this != &other){
+				release_();
+				block_ = std::exchange(other.block_, nullptr);
+			}
+			return *this;
+		}
+		~LocalBroadcast() { release_(); }
+
+		const Broadcast& operator*() const noexcept { return *block_->message; }
+		const Broadcast* operator->() const noexcept { return block_->message.get(); }
+		explicit operator bool() const noexcept { return block_ != nullptr; }
+	};
+
+	// what a send queue does with a message that does not fit
+	enum class Overflow{
+		Drop, // the new message is not queued
+		Coalesce, // the newest messages win, the oldest queued ones make room
+		Disconnect, // the socket is too slow to keep, its queue is emptied and it is closed
+	};
+
+	struct QueueLimits{
+		// a message always fits an empty queue, whatever its size
+		std::size_t maxMessages = 256;
+		std::size_t maxBytes = 1024 * 1024;
+		Overflow overflow = Overflow::Coalesce;
+	};
+
+	enum class PushResult{
+		Queued,
+		Coalesced, // queued in place of older messages
+		Dropped,
+		Overflowed, // under Overflow::Disconnect, the queue takes nothing from here on
+	};
+
+	// The messages waiting for one socket, bounded in count and bytes. Only the thread of the
+	// socket touches it.
+	class SendQueue{
+		std::deque<LocalBroadcast> queue_;
+		std::size_t bytes_ = 0;
+		QueueLimits limits_;
+		bool deflate_;
+		bool overflowed_ = false;
+
+		bool fits_(std::size_t size) const noexcept {
+			return queue_.empty() || (queue_.size() < limits_.maxMessages && bytes_ + size <= limits_.maxBytes);
+		}
+	public:
+		// deflate is whether the socket takes the deflated form of a Broadcast
+		SendQueue(const QueueLimits& limits, bool deflate) noexcept: limits_(limits), deflate_(deflate) {}
+
+		PushResult push(LocalBroadcast message){
+			if(overflowed_) return PushResult::Dropped;
+			std::size_t size = message->size(deflate_);
+			bool coalesced = false;
+			if(limits_.overflow == Overflow::Coalesce && message->key){
+				auto same = std::ranges::find_if(queue_, [&](const auto& queued){ return queued->key == message->key; });
+				if(same != queue_.end()){
+					bytes_ -= (*same)->size(deflate_);
+					queue_.erase(same);
+					coalesced = true;
+				}
+			}
+			if(!fits_(size)){
+				switch(limits_.overflow){
+				case Overflow::Drop:
+					return PushResult::Dropped;
+				case Overflow::Disconnect:
+					overflowed_ = true;
+					clear();
+					return PushResult::Overflowed;
+				case Overflow::Coalesce:
+					while(!fits_(size)){
+						bytes_ -= queue_.front()->size(deflate_);
+						queue_.pop_front();
+					}
+					coalesced = true;
+					break;
+				}
+			}
+			bytes_ += size;
+			queue_.push_back(std::move(message));
+			return coalesced ? PushResult::Coalesced : PushResult::Queued;
+		}
+
+		// the oldest message, empty if there is none
+		LocalBroadcast pop() noexcept {
+			if(queue_.empty()) return {};
+			LocalBroadcast message = std::move(queue_.front());
+			queue_.pop_front();
+			bytes_ -= message->size(deflate_);
+			return message;
+		}
+
+		void clear() noexcept {
+			queue_.clear();
+			bytes_ = 0;
+		}
+
+		bool empty() const noexcept { return queue_.empty(); }
+		std::size_t size() const noexcept { return queue_.size(); }
+		std::size_t bytes() const noexcept { return bytes_; }
+		bool deflate() const noexcept { return deflate_; }
+		bool overflowed() const noexcept { return overflowed_; }
+	};
+};
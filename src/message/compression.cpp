@@ -0,0 +1,338 @@
+module;
+#include <zlib.h>
+#ifdef CO_SERVER_ZSTD
+#include <zstd.h>
+#endif
+#ifdef CO_SERVER_BROTLI
+#include <brotli/encode.h>
+#endif
+
+export module compression;
+
+import std;
+import error;
+import buffer;
+import simd;
+import http;
+
+export
+namespace Http {
+	enum class Encoding : std::uint8_t {
+		Identity,
+		Gzip,
+		Deflate,
+		Zstd,
+		Brotli,
+		_Count
+	};
+	// one bit per Encoding, to pass sets of them around
+	constexpr std::uint32_t encodingBit(Encoding e) noexcept { return 1u << static_cast<unsigned>(e); }
+	constexpr std::uint32_t allEncodings = (1u << static_cast<unsigned>(Encoding::_Count)) - 1;
+
+	// the Content-Encoding token, empty for Identity
+	std::string_view encodingName(Encoding e) noexcept;
+	// the encodings compress() can produce in this build, zstd and brotli only where xmake found their packages
+	std::uint32_t availableEncodings() noexcept;
+
+	// The coding to answer a request with, out of allowed. Picks the highest q-value the client gave,
+	// brotli, zstd, gzip, deflate in that order on a tie, and Identity without a usable match or
+	// without an Accept-Encoding at all.
+	Encoding negotiateEncoding(std::optional<std::string_view> acceptEncoding, std::uint32_t allowed) noexcept;
+
+	// whether a body of contentType gets smaller by compressing it, images and archives do not
+	bool compressible(std::string_view contentType) noexcept;
+
+	// Compresses data in one go with a level meant for responses made per request.
+	std::tuple<Error, SharedBuffer> compress(Encoding e, std::span<const std::byte> data);
+
+	// Compressed variants of SharedBuffer bodies, keyed by the identity of the shared bytes so a body
+	// served over and over is compressed once. An entry goes stale once the body it was made from is
+	// gone. Holds at most maxBytes of compressed data and drops the least recently used first.
+	// Shared by every thread, lookups take a short lock.
+	class CompressionCache{
+		struct Key{
+			const std::byte* data;
+			std::size_t size;
+			Encoding encoding;
+			bool operator==(const Key&) const = default;
+		};
+		struct KeyHash{
+			std::size_t operator()(const Key& k) const noexcept {
+				return std::hash<const void*>{}(k.data) ^ (k.size * 31) ^ static_cast<std::size_t>(k.encoding);
+			}
+		};
+		struct Entry{
+			std::weak_ptr<const std::byte> source;
+			SharedBuffer compressed;
+			std::list<Key>::iterator lru;
+		};
+		std::mutex mutex_;
+		std::unordered_map<Key, Entry, KeyHash> entries_;
+		std::list<Key> lru_; // most recently used first
+		std::size_t maxBytes_;
+		std::size_t bytes_ = 0;
+
+		void erase_(std::unordered_map<Key, Entry, KeyHash>::iterator it){
+			bytes_ -= it->second.compressed.size();
+			lru_.erase(it->second.lru);
+			entries_.erase(it);
+		}
+	public:
+		explicit CompressionCache(std::size_t maxBytes): maxBytes_(maxBytes) {}
+
+		std::optional<SharedBuffer> find(const SharedBuffer& body, Encoding e){
+			std::lock_guard lock{mutex_};
+			auto it = entries_.find({body.data(), body.size(), e});
+			if(it == entries_.end()) return std::nullopt;
+			if(it->second.source.expired()){
+				erase_(it);
+				return std::nullopt;
+			}
+			lru_.splice(lru_.begin(), lru_, it->second.lru);
+			return it->second.compressed;
+		}
+
+		void insert(const SharedBuffer& body, Encoding e, SharedBuffer compressed){
+			if(compressed.size() > maxBytes_) return;
+			std::lock_guard lock{mutex_};
+			Key key{body.data(), body.size(), e};
+			if(auto it = entries_.find(key); it != entries_.end()) erase_(it);
+			lru_.push_front(key);
+			bytes_ += compressed.size();
+			entries_.emplace(key, Entry{body.weak(), std::move(compressed), lru_.begin()});
+			while(bytes_ > maxBytes_) erase_(entries_.find(lru_.back()));
+		}
+	};
+
+	// What to compress and how: bodies below minSize or of incompressible types go out as they are,
+	// the others in the negotiated encoding, from the cache when they were compressed before.
+	// Bodies of offloadSize and up are worth compressing off the I/O thread, see offload().
+	class Compressor{
+	public:
+		struct Options{
+			std::size_t minSize = 1024;
+			std::size_t offloadSize = 64 * 1024;
+			std::size_t cacheBytes = 64 * 1024 * 1024;
+			std::uint32_t encodings = allEncodings;
+		};
+	private:
+		Options options_;
+		CompressionCache cache_;
+	public:
+		Compressor(): Compressor(Options{}) {}
+		explicit Compressor(Options options): options_(options), cache_(options.cacheBytes) {
+			options_.encodings &= availableEncodings();
+		}
+
+		// the encoding for a body of size bytes of contentType in the response to req
+		Encoding select(const Request& req, std::string_view contentType, std::size_t size) const noexcept {
+			if(size < options_.minSize || !compressible(contentType)) return Encoding::Identity;
+			return negotiateEncoding(req.get(Field::AcceptEncoding), options_.encodings);
+		}
+		bool shouldOffload(std::size_t size) const noexcept { return size >= options_.offloadSize; }
+
+		std::optional<SharedBuffer> cached(const SharedBuffer& body, Encoding e){
+			if(e == Encoding::Identity) return body;
+			return cache_.find(body, e);
+		}
+		// Compresses body and keeps the result for the next time, callable from any thread.
+		std::tuple<Error, SharedBuffer> encode(const SharedBuffer& body, Encoding e){
+			if(auto hit = cached(body, e)) return {Error{}, std::move(*hit)};
+			auto [err, compressed] = compress(e, body.span());
+			if(err) return {err, {}};
+			cache_.insert(body, e, compressed);
+			return {Error{}, std::move(compressed)};
+		}
+
+		// Sets body, already in encoding e, on res with the headers that go with it.
+		static void setBody(Response& res, SharedBuffer body, Encoding e){
+			if(e != Encoding::Identity) res.set(Field::ContentEncoding, encodingName(e));
+			res.set(Field::Vary, "Accept-Encoding");
+			res.setBody(std::move(body));
+		}
+		// select(), encode() and setBody() in one, on the calling thread.
+		Error apply(Response& res, const Request& req, std::string_view contentType, const SharedBuffer& body){
+			res.set(Field::ContentType, contentType);
+			Encoding e = select(req, contentType, body.size());
+			auto [err, encoded] = encode(body, e);
+			if(err) return err;
+			setBody(res, std::move(encoded), e);
+			return {};
+		}
+	};
+};
+
+// module : private;
+
+static constexpr std::array<std::string_view, static_cast<std::size_t>(Http::Encoding::_Count)> encodingStrArr_{
+	"",
+	"gzip",
+	"deflate",
+	"zstd",
+	"br",
+};
+// server preference on equal q-values, best first
+static constexpr std::array<Http::Encoding, 4> encodingPreference_{
+	Http::Encoding::Brotli,
+	Http::Encoding::Zstd,
+	Http::Encoding::Gzip,
+	Http::Encoding::Deflate,
+};
+
+static std::string_view trim_(std::string_view s) noexcept {
+	while(!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+	while(!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+	return s;
+}
+
+// q-value in thousandths, 1000 without a q parameter and 0 for a malformed one
+static int qValue_(std::string_view params) noexcept {
+	while(!params.empty()){
+		auto semi = params.find(';');
+		auto param = trim_(params.substr(0, semi));
+		params = semi == std::string_view::npos ? std::string_view{} : params.substr(semi + 1);
+		if(param.size() < 2 || (param[0] != 'q' && param[0] != 'Q') || param[1] != '=') continue;
+		auto v = param.substr(2);
+		if(v.empty() || (v[0] != '0' && v[0] != '1')) return 0;
+		int q = (v[0] - '0') * 1000;
+		if(v.size() > 1){
+			if(v[1] != '.') return 0;
+			int scale = 100;
+			for(std::size_t i = 2; i < v.size() && i < 5; ++i, scale /= 10){
+				if(v[i] < '0' || v[i] > '9') return 0;
+				q += (v[i] - '0') * scale;
+			}
+		}
+		return std::min(q, 1000);
+	}
+	return 1000;
+}
+
+namespace Http {
+	std::string_view encodingName(Encoding e) noexcept {
+		return encodingStrArr_[static_cast<std::size_t>(e)];
+	}
+
+	std::uint32_t availableEncodings() noexcept {
+		std::uint32_t set = encodingBit(Encoding::Identity) | encodingBit(Encoding::Gzip) | encodingBit(Encoding::Deflate);
+#ifdef CO_SERVER_ZSTD
+		set |= encodingBit(Encoding::Zstd);
+#endif
+#ifdef CO_SERVER_BROTLI
+		set |= encodingBit(Encoding::Brotli);
+#endif
+		return set;
+	}
+
+	Encoding negotiateEncoding(std::optional<std::string_view> acceptEncoding, std::uint32_t allowed) noexcept {
+		if(!acceptEncoding) return Encoding::Identity;
+		// q of every coding in preference order, -1 where the client did not name it
+		std::array<int, encodingPreference_.size()> q;
+		q.fill(-1);
+		int anyQ = -1;
+		std::string_view list = *acceptEncoding;
+		while(!list.empty()){
+			auto comma = list.find(',');
+			auto item = list.substr(0, comma);
+			list = comma == std::string_view::npos ? std::string_view{} : list.substr(comma + 1);
+			auto semi = item.find(';');
+			auto name = trim_(item.substr(0, semi));
+			int itemQ = semi == std::string_view::npos ? 1000 : qValue_(item.substr(semi + 1));
+			if(name == "*"){
+				anyQ = itemQ;
+				continue;
+			}
+			if(Simd::equalsIgnoreCase(name, "x-gzip")) name = "gzip";
+			for(std::size_t i = 0; i < encodingPreference_.size(); ++i){
+				if(Simd::equalsIgnoreCase(name, encodingName(encodingPreference_[i]))) q[i] = itemQ;
+			}
+		}
+
+		Encoding best = Encoding::Identity;
+		int bestQ = 0;
+		for(std::size_t i = 0; i < encodingPreference_.size(); ++i){
+			if(!(allowed & encodingBit(encodingPreference_[i]))) continue;
+			int itemQ = q[i] >= 0 ? q[i] : anyQ;
+			if(itemQ > bestQ){
+				best = encodingPreference_[i];
+				bestQ = itemQ;
+			}
+		}
+		return best;
+	}
+
+	bool compressible(std::string_view contentType) noexcept {
+		auto type = trim_(contentType.substr(0, contentType.find(';')));
+		auto startsWith = [&](std::string_view prefix){
+			return type.size() >= prefix.size() && Simd::equalsIgnoreCase(type.substr(0, prefix.size()), prefix);
+		};
+		auto endsWith = [&](std::string_view suffix){
+			return type.size() >= suffix.size() && Simd::equalsIgnoreCase(type.substr(type.size() - suffix.size()), suffix);
+		};
+		if(startsWith("text/")) return true;
+		if(endsWith("+json") || endsWith("+xml")) return true;
+		static constexpr std::array<std::string_view, 7> types{
+			"application/json",
+			"application/javascript",
+			"application/xml",
+			"application/wasm",
+			"application/x-protobuf",
+			"application/vnd.mapbox-vector-tile",
+			"application/geo+json",
+		};
+		for(auto t : types){
+			if(Simd::equalsIgnoreCase(type, t)) return true;
+		}
+		return false;
+	}
+
+	static std::tuple<Error, SharedBuffer> zlibCompress_(std::span<const std::byte> data, int windowBits){
+		z_stream stream{};
+		if(deflateInit2(&stream, 6, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) return {ErrorCode::COMPRESSION_ERROR, {}};
+		std::vector<std::byte> out(deflateBound(&stream, static_cast<uLong>(data.size())));
+		stream.next_in = reinterpret_cast<Bytef*>(const_cast<std::byte*>(data.data()));
+		stream.avail_in = static_cast<uInt>(data.size());
+		stream.next_out = reinterpret_cast<Bytef*>(out.data());
+		stream.avail_out = static_cast<uInt>(out.size());
+		int ret = deflate(&stream, Z_FINISH);
+		out.resize(stream.total_out);
+		deflateEnd(&stream);
+		if(ret != Z_STREAM_END) return {ErrorCode::COMPRESSION_ERROR, {}};
+		return {Error{}, SharedBuffer{std::move(out)}};
+	}
+
+	std::tuple<Error, SharedBuffer> compress(Encoding e, std::span<const std::byte> data){
+		switch(e){
+		case Encoding::Identity:
+			return {Error{}, SharedBuffer{data}};
+		case Encoding::Gzip:
+			return zlibCompress_(data, 15 + 16);
+		case Encoding::Deflate:
+			// HTTP's deflate is the zlib format, not raw deflate
+			return zlibCompress_(data, 15);
+#ifdef CO_SERVER_ZSTD
+		case Encoding::Zstd: {
+			std::vector<std::byte> out(ZSTD_compressBound(data.size()));
+			std::size_t n = ZSTD_compress(out.data(), out.size(), data.data(), data.size(), 3);
+			if(ZSTD_isError(n)) return {ErrorCode::COMPRESSION_ERROR, {}};
+			out.resize(n);
+			return {Error{}, SharedBuffer{std::move(out)}};
+		}
+#endif
+#ifdef CO_SERVER_BROTLI
+		case Encoding::Brotli: {
+			std::size_t n = BrotliEncoderMaxCompressedSize(data.size());
+			if(n == 0) return {ErrorCode::COMPRESSION_ERROR, {}};
+			std::vector<std::byte> out(n);
+			if(!BrotliEncoderCompress(5, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC, data.size(),
+									  reinterpret_cast<const std::uint8_t*>(data.data()), &n, reinterpret_cast<std::uint8_t*>(out.data())))
+				return {ErrorCode::COMPRESSION_ERROR, {}};
+			out.resize(n);
+			return {Error{}, SharedBuffer{std::move(out)}};
+		}
+#endif
+		default:
+			return {ErrorCode::COMPRESSION_ERROR, {}};
+		}
+	}
+};
@@ -1,9 +1,14 @@
 module;
 #include "picohttpparser/picohttpparser.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 export module http;
 import std;
 import error;
+import buffer;
+import simd;
 
 export
 namespace Http {
@@ -13,6 +18,9 @@ namespace Http {
 		OK,
 		Created,
 		NoContent,
+		PartialContent,
+
+		NotModified,
 
 		BadRequest,
 		Unauthorized,
@@ -20,6 +28,10 @@ namespace Http {
 		NotFound,
 		MethodNotAllowed,
 		Conflict,
+		PreconditionFailed,
+		PayloadTooLarge,
+		RangeNotSatisfiable,
+		UpgradeRequired,
 
 		InternalServerError,
 		NotImplemented,
@@ -42,18 +54,82 @@ namespace Http {
 		Authorization,
 		Cookie,
 
+		AcceptEncoding,
+		AcceptLanguage,
+		AcceptRanges,
+		AccessControlAllowOrigin,
+		Allow,
+		CacheControl,
+		ContentEncoding,
+		ContentRange,
+		Date,
+		ETag,
+		Expect,
+		IfMatch,
+		IfModifiedSince,
+		IfNoneMatch,
+		IfRange,
+		IfUnmodifiedSince,
+		KeepAlive,
+		LastModified,
+		Location,
+		Origin,
+		Range,
+		Referer,
+		RetryAfter,
+		SecWebSocketAccept,
+		SecWebSocketExtensions,
+		SecWebSocketKey,
+		SecWebSocketProtocol,
+		SecWebSocketVersion,
+		Server,
+		SetCookie,
+		Upgrade,
+		Vary,
+		XForwardedFor,
+
 		_Count
 	};
 
+	// Case-insensitive lookup of a header name, nullopt if it is not one of Field.
+	std::optional<Field> fieldFromName(std::string_view name) noexcept;
+
+	// Other stands for any extension method, Request::method() still has its name.
+	enum class Method {
+		Get,
+		Head,
+		Post,
+		Put,
+		Delete,
+		Connect,
+		Options,
+		Trace,
+		Patch,
+		Other,
+
+		_Count
+	};
+
+	std::string_view methodName(Method method) noexcept;
+
 	class Request{
-		std::vector<std::byte> headerBufferOptionalData_;
+		PoolBlock headerBlock_; // own header storage, borrowed from the pool once bytes arrive
 		std::span<std::byte> headerBuffer_;
 		std::size_t maxHeaderSize_;
 		std::size_t headerBufferIdx_ = 0;
-		char last_{0};
-		unsigned char numFound_{0};
+		std::span<const std::byte> header_; // the parsed header block, in headerBuffer_ or in place in the caller's buffer
+		std::size_t scanned_ = 0;
+		bool inPlace_ = false;
+	public:
+		// SIMD finds the end of the header block first and parses it once complete. INCREMENTAL skips
+		// the scan and lets picohttpparser resume from the previous length, but copies everything
+		// that arrived into the header buffer, so it suits requests without bodies best.
+		enum class ScanMode { SIMD, INCREMENTAL };
+	private:
+		ScanMode scanMode_ = ScanMode::SIMD;
 
-		bool deserialize_();
+		int deserialize_(std::size_t lastLen);
+		void reserveHeader_(std::size_t size);
 
 		std::vector<std::byte> body_;
 		std::size_t maxBodySize_ = 1024 * 1024;
@@ -61,6 +137,7 @@ namespace Http {
 		phr_chunked_decoder chunkedDecoder_;
 
 		std::string_view method_;
+		Method methodId_ = Method::Other;
 		std::string_view target_;
 		std::string version_;
 		std::vector<std::string_view> path_;
@@ -72,11 +149,51 @@ namespace Http {
 		static constexpr std::size_t maxNumHeaders_ = 32;
 		std::array<std::pair<std::string_view, std::string_view>, maxNumHeaders_> fields_;
 		std::size_t numHeaders_ = 0;
+
+		// first header of each known field and the next one with the same field, filled by deserialize_
+		static constexpr std::uint8_t noIndex_ = 0xFF;
+		std::array<std::uint8_t, static_cast<std::size_t>(Field::_Count)> firstIdx_;
+		std::array<std::uint8_t, maxNumHeaders_> nextIdx_;
+		void indexFields_() noexcept;
+	public:
+		// Values of every header with one name in the order they arrived, a view into the request.
+		class FieldValues{
+		public:
+			class iterator{
+				const Request* req_ = nullptr;
+				std::uint8_t idx_ = noIndex_;
+				std::string_view name_; // only set for names outside Field, which are found by scanning
+			public:
+				using value_type = std::string_view;
+				using difference_type = std::ptrdiff_t;
+
+				iterator() = default;
+				iterator(const Request* req, std::uint8_t idx, std::string_view name) noexcept:
+					req_(req), idx_(idx), name_(name) {}
+
+				std::string_view operator*() const noexcept { return req_->fields_[idx_].second; }
+				iterator& operator++() noexcept { idx_ = req_->nextMatch_(idx_, name_); return *this; }
+				iterator operator++(int) noexcept { auto it = *this; ++*this; return it; }
+				bool operator==(const iterator& other) const noexcept { return idx_ == other.idx_; }
+			};
+		private:
+			iterator begin_;
+		public:
+			FieldValues(iterator begin) noexcept: begin_(begin) {}
+
+			iterator begin() const noexcept { return begin_; }
+			iterator end() const noexcept { return {}; }
+			bool empty() const noexcept { return begin_ == end(); }
+		};
+	private:
+		std::uint8_t nextMatch_(std::uint8_t idx, std::string_view name) const noexcept;
+		std::uint8_t findName_(std::size_t from, std::string_view name) const noexcept;
 	public:
 		Request(std::span<std::byte> headerBuffer) noexcept;
 		Request(std::size_t maxHeaderSize = 4096);
 
 		std::string_view method() const noexcept { return method_; }
+		Method methodId() const noexcept { return methodId_; }
 		std::string_view target() const noexcept { return target_; }
 		std::string_view version() const noexcept { return version_; }
 
@@ -85,19 +202,183 @@ namespace Http {
 
 		std::optional<std::string_view> get(Http::Field field) const noexcept;
 		std::optional<std::string_view> get(std::string_view field) const noexcept;
-		std::vector<std::string_view> getList(Http::Field field) const noexcept;
-		std::vector<std::string_view> getList(std::string_view field) const noexcept;
+		FieldValues getList(Http::Field field) const noexcept;
+		FieldValues getList(std::string_view field) const noexcept;
 
 		std::span<const std::byte> body() const noexcept { return body_; }
+		// Largest body accepted, whether buffered or streamed, set before the body is read.
+		void maxBodySize(std::size_t size) noexcept { maxBodySize_ = size; }
+
+		void scanMode(ScanMode mode) noexcept { scanMode_ = mode; }
 
 		std::tuple<Error, bool, std::size_t> consumeHeaderSome(std::span<const std::byte> data);
 		std::tuple<Error, bool, std::size_t> consumeBodySome(std::span<const std::byte> data);
 		std::tuple<Error, bool, std::size_t> produceHeaderSome(std::span<std::byte> out);
 		std::tuple<Error, bool, std::size_t> produceBodySome(std::span<std::byte> out);
+
+		// Takes the next piece of the body out of data without copying it into body_. A chunked body
+		// is decoded in place, so the piece is a view into data and holds only payload bytes, and
+		// whatever follows the body is moved to the end of the consumed range. The piece may be
+		// empty while a chunk header is still incomplete.
+		std::tuple<Error, bool, std::size_t, std::span<const std::byte>> consumeBodyInPlace(std::span<std::byte> data);
+
+		// Parses the header straight out of data, which must start at the request and stay put until
+		// the request is done with it or detachHeader() is called. Consumes nothing until the whole
+		// header is in data, so the caller keeps appending to the same buffer meanwhile.
+		std::tuple<Error, bool, std::size_t> consumeHeaderInPlace(std::span<const std::byte> data);
+		// copies an in-place header into the request's own storage and repoints every view into it
+		Error detachHeader();
+	};
+
+	// A response body made piece by piece while it is sent. pull() fills out with the next bytes
+	// and reports through done, right away or later on the connection's thread. The next pull
+	// only comes after the previous piece was written, so a slow client holds the producer back
+	// instead of the body piling up in memory.
+	class BodyStream{
+	public:
+		struct Done{
+			void (*fn)(void* ctx, Error err, std::size_t size, bool last);
+			void* ctx;
+			void operator()(Error err, std::size_t size, bool last) const { fn(ctx, err, size, last); }
+		};
+		virtual ~BodyStream() = default;
+		virtual void pull(std::span<std::byte> out, Done done) = 0;
+	};
+
+	// What takes a connection over once a 101 went out on it, e.g. a WebSocket session. The
+	// server that sends the 101 knows the kinds it can run, see ConnectionUpgrade.
+	class Upgrade{
+	public:
+		virtual ~Upgrade() = default;
+	};
+
+	// Chunked transfer coding with a fixed-width size line, so the line can be written in front
+	// of data that was already placed behind it.
+	struct Chunk{
+		static constexpr std::size_t headerSize = 10; // 8 hex digits and CRLF
+		static constexpr std::string_view trailer{"\r\n"};
+		static constexpr std::string_view last{"0\r\n\r\n"};
+		// the frame around size bytes of data, out must hold headerSize bytes
+		static void writeHeader(std::span<std::byte> out, std::size_t size) noexcept {
+			static constexpr std::string_view hex{"0123456789abcdef"};
+			for(std::size_t i = 8; i-- > 0; size >>= 4) out[i] = static_cast<std::byte>(hex[size & 0xF]);
+			out[8] = std::byte{'\r'};
+			out[9] = std::byte{'\n'};
+		}
+	};
+
+	// IMF-fixdate, "Sun, 06 Nov 1994 08:49:37 GMT", as Date and Last-Modified carry it.
+	std::array<char, 29> formatDate(std::chrono::sys_seconds time) noexcept;
+	// Reads an IMF-fixdate back, nullopt for anything else including the obsolete formats.
+	std::optional<std::chrono::sys_seconds> parseDate(std::string_view value) noexcept;
+
+	// IMF-fixdate of the current second for the Date header, one per thread. Server refreshes it
+	// every second from a timer on each io_context; a thread without one formats it on first use
+	// and keeps it until refresh() is called.
+	class DateCache{
+		std::array<char, 29> buf_{};
+		bool valid_ = false;
+	public:
+		static DateCache& local() noexcept;
+		void refresh() noexcept;
+		std::string_view value() noexcept;
+	};
+
+	// A regular file opened for reading, with the validators that describe it. The descriptor is
+	// closed with the last reference, so a response keeps sending a file a cache already dropped.
+	class File{
+		int fd_ = -1;
+		std::uint64_t size_ = 0;
+		std::uint64_t device_ = 0;
+		std::uint64_t inode_ = 0;
+		std::int64_t modifiedNs_ = 0;
+		std::string etag_;
+		std::array<char, 29> lastModified_{};
+
+		File(int fd, std::uint64_t size, std::uint64_t device, std::uint64_t inode, std::int64_t modifiedNs);
+	public:
+		// nullptr when path is missing, unreadable or not a regular file
+		static std::shared_ptr<const File> open(const std::string& path);
+		~File();
+		File(const File&) = delete;
+		File& operator=(const File&) = delete;
+
+		int fd() const noexcept { return fd_; }
+		std::uint64_t size() const noexcept { return size_; }
+		std::chrono::sys_seconds modified() const noexcept;
+		// strong validator made from size and modification time, quotes included
+		std::string_view etag() const noexcept { return etag_; }
+		std::string_view lastModified() const noexcept { return {lastModified_.data(), lastModified_.size()}; }
+		// whether path still names this file with the same size and modification time
+		bool unchanged(const std::string& path) const noexcept;
+	};
+
+	// length bytes of file from offset, sent by the connection without passing through userspace
+	struct FileRange{
+		std::shared_ptr<const File> file;
+		std::uint64_t offset = 0;
+		std::uint64_t length = 0;
+	};
+
+	// Inclusive byte positions, as a Range or Content-Range header counts them.
+	struct ByteRange{
+		std::uint64_t first = 0;
+		std::uint64_t last = 0;
+		std::uint64_t length() const noexcept { return last - first + 1; }
+	};
+	enum class RangeStatus { Ignore, Satisfiable, Unsatisfiable };
+	// Reads a "bytes=" Range value against a representation of size bytes. Satisfiable ranges come
+	// back in ascending order with overlapping and adjacent ones merged, those past the end are
+	// dropped. Ignore covers what a server may answer with the whole representation: bad syntax,
+	// other units and more than maxRanges ranges left after merging.
+	std::tuple<RangeStatus, std::vector<ByteRange>> parseRanges(std::string_view value, std::uint64_t size, std::size_t maxRanges = 32);
+
+	// One part of a multipart/byteranges body: the delimiter and part headers, then the bytes of
+	// its range, from a shared body or from a file. The last part only closes the body.
+	struct BodyPart{
+		std::string header;
+		SharedBuffer bytes;
+		FileRange file;
+	};
+
+	// Whether etag is in the If-Match/If-None-Match list value, "*" matching any. The weak
+	// comparison ignores W/ on either side, the strong one never matches a weak tag.
+	bool etagMatches(std::string_view list, std::string_view etag, bool weak) noexcept;
+
+	// What identifies the current representation of a resource, as far as it is known. An empty
+	// etag or no lastModified means that validator is not available.
+	struct Validators{
+		std::string etag; // quotes included, W/ for a weak one
+		std::optional<std::chrono::sys_seconds> lastModified;
+	};
+	enum class Precondition { Proceed, NotModified, Failed };
+	// Evaluates If-Match, If-Unmodified-Since, If-None-Match and If-Modified-Since of req against
+	// validators in the order RFC 9110 gives: Failed is answered with 412, NotModified with 304.
+	Precondition validate(const Request& req, const Validators& validators) noexcept;
+
+	// A status line and fixed headers formatted once, for responses that always share that shape.
+	// A Response built from it copies the block in one go and only adds what is per response:
+	// Date, Content-Length, and Content-Type or Connection unless they are fixed here. The line
+	// is kept as HTTP/1.1 and patched for 1.0 requests.
+	class ResponseTemplate{
+		std::string header_;
+		bool hasContentType_ = false;
+		bool hasConnection_ = false;
+		bool hasDate_ = false;
+		std::size_t connectionIdx_ = 0; // the value of the Connection field, when there is one
+		std::size_t connectionSize_ = 0;
+
+		friend class Response;
+	public:
+		ResponseTemplate(Http::Status status);
+		ResponseTemplate(std::pair<int, std::string_view> status);
+
+		void set(Http::Field field, std::string_view value);
+		void set(std::string_view field, std::string_view value);
 	};
 
 	class Response{
-		std::vector<std::byte> headerBufferOptionalData_;
+		PoolBlock headerBlock_;
 		std::span<std::byte> headerBuffer_;
 		std::size_t headerBufferIdx_ = 0;
 		std::size_t headerSize_ = 0;
@@ -106,35 +387,93 @@ namespace Http {
 		std::size_t contentLength_ = 0;
 		bool hasContentType_ = false;
 		bool hasConnection_ = false;
+		bool hasDate_ = false;
+		bool bodiless_ = false; // 1xx, 204 and 304 have neither a body nor a Content-Length
+		bool switching_ = false; // 101
+		bool close_ = false;
+		// where the value of a Connection field set is, so closeConnection() can rewrite it
+		std::size_t connectionIdx_ = 0;
+		std::size_t connectionSize_ = 0;
 		//bool hasTransferEncoding
 
 		void init_(std::string_view status, std::string_view reason, std::string_view version);
+		void init_(Http::Status status, std::string_view version);
+		void init_(const ResponseTemplate& tmpl, std::string_view version);
 		void alloc_(std::size_t num);
 		bool serialize_();
 		bool serialized_ = false;
 
 		std::string stringBody_;
 		std::vector<std::byte> body_;
+		SharedBuffer sharedBody_;
 		std::size_t bodyIdx_ = 0;
-		bool isBodyString_;
+		bool isBodyString_ = false;
+		bool omitBody_ = false;
+		std::unique_ptr<BodyStream> stream_;
+		std::unique_ptr<Upgrade> upgrade_;
+		FileRange fileBody_;
+		std::vector<BodyPart> parts_;
+		std::size_t partIdx_ = 0;
+		std::span<const std::byte> bodySpan_();
+		void clearBody_() noexcept;
 	public:
 		Response(Http::Status status, std::string_view version, std::span<std::byte> headerBuffer) noexcept;
 		Response(std::pair<int, std::string_view> status, std::string_view version, std::span<std::byte> headerBuffer) noexcept;
 		Response(Http::Status status, std::string_view version);
 		Response(std::pair<int, std::string_view> status, std::string_view version);
+		Response(const ResponseTemplate& tmpl, std::string_view version, std::span<std::byte> headerBuffer) noexcept;
+		Response(const ResponseTemplate& tmpl, std::string_view version);
 
 		void set(Http::Field field, std::string_view value);
 		void set(std::string_view field, std::string_view value);
+		// ETag and Last-Modified for whichever of validators are there
+		void setValidators(const Validators& validators);
 
 		void setBody(std::span<const std::byte> data);
 		void setBody(std::vector<std::byte>&& data);
 		void setBody(const std::string& data);
 		void setBody(std::string&& data);
+		// Sends data straight from the shared bytes, nothing is copied into the response.
+		void setBody(SharedBuffer data);
+		// Streams the body from stream with chunked coding. A 1.0 peer has no chunked coding, the
+		// body then ends with the connection instead (see closeAfter()).
+		void setBody(std::unique_ptr<BodyStream> stream);
+		// Sends the bytes of range.file, straight from the file where the connection can.
+		void setBody(FileRange range);
+		// Narrows the body to ranges of it, as parseRanges gives them: one range is sent as the body
+		// with its Content-Range, several as a multipart/byteranges body with parts of contentType.
+		// Either way the bytes still go out from the shared buffer or file, a string or vector body
+		// is moved into a SharedBuffer first. Sets Content-Type, so it is not set besides, and fails
+		// with INVALID_STATE for a streamed body.
+		Error setRanges(std::span<const ByteRange> ranges, std::string_view contentType);
+
+		// the stream to write the body from, null for a body held in the response or omitted
+		BodyStream* stream() const noexcept { return omitBody_ ? nullptr : stream_.get(); }
+		bool chunked() const noexcept { return stream_ && defaultKeepAlive_; }
+		// Sends Connection: close whatever was set before, e.g. from a server that drains. A value
+		// set already is overwritten in place, so the header needs no room it does not have.
+		void closeConnection();
+		// the connection has to be closed once this is written, because the body ends with it or
+		// closeConnection() was called
+		bool closeAfter() const noexcept { return close_ || (stream() && !chunked()); }
+		// the file to send after the header, null for other bodies or when the body is omitted
+		const FileRange* file() const noexcept { return omitBody_ || !fileBody_.file ? nullptr : &fileBody_; }
+		// the parts to send after the header, empty unless setRanges() made a multipart body
+		std::span<const BodyPart> parts() const noexcept { return omitBody_ ? std::span<const BodyPart>{} : std::span<const BodyPart>{parts_}; }
+		// a 101, after which the connection speaks the protocol named in Upgrade instead of HTTP
+		bool switchingProtocols() const noexcept { return switching_; }
+		// what runs on the connection after this 101, handed to the connection loop by takeUpgrade()
+		void upgrade(std::unique_ptr<Upgrade> upgrade) noexcept { upgrade_ = std::move(upgrade); }
+		std::unique_ptr<Upgrade> takeUpgrade() noexcept { return std::move(upgrade_); }
+		// Keeps the headers of the body, Content-Length included, but sends none of it, as a
+		// response to HEAD does.
+		void omitBody() noexcept { omitBody_ = true; }
 
 		std::tuple<Error, bool, std::size_t> consumeHeaderSome(std::span<const std::byte> data);
 		std::tuple<Error, bool, std::size_t> consumeBodySome(std::span<const std::byte> data);
 		std::tuple<Error, bool, std::size_t> produceHeaderSome(std::span<std::byte> out);
 		std::tuple<Error, bool, std::size_t> produceBodySome(std::span<std::byte> out);
+		std::tuple<Error, std::size_t> produceBuffers(std::span<std::span<const std::byte>> out);
 	};
 
 
@@ -156,57 +495,272 @@ namespace Http {
 	// 	{ t(std::declval<Args>()...) } -> std::same_as<AwaitT<Ret>>; // callable object
 	// };
 
+	// Values captured by a route match: ":name" segments by name, "*" runs under the name "*", all
+	// of them by position in route order. A "*" capture spans the matched segments with the slashes
+	// between them, so the path segments must be views into one target as Request::path() gives.
+	class RouteParams{
+	public:
+		static constexpr std::size_t maxParams = 8;
+	private:
+		std::array<std::pair<std::string_view, std::string_view>, maxParams> params_;
+		std::size_t size_ = 0;
+		std::string_view allow_;
+		Validators validators_;
+		Precondition precondition_ = Precondition::Proceed;
+		bool head_ = false;
+
+		template<typename Signature>
+		friend class Router;
+	public:
+		std::size_t size() const noexcept { return size_; }
+		bool empty() const noexcept { return size_ == 0; }
+		std::string_view operator[](std::size_t i) const noexcept { return params_[i].second; }
+		std::string_view name(std::size_t i) const noexcept { return params_[i].first; }
+		// value for the Allow header, only set for the methodNotAllowed handler
+		std::string_view allow() const noexcept { return allow_; }
+		// what the route's validator gave and what the request's conditions made of it, set once the
+		// validator ran so the route's own handler can send the same validators
+		const Validators& validators() const noexcept { return validators_; }
+		Precondition precondition() const noexcept { return precondition_; }
+		// the request is a HEAD, its response goes out without a body, which the handler may skip making
+		bool head() const noexcept { return head_; }
+
+		std::optional<std::string_view> get(std::string_view name) const noexcept {
+			for(std::size_t i = 0; i < size_; ++i){
+				if(params_[i].first == name) return params_[i].second;
+			}
+			return std::nullopt;
+		}
+	};
+
+	class RouteParams;
+
+	// Per-route body handling. A route with streamBody gets the request once its header is in and
+	// reads the body itself, piece by piece out of the connection's read buffer, instead of having
+	// it collected into Request::body() first. maxBodySize limits both.
+	// A validator tells the current ETag/Last-Modified of the route's resource without making it.
+	// Conditional requests it decides go to the router's precondition handler instead of the route,
+	// so a revalidation costs the validator and no body.
+	// A compute route's handler runs on a compute pool, off the I/O thread of its connection, e.g.
+	// to render a tile. It gets the whole body and never the socket, so it cannot stream its body.
+	struct RouteOptions{
+		std::size_t maxBodySize = 1024 * 1024;
+		bool streamBody = false;
+		bool compute = false;
+		std::function<Validators(const Request&, const RouteParams&)> validator = nullptr;
+	};
+
 	template<typename Signature>
 	class Router;
 
+	// Routes are registered with add()/notFound() and take effect once compile() flattens them;
+	// match() and handle() only read the compiled table, so it is safe to share across threads afterwards.
+	// A handler takes Args... and may take a trailing const RouteParams& for its captures.
 	template <template<typename> typename AwaitT, typename Ret, typename... Args>
 	class Router<AwaitT<Ret>(Args...)> {
-		using Handler = std::function<AwaitT<Ret>(Args...)>;
+		// Type-erased handler stored inline. A callable bigger than the buffer fails to compile
+		// instead of going to the heap.
+		class Handler {
+			static constexpr std::size_t capacity_ = 4 * sizeof(void*);
+			alignas(std::max_align_t) std::byte storage_[capacity_];
+			AwaitT<Ret> (*invoke_)(void*, Args..., const RouteParams&);
+			// copy-constructs src into dst, or destroys src when dst is null
+			void (*manage_)(void* dst, const void* src);
+		public:
+			template<typename F>
+			requires (!std::same_as<std::decay_t<F>, Handler>)
+			Handler(F&& func){
+				using T = std::decay_t<F>;
+				static_assert(sizeof(T) <= capacity_ && alignof(T) <= alignof(std::max_align_t),
+							  "Handler captures too much to be stored inline.");
+				::new (static_cast<void*>(storage_)) T(std::forward<F>(func));
+				invoke_ = [](void* f, Args... args, const RouteParams& params) -> AwaitT<Ret> {
+					return (*static_cast<T*>(f))(std::forward<Args>(args)..., params);
+				};
+				manage_ = [](void* dst, const void* src){
+					if(dst) ::new (dst) T(*static_cast<const T*>(src));
+					else static_cast<const T*>(src)->~T();
+				};
+			}
+			Handler(const Handler& other): invoke_(other.invoke_), manage_(other.manage_) {
+				manage_(storage_, other.storage_);
+			}
+			Handler& operator=(const Handler& other){
+				if(this == &other) return *this;
+				manage_(nullptr, storage_);
+				invoke_ = other.invoke_;
+				manage_ = other.manage_;
+				manage_(storage_, other.storage_);
+				return *this;
+			}
+			~Handler(){ manage_(nullptr, storage_); }
+
+			AwaitT<Ret> operator()(Args... args, const RouteParams& params) const {
+				return invoke_(const_cast<std::byte*>(storage_), std::forward<Args>(args)..., params);
+			}
+		};
+	public:
+		static constexpr std::size_t maxSegments = 32;
+	private:
+		// one handler slot per method plus one for add() without a method
+		static constexpr std::size_t numMethods_ = static_cast<std::size_t>(Method::_Count);
+		static constexpr std::size_t anySlot_ = numMethods_;
+		struct Slot {
+			Handler handler;
+			std::vector<std::string> captureNames;
+			RouteOptions options;
+		};
+
+		// registration tree, flattened by compile()
 		struct Node {
-			std::unordered_map<std::string_view, std::unique_ptr<Node>> children{};
+			std::map<std::string, std::unique_ptr<Node>, std::less<>> children{};
 			std::unique_ptr<Node> paramChild = nullptr;  // : here
 			std::unique_ptr<Node> wildcardChild = nullptr; // * here
-			std::optional<Handler> handler;
+			std::array<std::optional<Slot>, numMethods_ + 1> slots;
 		};
-		std::optional<Handler> notFoundHandler;
 		Node root;
-		std::vector<std::vector<std::string>> segmentsList;
-
-		const Node* find_(const Node* n, std::span<const std::string_view> path) const {
-			// std::println("path: {}", path);
-			if(path.empty()){
-				if(n->handler) return n;
-				return nullptr;
-			}
 
-			// std::println("segments: {}", segments);
-			// for(const auto& [k, v] : n->children) std::println("child: {}", k);
+		// validators need the request, which handlers get as their first argument
+		static constexpr bool requestFirst_ = [](){
+			if constexpr (sizeof...(Args) == 0) return false;
+			else return std::same_as<std::remove_cvref_t<std::tuple_element_t<0, std::tuple<Args...>>>, Request>;
+		}();
+
+		static constexpr std::uint32_t none_ = std::numeric_limits<std::uint32_t>::max();
+		// nodes in breadth-first order, the static edges of a node are contiguous and sorted
+		struct FlatNode {
+			std::uint32_t edgesBegin = 0;
+			std::uint32_t edgesCount = 0;
+			std::uint32_t paramChild = none_;
+			std::uint32_t wildcardChild = none_;
+			// bit i set when slot i has a handler, the handlers follow in slot order from handlersBegin
+			std::uint32_t slots = 0;
+			std::uint32_t handlersBegin = 0;
+			std::string_view allow;
+		};
+		struct Edge {
+			std::string_view segment;
+			std::uint32_t child;
+		};
+	public:
+		// A matched handler together with how its body is to be read.
+		struct Route {
+			Handler handler;
+			std::uint32_t namesBegin;
+			RouteOptions options;
+		};
+	private:
+		std::optional<Route> notFound_;
+		std::optional<Route> methodNotAllowed_;
+		std::optional<Route> precondition_;
+
+		std::vector<FlatNode> nodes_;
+		std::vector<Edge> edges_;
+		std::vector<Route> handlers_;
+		std::vector<std::string_view> names_;
+		std::string strings_; // backs every view in edges_, names_ and the allow lists
+
+		// upper bound on match steps, a path that needs more backtracking than this is not found
+		static constexpr std::size_t maxSteps_ = 1024;
+
+		std::uint32_t findStatic_(const FlatNode& n, std::string_view segment) const noexcept {
+			auto edges = std::span{edges_}.subspan(n.edgesBegin, n.edgesCount);
+			auto it = std::ranges::lower_bound(edges, segment, {}, &Edge::segment);
+			if(it != edges.end() && it->segment == segment) return it->child;
+			return none_;
+		}
 
-			auto it = n->children.find(path.front());
-			if (it != n->children.end()) {
-				// std::println("found child: {}", it->first);
-				auto ret = find_(it->second.get(), path.subspan(1));
-				if(ret) return ret;
+		// Index into handlers_ serving method at n: its own slot, GET for HEAD, then the any slot.
+		static std::uint32_t findHandler_(const FlatNode& n, Method method) noexcept {
+			std::size_t slot = static_cast<std::size_t>(method);
+			if(!(n.slots & (1u << slot))){
+				if(method == Method::Head && (n.slots & (1u << static_cast<std::size_t>(Method::Get)))) slot = static_cast<std::size_t>(Method::Get);
+				else if(n.slots & (1u << anySlot_)) slot = anySlot_;
+				else return none_;
 			}
+			return n.handlersBegin + std::popcount(n.slots & ((1u << slot) - 1));
+		}
 
-			if(n->paramChild){
-				auto ret = find_(n->paramChild.get(), path.subspan(1));
-				if(ret) return ret;
-			}
+		// Static children win over ":" which wins over "*", and "*" tries its shortest run first.
+		// The search keeps one frame per route segment instead of recursing. A path that matches
+		// only routes without a handler for method leaves the first such node in allowed.
+		std::uint32_t match_(Method method, std::span<const std::string_view> path, RouteParams& params,
+							 const FlatNode*& allowed) const noexcept {
+			allowed = nullptr;
+			if(nodes_.empty()) return none_;
+			struct Frame {
+				std::uint32_t node;
+				std::uint32_t pos;
+				std::uint32_t span = 0; // segments taken by "*", 0 while on the static or ":" child
+				std::uint8_t state = 0; // next alternative: 0 static, 1 param, 2 wildcard, 3 none left
+			};
+			std::array<Frame, maxSegments + 1> stack;
+			std::size_t depth = 0;
+			stack[depth++] = {0, 0};
+
+			std::uint32_t found = none_;
+			for(std::size_t steps = 0; depth && steps < maxSteps_; ++steps){
+				Frame& f = stack[depth - 1];
+				const FlatNode& n = nodes_[f.node];
+				if(f.pos == path.size()){
+					if(n.slots){
+						found = findHandler_(n, method);
+						if(found != none_) break;
+						if(!allowed) allowed = &n;
+					}
+					--depth;
+					continue;
+				}
 
-			if (n->wildcardChild) {
-				// for(int i = path.size(); i >= 1; --i){
-				for(int i = 1; i <= path.size(); ++i){
-					auto ret = find_(n->wildcardChild.get(), path.subspan(i));
-					if(ret) return ret;
+				std::uint32_t next = none_;
+				std::uint32_t nextPos = f.pos + 1;
+				if(f.state == 0){
+					f.state = 1;
+					if(n.edgesCount) next = findStatic_(n, path[f.pos]);
+				} else if(f.state == 1){
+					f.state = 2;
+					next = n.paramChild;
+				} else if(f.state == 2 && n.wildcardChild != none_ && f.pos + f.span < path.size()){
+					++f.span;
+					next = n.wildcardChild;
+					nextPos = f.pos + f.span;
+				} else{
+					--depth;
+					continue;
+				}
+				if(next != none_) stack[depth++] = {next, nextPos};
+			}
+			params.size_ = 0;
+			if(found == none_) return none_;
+
+			for(std::size_t i = 0; i + 1 < depth; ++i){
+				const Frame& f = stack[i];
+				if(f.state != 2) continue; // took the static child
+				std::string_view value = path[f.pos];
+				if(f.span > 1){
+					const auto& last = path[f.pos + f.span - 1];
+					value = {value.data(), static_cast<std::size_t>(last.data() + last.size() - value.data())};
 				}
+				params.params_[params.size_] = {names_[handlers_[found].namesBegin + params.size_], value};
+				++params.size_;
 			}
+			return found;
+		}
 
-			return nullptr;
+		template<typename HttpHandler>
+		static Handler wrap_(HttpHandler&& func){
+			if constexpr (std::is_invocable_v<HttpHandler&, Args..., const RouteParams&>){
+				return std::forward<HttpHandler>(func);
+			} else{
+				return [f = std::forward<HttpHandler>(func)](Args... args, const RouteParams&) mutable {
+					return f(std::forward<Args>(args)...);
+				};
+			}
 		}
-	public:
+
 		template<typename HttpHandler>
-		void add(std::string path, HttpHandler&& func) {
+		void add_(std::size_t slot, std::string path, HttpHandler&& func, RouteOptions options) {
+			if(options.compute && options.streamBody) throw std::invalid_argument("A compute route cannot stream its body.");
 			std::vector<std::string> segments;
 			std::size_t start = 0;
 			while (start < path.size()) {
@@ -217,51 +771,182 @@ namespace Http {
 				start = slash + 1;
 			}
 			if(path.back() == '/') segments.emplace_back("");
+			if(segments.size() > maxSegments) throw std::length_error("Route has too many segments.");
 
-
+			std::vector<std::string> captureNames;
 			Node* n = &root;
 			for(auto& seg : segments){
 				if(seg == "*"){
 					if (!n->wildcardChild) n->wildcardChild = std::make_unique<Node>();
-					// std::println("wildChild");
+					captureNames.emplace_back("*");
 					n = n->wildcardChild.get();
 				} else if(seg.size() && seg[0] == ':'){
 					if (!n->paramChild) n->paramChild = std::make_unique<Node>();
-					// std::println("paramChild");
+					captureNames.emplace_back(seg.substr(1));
 					n = n->paramChild.get();
 				} else{
 					auto [it, inserted] = n->children.try_emplace(std::move(seg), std::make_unique<Node>());
-					// for(const auto& [k, v] : n->children) std::println("child: {}", k);
 					n = it->second.get();
+				}
+			}
+			if(captureNames.size() > RouteParams::maxParams) throw std::length_error("Route has too many parameters.");
+
+			n->slots[slot].emplace(wrap_(std::forward<HttpHandler>(func)), std::move(captureNames), options);
+		}
+	public:
+		// Serves every method on path that has no handler of its own.
+		template<typename HttpHandler>
+		void add(std::string path, HttpHandler&& func, RouteOptions options = {}) {
+			add_(anySlot_, std::move(path), std::forward<HttpHandler>(func), options);
+		}
+		// Serves method on path, a GET handler also answers HEAD unless HEAD has its own.
+		template<typename HttpHandler>
+		void add(Method method, std::string path, HttpHandler&& func, RouteOptions options = {}) {
+			add_(static_cast<std::size_t>(method), std::move(path), std::forward<HttpHandler>(func), options);
+		}
+
+		template<typename HttpHandler>
+		void notFound(HttpHandler&& func){
+			notFound_.emplace(wrap_(std::forward<HttpHandler>(func)), 0u, RouteOptions{});
+		}
+		// Called when the path matches but not the method, with RouteParams::allow() listing the
+		// methods that would. Without one those requests go to notFound.
+		template<typename HttpHandler>
+		void methodNotAllowed(HttpHandler&& func){
+			methodNotAllowed_.emplace(wrap_(std::forward<HttpHandler>(func)), 0u, RouteOptions{});
+		}
+		// Called in place of a route whose validator decided the request: RouteParams::precondition()
+		// says whether to answer 304 or 412 and validators() what to send along. Without one the
+		// validators are not called.
+		template<typename HttpHandler>
+		void precondition(HttpHandler&& func){
+			static_assert(requestFirst_, "Validators need the Request as the first handler argument.");
+			precondition_.emplace(wrap_(std::forward<HttpHandler>(func)), 0u, RouteOptions{});
+		}
 
+		// Flattens the registered routes into the lookup table, call again after adding more.
+		void compile(){
+			// the allow list of a node is at most every method name plus ", " each
+			std::size_t allowSize = 0;
+			for(std::size_t m = 0; m < numMethods_; ++m) allowSize += methodName(static_cast<Method>(m)).size() + 2;
+
+			std::size_t stringsSize = 0;
+			std::vector<const Node*> order{&root};
+			for(std::size_t i = 0; i < order.size(); ++i){
+				const Node* n = order[i];
+				for(const auto& [seg, child] : n->children){
+					stringsSize += seg.size();
+					order.push_back(child.get());
 				}
+				if(n->paramChild) order.push_back(n->paramChild.get());
+				if(n->wildcardChild) order.push_back(n->wildcardChild.get());
+				for(const auto& slot : n->slots){
+					if(!slot) continue;
+					for(const auto& name : slot->captureNames) stringsSize += name.size();
+				}
+				stringsSize += allowSize;
 			}
-			segmentsList.push_back(std::move(segments));
 
-			// std::println("segments: {}", segments);
-			// for(const auto& [k, v] : root.children) std::print("root children added: {}", k);
-			// std::println(", have wild: {}, have param {}", bool(root.wildcardChild), bool(root.paramChild));
+			// reserved up front so the views taken below stay valid
+			strings_.clear();
+			strings_.reserve(stringsSize);
+			auto intern = [this](std::string_view str){
+				std::size_t offset = strings_.size();
+				strings_ += str;
+				return std::string_view{strings_.data() + offset, str.size()};
+			};
+
+			nodes_.assign(order.size(), {});
+			edges_.clear();
+			handlers_.clear();
+			names_.clear();
+			// children were queued in the same order they are numbered here
+			std::uint32_t next = 1;
+			for(std::size_t i = 0; i < order.size(); ++i){
+				const Node* n = order[i];
+				FlatNode& f = nodes_[i];
+				f.edgesBegin = static_cast<std::uint32_t>(edges_.size());
+				f.edgesCount = static_cast<std::uint32_t>(n->children.size());
+				for(const auto& [seg, child] : n->children) edges_.push_back({intern(seg), next++});
+				if(n->paramChild) f.paramChild = next++;
+				if(n->wildcardChild) f.wildcardChild = next++;
+
+				f.handlersBegin = static_cast<std::uint32_t>(handlers_.size());
+				for(std::size_t s = 0; s < n->slots.size(); ++s){
+					const auto& slot = n->slots[s];
+					if(!slot) continue;
+					f.slots |= 1u << s;
+					handlers_.push_back({slot->handler, static_cast<std::uint32_t>(names_.size()), slot->options});
+					for(const auto& name : slot->captureNames) names_.push_back(intern(name));
+				}
 
-			n->handler = std::move(func);
+				if(!f.slots || (f.slots & (1u << anySlot_))) continue;
+				std::string allow;
+				for(std::size_t m = 0; m < numMethods_; ++m){
+					bool served = (f.slots & (1u << m)) ||
+						(static_cast<Method>(m) == Method::Head && (f.slots & (1u << static_cast<std::size_t>(Method::Get))));
+					if(!served || static_cast<Method>(m) == Method::Other) continue;
+					if(!allow.empty()) allow += ", ";
+					allow += methodName(static_cast<Method>(m));
+				}
+				f.allow = intern(allow);
+			}
+		}
 
+		// The route for method and path, or the methodNotAllowed/notFound one, with the captures in
+		// params. Lets the caller look at the route's options before the body is read. nullptr when no
+		// handler applies at all.
+		const Route* match(Method method, std::span<const std::string_view> path, RouteParams& params) const {
+			params.head_ = method == Method::Head;
+			const FlatNode* allowed;
+			std::uint32_t found = match_(method, path, params, allowed);
+			if (found != none_) return &handlers_[found];
+			if(allowed && methodNotAllowed_){
+				params.allow_ = allowed->allow;
+				return &*methodNotAllowed_;
+			}
+			if(notFound_) return &*notFound_;
+			return nullptr;
 		}
 
-		template<typename HttpHandler>
-		void notFound(HttpHandler&& func){
-			notFoundHandler = std::move(func);
-		}
-
-		AwaitT<std::optional<Ret>> handle(std::span<const std::string_view> path, Args... args) const {
-			// std::println("finding path...");
-			const Node* node = find_(&root, path);
-			// for(const auto& [k, v] : root.children) std::println("root children: {}", k);
-			if (node) {
-				// std::println("found path: {}", path);
-				co_return std::optional<Ret>{ co_await (*(node->handler))(std::forward<Args>(args)...) };
-			} else if(notFoundHandler){
-				co_return std::optional<Ret>{ co_await (*notFoundHandler)(std::forward<Args>(args)...) };
+		// Calls the handler of route, or the precondition one when the route's validator decides
+		// the request, and hands back its awaitable without wrapping it in another coroutine. Only
+		// for a HEAD it is wrapped in one that omits the body of the response. params has to
+		// outlive the awaitable.
+		AwaitT<Ret> dispatch(const Route& route, RouteParams& params, Args... args) const {
+			if constexpr (omitsBody_) {
+				if(params.head_) return withoutBody_(call_(route, params, std::forward<Args>(args)...));
 			}
-			co_return std::nullopt;
+			return call_(route, params, std::forward<Args>(args)...);
+		}
+
+		// match() and dispatch() in one, nullopt when no handler applies at all.
+		std::optional<AwaitT<Ret>> handle(Method method, std::span<const std::string_view> path, RouteParams& params, Args... args) const {
+			const Route* route = match(method, path, params);
+			if(!route) return std::nullopt;
+			return dispatch(*route, params, std::forward<Args>(args)...);
+		}
+
+	private:
+		static constexpr bool omitsBody_ = requires(Ret& res) { res.omitBody(); };
+
+		AwaitT<Ret> call_(const Route& route, RouteParams& params, Args... args) const {
+			if constexpr (requestFirst_) {
+				if(route.options.validator && precondition_){
+					const Request& req = [](const Request& r, const auto&...) -> const Request& { return r; }(args...);
+					params.validators_ = route.options.validator(req, params);
+					params.precondition_ = validate(req, params.validators_);
+					if(params.precondition_ != Precondition::Proceed) return precondition_->handler(std::forward<Args>(args)..., params);
+				}
+			}
+			return route.handler(std::forward<Args>(args)..., params);
+		}
+
+		// a HEAD is answered by what the handler makes of the GET, without the body
+		static AwaitT<Ret> withoutBody_(AwaitT<Ret> response){
+			Ret res = co_await std::move(response);
+			res.omitBody();
+			co_return res;
 		}
 	};
 
@@ -275,6 +960,9 @@ static constexpr std::array<std::tuple<int, std::string_view, std::string_view>,
 	{200, "200", "OK"},
 	{201, "201", "Created"},
 	{204, "204", "No Content"},
+	{206, "206", "Partial Content"},
+
+	{304, "304", "Not Modified"},
 
 	{400, "400", "Bad Request"},
 	{401, "401", "Unauthorized"},
@@ -282,6 +970,10 @@ static constexpr std::array<std::tuple<int, std::string_view, std::string_view>,
 	{404, "404", "Not Found"},
 	{405, "405", "Method Not Allowed"},
 	{409, "409", "Conflict"},
+	{412, "412", "Precondition Failed"},
+	{413, "413", "Content Too Large"},
+	{416, "416", "Range Not Satisfiable"},
+	{426, "426", "Upgrade Required"},
 
 	{500, "500", "Internal Server Error"},
 	{501, "501", "Not Implemented"},
@@ -290,6 +982,50 @@ static constexpr std::array<std::tuple<int, std::string_view, std::string_view>,
 	{504, "504", "Gateway Timeout"}
 }};
 
+// "HTTP/1.1 <code> <reason>\r\n" for every status, a 1.0 response patches the minor version
+struct StatusLine_{
+	std::array<char, 48> data{};
+	std::size_t size = 0;
+	constexpr std::string_view view() const noexcept { return {data.data(), size}; }
+};
+static consteval std::array<StatusLine_, static_cast<std::size_t>(Http::Status::_Count)> buildStatusLines_(){
+	std::array<StatusLine_, static_cast<std::size_t>(Http::Status::_Count)> lines{};
+	for(std::size_t i = 0; i < lines.size(); ++i){
+		auto& line = lines[i];
+		auto append = [&](std::string_view str){ for(char c : str) line.data[line.size++] = c; };
+		const auto& [intStatus, strStatus, reason] = statusStrArr_[i];
+		append("HTTP/1.1 ");
+		append(strStatus);
+		append(" ");
+		append(reason);
+		append("\r\n");
+	}
+	return lines;
+}
+static constexpr auto statusLines_ = buildStatusLines_();
+static constexpr std::size_t statusLineMinorIdx_ = 7;
+
+static constexpr std::array<std::string_view, static_cast<std::size_t>(Http::Method::_Count)> methodStrArr_{
+	"GET",
+	"HEAD",
+	"POST",
+	"PUT",
+	"DELETE",
+	"CONNECT",
+	"OPTIONS",
+	"TRACE",
+	"PATCH",
+	""
+};
+
+// method names are case-sensitive, the compares mostly stop at the length check
+static Http::Method methodFromName_(std::string_view name) noexcept {
+	for(std::size_t i = 0; i < static_cast<std::size_t>(Http::Method::Other); ++i){
+		if(methodStrArr_[i] == name) return static_cast<Http::Method>(i);
+	}
+	return Http::Method::Other;
+}
+
 static constexpr std::array<std::string_view, static_cast<std::size_t>(Http::Field::_Count)> fieldStrArr_{
 	"Host",
 	"Content-Length",
@@ -299,7 +1035,40 @@ static constexpr std::array<std::string_view, static_cast<std::size_t>(Http::Fie
 	"User-Agent",
 	"Transfer-Encoding",
 	"Authorization",
-	"Cookie"
+	"Cookie",
+	"Accept-Encoding",
+	"Accept-Language",
+	"Accept-Ranges",
+	"Access-Control-Allow-Origin",
+	"Allow",
+	"Cache-Control",
+	"Content-Encoding",
+	"Content-Range",
+	"Date",
+	"ETag",
+	"Expect",
+	"If-Match",
+	"If-Modified-Since",
+	"If-None-Match",
+	"If-Range",
+	"If-Unmodified-Since",
+	"Keep-Alive",
+	"Last-Modified",
+	"Location",
+	"Origin",
+	"Range",
+	"Referer",
+	"Retry-After",
+	"Sec-WebSocket-Accept",
+	"Sec-WebSocket-Extensions",
+	"Sec-WebSocket-Key",
+	"Sec-WebSocket-Protocol",
+	"Sec-WebSocket-Version",
+	"Server",
+	"Set-Cookie",
+	"Upgrade",
+	"Vary",
+	"X-Forwarded-For"
 };
 static constexpr std::array<std::string_view, static_cast<std::size_t>(Http::Field::_Count)> fieldStrArrLower_{
 	"host",
@@ -310,11 +1079,84 @@ static constexpr std::array<std::string_view, static_cast<std::size_t>(Http::Fie
 	"user-agent",
 	"transfer-encoding",
 	"authorization",
-	"cookie"
+	"cookie",
+	"accept-encoding",
+	"accept-language",
+	"accept-ranges",
+	"access-control-allow-origin",
+	"allow",
+	"cache-control",
+	"content-encoding",
+	"content-range",
+	"date",
+	"etag",
+	"expect",
+	"if-match",
+	"if-modified-since",
+	"if-none-match",
+	"if-range",
+	"if-unmodified-since",
+	"keep-alive",
+	"last-modified",
+	"location",
+	"origin",
+	"range",
+	"referer",
+	"retry-after",
+	"sec-websocket-accept",
+	"sec-websocket-extensions",
+	"sec-websocket-key",
+	"sec-websocket-protocol",
+	"sec-websocket-version",
+	"server",
+	"set-cookie",
+	"upgrade",
+	"vary",
+	"x-forwarded-for"
+};
+
+// Perfect hash over the lowercase field names, the seed is searched at compile time. Hashing ORs
+// 0x20 into every byte, which folds letters and leaves '-' and digits alone, so a name in any case
+// lands on the slot of its lowercase spelling; the slot is then confirmed with one compare.
+static constexpr std::uint32_t fieldHash_(std::string_view name, std::uint32_t seed) noexcept {
+	std::uint32_t h = seed;
+	for(char c : name) h = (h ^ static_cast<std::uint8_t>(c | 0x20)) * 16777619u;
+	return h ^ (h >> 16);
+}
+
+struct FieldTable_{
+	static constexpr std::size_t size = 256;
+	std::uint32_t seed;
+	std::array<std::uint8_t, size> slots;
 };
 
+static consteval FieldTable_ buildFieldTable_(){
+	for(std::uint32_t seed = 2166136261u; ; ++seed){
+		FieldTable_ table{seed, {}};
+		table.slots.fill(0xFF);
+		bool collided = false;
+		for(std::size_t i = 0; i < fieldStrArrLower_.size() && !collided; ++i){
+			auto& slot = table.slots[fieldHash_(fieldStrArrLower_[i], seed) % FieldTable_::size];
+			if(slot != 0xFF) collided = true;
+			else slot = static_cast<std::uint8_t>(i);
+		}
+		if(!collided) return table;
+	}
+}
+static constexpr FieldTable_ fieldTable_ = buildFieldTable_();
+
 export
 namespace Http{
+	std::optional<Field> fieldFromName(std::string_view name) noexcept {
+		auto idx = fieldTable_.slots[fieldHash_(name, fieldTable_.seed) % FieldTable_::size];
+		if(idx == 0xFF || !Simd::equalsIgnoreCase(name, fieldStrArrLower_[idx])) return std::nullopt;
+		return static_cast<Field>(idx);
+	}
+
+	std::string_view methodName(Method method) noexcept {
+		return methodStrArr_[static_cast<std::size_t>(method)];
+	}
+
 	/*~~~~~~~~~~~~~~~~~~~~~~~REQUEST~~~~~~~~~~~~~~~~~~~~~~~*/
 	Request::Request(std::span<std::byte> headerBuffer) noexcept:
 		headerBuffer_(headerBuffer),
@@ -322,17 +1164,18 @@ namespace Http{
 	{
 		chunkedDecoder_ = {};
 		chunkedDecoder_.consume_trailer = 1;
+		firstIdx_.fill(noIndex_);
 	}
 	Request::Request(std::size_t maxHeaderSize):
 		maxHeaderSize_(maxHeaderSize)
 	{
 		chunkedDecoder_ = {};
 		chunkedDecoder_.consume_trailer = 1;
-		headerBufferOptionalData_.resize(maxHeaderSize_);
-		headerBuffer_ = {headerBufferOptionalData_.data(), maxHeaderSize_};
+		firstIdx_.fill(noIndex_);
 	}
 
-	bool Request::deserialize_(){ //TODO: use error code
+	// Returns what phr_parse_request returns: the header length, -2 if incomplete or -1 on error.
+	int Request::deserialize_(std::size_t lastLen){ //TODO: use error code
 		const char* method = nullptr;
 		const char* target = nullptr;
 		size_t methodLen, targetLen;
@@ -340,14 +1183,15 @@ namespace Http{
 		numHeaders_ = maxNumHeaders_;
 		phr_header headers[maxNumHeaders_];
 
-		int ret = phr_parse_request(reinterpret_cast<const char*>(headerBuffer_.data()), headerBuffer_.size(),
+		int ret = phr_parse_request(reinterpret_cast<const char*>(header_.data()), header_.size(),
 									&method, &methodLen,
 									&target, &targetLen,
-									&minorVersion, headers, &numHeaders_, 0);
+									&minorVersion, headers, &numHeaders_, lastLen);
 
-		if(ret <= 0) return false;
+		if(ret <= 0) return ret;
 
 		method_ = std::string_view{method, methodLen};
+		methodId_ = methodFromName_(method_);
 		target_ = std::string_view{target, targetLen};
 		if(minorVersion == 0) version_ = "1.0";
 		else if(minorVersion == 1) version_ = "1.1";
@@ -357,14 +1201,14 @@ namespace Http{
 			std::string_view name {headers[i].name, headers[i].name_len};
 			std::string_view value {headers[i].value, headers[i].value_len};
 			fields_[i] = {name, value};
-			// fields_[name].push_back(value);
 		}
+		indexFields_();
 
 		auto cl = get(Http::Field::ContentLength);
 		if(cl){
 			std::size_t value;
 			auto [ptr, ec] = std::from_chars(cl->data(), cl->data() + cl->size(), value);
-			if (ec != std::errc{}) return false; //content length field but invalid
+			if (ec != std::errc{}) return -1; //content length field but invalid
 			contentLength_ = value;
 		}
 		if(!contentLength_){
@@ -389,7 +1233,7 @@ namespace Http{
 		}
 		if (pathPart.back() == '/') path_.emplace_back("");
 
-		if (qPos == std::string_view::npos) return true;
+		if (qPos == std::string_view::npos) return ret;
 		std::string_view query = target_.substr(qPos + 1);
 		start = 0;
 		while (start < query.size()) {
@@ -406,42 +1250,57 @@ namespace Http{
 			start = amp + 1;
 		}
 
-		return true;
+		return ret;
 	}
 
-	std::optional<std::string_view> Request::get(Field field) const noexcept {
-		const auto& fieldStr = fieldStrArr_[static_cast<std::size_t>(field)];
-		const auto& fieldStrLower = fieldStrArrLower_[static_cast<std::size_t>(field)];
-		for(int i = 0; i < numHeaders_; ++i){
-			const auto& [k, v] = fields_[i];
-			if(k == fieldStr || k == fieldStrLower) return v;
+	void Request::indexFields_() noexcept {
+		firstIdx_.fill(noIndex_);
+		// walk backwards so every chain ends up in arrival order
+		for(std::size_t i = numHeaders_; i-- > 0;){
+			auto field = fieldFromName(fields_[i].first);
+			if(!field) continue;
+			auto& first = firstIdx_[static_cast<std::size_t>(*field)];
+			nextIdx_[i] = first;
+			first = static_cast<std::uint8_t>(i);
 		}
-		return std::nullopt;
 	}
-	std::optional<std::string_view> Request::get(std::string_view field) const noexcept {
-		for(int i = 0; i < numHeaders_; ++i){
-			const auto& [k, v] = fields_[i];
-			if(k == field) return v;
+	std::uint8_t Request::findName_(std::size_t from, std::string_view name) const noexcept {
+		for(std::size_t i = from; i < numHeaders_; ++i){
+			if(Simd::equalsIgnoreCase(fields_[i].first, name)) return static_cast<std::uint8_t>(i);
 		}
-		return std::nullopt;
+		return noIndex_;
 	}
-	std::vector<std::string_view> Request::getList(Field field) const noexcept {
-		const auto& fieldStr = fieldStrArr_[static_cast<std::size_t>(field)];
-		const auto& fieldStrLower = fieldStrArrLower_[static_cast<std::size_t>(field)];
-		std::vector<std::string_view> ret;
-		for(int i = 0; i < numHeaders_; ++i){
-			const auto& [k, v] = fields_[i];
-			if(k == fieldStr || k == fieldStrLower) ret.push_back(v);
-		}
-		return ret;
+	std::uint8_t Request::nextMatch_(std::uint8_t idx, std::string_view name) const noexcept {
+		if(name.empty()) return nextIdx_[idx];
+		return findName_(idx + 1, name);
 	}
-	std::vector<std::string_view> Request::getList(std::string_view field) const noexcept{
-		std::vector<std::string_view> ret;
-		for(int i = 0; i < numHeaders_; ++i){
-			const auto& [k, v] = fields_[i];
-			if(k == field) ret.push_back(v);
-		}
-		return ret;
+
+	std::optional<std::string_view> Request::get(Field field) const noexcept {
+		auto idx = firstIdx_[static_cast<std::size_t>(field)];
+		if(idx == noIndex_) return std::nullopt;
+		return fields_[idx].second;
+	}
+	std::optional<std::string_view> Request::get(std::string_view field) const noexcept {
+		if(auto known = fieldFromName(field)) return get(*known);
+		auto idx = findName_(0, field);
+		if(idx == noIndex_) return std::nullopt;
+		return fields_[idx].second;
+	}
+	Request::FieldValues Request::getList(Field field) const noexcept {
+		return FieldValues::iterator{this, firstIdx_[static_cast<std::size_t>(field)], {}};
+	}
+	Request::FieldValues Request::getList(std::string_view field) const noexcept{
+		if(auto known = fieldFromName(field)) return getList(*known);
+		if(field.empty()) return FieldValues::iterator{};
+		return FieldValues::iterator{this, findName_(0, field), field};
+	}
+
+	void Request::reserveHeader_(std::size_t size){
+		if(headerBuffer_.size() >= size) return;
+		// own storage, grow it towards maxHeaderSize_
+		std::size_t newSize = std::min(std::max(size, headerBuffer_.size() * 2), maxHeaderSize_);
+		headerBlock_.grow(newSize, headerBufferIdx_);
+		headerBuffer_ = headerBlock_.span();
 	}
 
 	std::tuple<Error, bool, std::size_t> Request::consumeHeaderSome(std::span<const std::byte> data){
@@ -449,34 +1308,112 @@ namespace Http{
 		bool readAll = writeable >= data.size();
 		std::size_t maxRead = readAll ? data.size() : writeable;
 
+		if(scanMode_ == ScanMode::INCREMENTAL){
+			reserveHeader_(headerBufferIdx_ + maxRead);
+			std::memcpy(headerBuffer_.data() + headerBufferIdx_, data.data(), maxRead);
+			std::size_t lastLen = headerBufferIdx_;
+			headerBufferIdx_ += maxRead;
+
+			header_ = headerBuffer_.first(headerBufferIdx_);
+			int ret = deserialize_(lastLen);
+			if(ret == -2){
+				if(!readAll) return {ErrorCode::INVALID_MESSAGE, true, 0};
+				return {{}, false, maxRead};
+			}
+			if(ret < 0) return {ErrorCode::INVALID_MESSAGE, true, 0};
+			headerBufferIdx_ = ret; // whatever followed the header stays in the caller's buffer
+			header_ = headerBuffer_.first(headerBufferIdx_);
+			return {{}, true, ret - lastLen};
+		}
+
 		std::size_t numRead = maxRead;
-		for(std::size_t i = 0; i < maxRead; ++i){
-			const char& c = static_cast<char>(data[i]);
-			if(c == '\r' && last_ != '\r') ++numFound_;
-			else if(c == '\n' && last_ == '\r') ++numFound_;
-			else numFound_ = 0;
-			last_ = c;
-
-			if(numFound_ == 4) {
-				numRead = i + 1;
+		bool finished = false;
+		// the terminator may straddle two reads, check the seam between what we have and data
+		std::size_t tail = std::min<std::size_t>(headerBufferIdx_, 3);
+		if(tail > 0){
+			std::array<std::byte, 6> seam;
+			std::size_t head = std::min<std::size_t>(maxRead, 3);
+			std::memcpy(seam.data(), headerBuffer_.data() + headerBufferIdx_ - tail, tail);
+			std::memcpy(seam.data() + tail, data.data(), head);
+			std::size_t end = Simd::findHeaderEnd(std::span{seam}.first(tail + head));
+			if(end != std::string_view::npos){
+				numRead = end - tail;
+				finished = true;
+			}
+		}
+		if(!finished){
+			std::size_t end = Simd::findHeaderEnd(data.first(maxRead));
+			if(end != std::string_view::npos){
+				numRead = end;
+				finished = true;
 			}
 		}
-		bool finished = numFound_ == 4;
 
-		if((numRead == writeable) && !finished) return {ErrorCode::INVALID_MESSAGE, true, 0};
+		if(!readAll && !finished) return {ErrorCode::INVALID_MESSAGE, true, 0};
 
+		reserveHeader_(headerBufferIdx_ + numRead);
 		std::memcpy(headerBuffer_.data() + headerBufferIdx_, data.data(), numRead);
 		headerBufferIdx_ += numRead;
 
 		if(finished){
-			bool success = deserialize_();
-			if(!success) return {ErrorCode::INVALID_MESSAGE, true, 0};
+			header_ = headerBuffer_.first(headerBufferIdx_);
+			if(deserialize_(0) <= 0) return {ErrorCode::INVALID_MESSAGE, true, 0};
 		}
 		return {{}, finished, numRead};
 	}
+	std::tuple<Error, bool, std::size_t> Request::consumeHeaderInPlace(std::span<const std::byte> data){
+		std::size_t avail = std::min(data.size(), maxHeaderSize_);
+		std::size_t end;
+		if(scanMode_ == ScanMode::INCREMENTAL){
+			header_ = data.first(avail);
+			int ret = deserialize_(scanned_);
+			if(ret == -2){
+				if(avail == maxHeaderSize_) return {ErrorCode::INVALID_MESSAGE, true, 0};
+				scanned_ = avail;
+				return {{}, false, 0};
+			}
+			if(ret < 0) return {ErrorCode::INVALID_MESSAGE, true, 0};
+			end = ret;
+		} else {
+			end = Simd::findHeaderEnd(data.first(avail), scanned_);
+			if(end == std::string_view::npos){
+				if(avail == maxHeaderSize_) return {ErrorCode::INVALID_MESSAGE, true, 0};
+				scanned_ = avail >= 3 ? avail - 3 : 0;
+				return {{}, false, 0};
+			}
+			header_ = data.first(end);
+			if(deserialize_(0) <= 0) return {ErrorCode::INVALID_MESSAGE, true, 0};
+		}
+		header_ = data.first(end);
+		inPlace_ = true;
+		return {{}, true, end};
+	}
+	Error Request::detachHeader(){
+		if(!inPlace_) return {};
+		if(headerBufferIdx_ != 0 || header_.size() > maxHeaderSize_) return {ErrorCode::INVALID_STATE};
+		reserveHeader_(header_.size());
+		std::memcpy(headerBuffer_.data(), header_.data(), header_.size());
+
+		const char* oldBase = reinterpret_cast<const char*>(header_.data());
+		const char* newBase = reinterpret_cast<const char*>(headerBuffer_.data());
+		auto rebase = [&](std::string_view& sv){
+			if(sv.data() >= oldBase && sv.data() < oldBase + header_.size())
+				sv = {newBase + (sv.data() - oldBase), sv.size()};
+		};
+		rebase(method_);
+		rebase(target_);
+		for(auto& seg : path_) rebase(seg);
+		for(auto& [k, v] : params_) { rebase(k); rebase(v); }
+		for(std::size_t i = 0; i < numHeaders_; ++i) { rebase(fields_[i].first); rebase(fields_[i].second); }
+
+		headerBufferIdx_ = header_.size();
+		header_ = headerBuffer_.first(headerBufferIdx_);
+		inPlace_ = false;
+		return {};
+	}
 	std::tuple<Error, bool, std::size_t> Request::consumeBodySome(std::span<const std::byte> data){
 		if(contentLength_ && *contentLength_ > 0){
-			if(*contentLength_ > maxBodySize_) return {ErrorCode::INVALID_MESSAGE, true, 0};
+			if(*contentLength_ > maxBodySize_) return {ErrorCode::BODY_TOO_LARGE, true, 0};
 			if(body_.size() != *contentLength_) body_.resize(*contentLength_);
 			std::size_t writeable = *contentLength_ - bodyIdx_;
 			std::size_t numCopy = std::min(data.size(), writeable);
@@ -491,26 +1428,44 @@ namespace Http{
 			std::size_t writeable = maxBodySize_ - bodyIdx_;
 			std::size_t numCopy = std::min(data.size(), writeable);
 
+			if(writeable == 0) return {ErrorCode::BODY_TOO_LARGE, true, 0};
 			if(body_.size() < 1024) body_.resize(1024);
-			if(body_.size() < bodyIdx_ + numCopy) body_.resize(std::min(maxBodySize_, body_.size() * 2));
-			if(writeable == 0) return {ErrorCode::INVALID_MESSAGE, true, 0};
+			if(body_.size() < bodyIdx_ + numCopy) body_.resize(std::min(maxBodySize_, std::max(body_.size() * 2, bodyIdx_ + numCopy)));
 
 			std::memcpy(body_.data() + bodyIdx_, data.data(), numCopy);
-			int ret = phr_decode_chunked(&chunkedDecoder_, (char*)(body_.data() + bodyIdx_), &numCopy); //modify body_ in place;
+			std::size_t decoded = numCopy;
+			int ret = phr_decode_chunked(&chunkedDecoder_, (char*)(body_.data() + bodyIdx_), &decoded); //modify body_ in place;
 			if(ret == -1) return {ErrorCode::INVALID_MESSAGE, true, 0};
-			else if(ret == -2) {
-				bodyIdx_ += numCopy;
-				return {{}, false, numCopy};
-			}
-			else {
-				std::size_t encoded = numCopy - ret;
-				body_.resize(bodyIdx_ + encoded);
-				return {{}, true, encoded};
-			}
+			bodyIdx_ += decoded;
+			if(ret == -2) return {{}, false, numCopy};
+			// ret bytes past the body belong to the next message
+			body_.resize(bodyIdx_);
+			return {{}, true, numCopy - static_cast<std::size_t>(ret)};
 		}
 		//there's no body here
 		return {{}, true, 0};
 	}
+	std::tuple<Error, bool, std::size_t, std::span<const std::byte>> Request::consumeBodyInPlace(std::span<std::byte> data){
+		if(contentLength_ && *contentLength_ > 0){
+			if(*contentLength_ > maxBodySize_) return {ErrorCode::BODY_TOO_LARGE, true, 0, {}};
+			std::size_t n = std::min(data.size(), *contentLength_ - bodyIdx_);
+			bodyIdx_ += n;
+			return {{}, bodyIdx_ >= *contentLength_, n, data.first(n)};
+		}
+		else if(chunked_){
+			std::size_t decoded = data.size();
+			int ret = phr_decode_chunked(&chunkedDecoder_, reinterpret_cast<char*>(data.data()), &decoded);
+			if(ret == -1) return {ErrorCode::INVALID_MESSAGE, true, 0, {}};
+			bodyIdx_ += decoded;
+			if(bodyIdx_ > maxBodySize_) return {ErrorCode::BODY_TOO_LARGE, true, 0, {}};
+			if(ret == -2) return {{}, false, data.size(), data.first(decoded)};
+			// the bytes after the body sit behind the decoded ones, keep them where consuming stops
+			std::size_t rest = static_cast<std::size_t>(ret);
+			std::memmove(data.data() + data.size() - rest, data.data() + decoded, rest);
+			return {{}, true, data.size() - rest, data.first(decoded)};
+		}
+		return {{}, true, 0, {}};
+	}
 	std::tuple<Error, bool, std::size_t> Request::produceHeaderSome(std::span<std::byte> out){
 		return {ErrorCode::INVALID_MESSAGE, true, 0};
 	}
@@ -519,9 +1474,233 @@ namespace Http{
 	}
 
 
+	/*~~~~~~~~~~~~~~~~~~~~~~~DATE~~~~~~~~~~~~~~~~~~~~~~~*/
+	static constexpr std::string_view dayNames_{"SunMonTueWedThuFriSat"};
+	static constexpr std::string_view monthNames_{"JanFebMarAprMayJunJulAugSepOctNovDec"};
+
+	std::array<char, 29> formatDate(std::chrono::sys_seconds time) noexcept {
+		auto day = std::chrono::floor<std::chrono::days>(time);
+		std::chrono::year_month_day ymd{day};
+		std::chrono::hh_mm_ss hms{time - day};
+		unsigned wd = std::chrono::weekday{day}.c_encoding();
+		unsigned month = static_cast<unsigned>(ymd.month()) - 1;
+
+		std::array<char, 29> buf;
+		char* p = buf.data();
+		auto two = [&](unsigned v){ *p++ = static_cast<char>('0' + v / 10); *p++ = static_cast<char>('0' + v % 10); };
+		std::memcpy(p, dayNames_.data() + wd * 3, 3); p += 3;
+		*p++ = ','; *p++ = ' ';
+		two(static_cast<unsigned>(ymd.day()));
+		*p++ = ' ';
+		std::memcpy(p, monthNames_.data() + month * 3, 3); p += 3;
+		*p++ = ' ';
+		int year = static_cast<int>(ymd.year());
+		two(static_cast<unsigned>(year / 100));
+		two(static_cast<unsigned>(year % 100));
+		*p++ = ' ';
+		two(static_cast<unsigned>(hms.hours().count()));
+		*p++ = ':';
+		two(static_cast<unsigned>(hms.minutes().count()));
+		*p++ = ':';
+		two(static_cast<unsigned>(hms.seconds().count()));
+		std::memcpy(p, " GMT", 4);
+		return buf;
+	}
+	std::optional<std::chrono::sys_seconds> parseDate(std::string_view value) noexcept {
+		// "Sun, 06 Nov 1994 08:49:37 GMT"
+		if(value.size() != 29 || value.substr(3, 2) != ", " || value.substr(25) != " GMT") return std::nullopt;
+		auto num = [&](std::size_t pos, std::size_t len) -> std::optional<unsigned> {
+			unsigned v = 0;
+			auto [ptr, ec] = std::from_chars(value.data() + pos, value.data() + pos + len, v);
+			if(ec != std::errc{} || ptr != value.data() + pos + len) return std::nullopt;
+			return v;
+		};
+		auto month = monthNames_.find(value.substr(8, 3));
+		auto day = num(5, 2), year = num(12, 4), h = num(17, 2), m = num(20, 2), sec = num(23, 2);
+		if(month == std::string_view::npos || month % 3 || !day || !year || !h || !m || !sec) return std::nullopt;
+		if(value[7] != ' ' || value[11] != ' ' || value[16] != ' ' || value[19] != ':' || value[22] != ':') return std::nullopt;
+		std::chrono::year_month_day ymd{std::chrono::year(static_cast<int>(*year)), std::chrono::month(static_cast<unsigned>(month / 3 + 1)), std::chrono::day(*day)};
+		if(!ymd.ok() || *h > 23 || *m > 59 || *sec > 60) return std::nullopt;
+		return std::chrono::sys_days{ymd} + std::chrono::hours{*h} + std::chrono::minutes{*m} + std::chrono::seconds{*sec};
+	}
+
+	DateCache& DateCache::local() noexcept {
+		thread_local DateCache cache;
+		return cache;
+	}
+	void DateCache::refresh() noexcept {
+		buf_ = formatDate(std::chrono::floor<std::chrono::seconds>(std::chrono::system_clock::now()));
+		valid_ = true;
+	}
+	std::string_view DateCache::value() noexcept {
+		if(!valid_) refresh();
+		return {buf_.data(), buf_.size()};
+	}
+
+	/*~~~~~~~~~~~~~~~~~~~~~~~FILE~~~~~~~~~~~~~~~~~~~~~~~*/
+	static std::int64_t statModifiedNs_(const struct stat& st) noexcept {
+		return static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1'000'000'000 + st.st_mtim.tv_nsec;
+	}
+
+	File::File(int fd, std::uint64_t size, std::uint64_t device, std::uint64_t inode, std::int64_t modifiedNs):
+		fd_(fd), size_(size), device_(device), inode_(inode), modifiedNs_(modifiedNs)
+	{
+		etag_ = std::format("\"{:x}-{:x}\"", size_, modifiedNs_);
+		lastModified_ = formatDate(modified());
+	}
+	File::~File(){
+		if(fd_ >= 0) ::close(fd_);
+	}
+	std::shared_ptr<const File> File::open(const std::string& path){
+		int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd < 0) return nullptr;
+		struct stat st;
+		if(::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)){
+			::close(fd);
+			return nullptr;
+		}
+		return std::shared_ptr<const File>(new File(fd, static_cast<std::uint64_t>(st.st_size), st.st_dev, st.st_ino, statModifiedNs_(st)));
+	}
+	std::chrono::sys_seconds File::modified() const noexcept {
+		return std::chrono::sys_seconds{std::chrono::seconds{modifiedNs_ / 1'000'000'000}};
+	}
+	bool File::unchanged(const std::string& path) const noexcept {
+		struct stat st;
+		if(::stat(path.c_str(), &st) != 0) return false;
+		return st.st_dev == device_ && st.st_ino == inode_ &&
+			static_cast<std::uint64_t>(st.st_size) == size_ && statModifiedNs_(st) == modifiedNs_;
+	}
+
+	std::tuple<RangeStatus, std::vector<ByteRange>> parseRanges(std::string_view value, std::uint64_t size, std::size_t maxRanges){
+		static constexpr std::string_view unit{"bytes="};
+		if(!value.starts_with(unit)) return {RangeStatus::Ignore, {}};
+		value.remove_prefix(unit.size());
+
+		auto number = [](std::string_view digits) -> std::optional<std::uint64_t> {
+			std::uint64_t v = 0;
+			auto [ptr, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), v);
+			if(digits.empty() || ec != std::errc{} || ptr != digits.data() + digits.size()) return std::nullopt;
+			return v;
+		};
+		std::vector<ByteRange> ranges;
+		bool any = false;
+		while(!value.empty()){
+			auto comma = value.find(',');
+			auto spec = value.substr(0, comma);
+			value = comma == std::string_view::npos ? std::string_view{} : value.substr(comma + 1);
+			while(!spec.empty() && (spec.front() == ' ' || spec.front() == '\t')) spec.remove_prefix(1);
+			while(!spec.empty() && (spec.back() == ' ' || spec.back() == '\t')) spec.remove_suffix(1);
+			if(spec.empty()) continue; // empty list elements are allowed
+
+			auto dash = spec.find('-');
+			if(dash == std::string_view::npos) return {RangeStatus::Ignore, {}};
+			any = true;
+			auto firstStr = spec.substr(0, dash), lastStr = spec.substr(dash + 1);
+			if(firstStr.empty()){
+				// "-n", the last n bytes
+				auto suffix = number(lastStr);
+				if(!suffix) return {RangeStatus::Ignore, {}};
+				if(*suffix > 0 && size > 0) ranges.push_back({size - std::min(*suffix, size), size - 1});
+				continue;
+			}
+			auto first = number(firstStr);
+			if(!first) return {RangeStatus::Ignore, {}};
+			std::uint64_t last = size - 1;
+			if(!lastStr.empty()){
+				auto l = number(lastStr);
+				if(!l || *l < *first) return {RangeStatus::Ignore, {}};
+				last = std::min(*l, size - 1);
+			}
+			if(*first < size) ranges.push_back({*first, last});
+		}
+		if(!any) return {RangeStatus::Ignore, {}};
+		if(ranges.empty()) return {RangeStatus::Unsatisfiable, {}};
+
+		// overlapping and adjacent ranges become one, so no byte is sent twice
+		std::ranges::sort(ranges, {}, &ByteRange::first);
+		std::size_t n = 0;
+		for(std::size_t i = 1; i < ranges.size(); ++i){
+			if(ranges[i].first <= ranges[n].last + 1) ranges[n].last = std::max(ranges[n].last, ranges[i].last);
+			else ranges[++n] = ranges[i];
+		}
+		ranges.resize(n + 1);
+		if(ranges.size() > maxRanges) return {RangeStatus::Ignore, {}};
+		return {RangeStatus::Satisfiable, std::move(ranges)};
+	}
+
+	bool etagMatches(std::string_view list, std::string_view etag, bool weak) noexcept {
+		bool etagWeak = etag.starts_with("W/");
+		std::string_view etagOpaque = etagWeak ? etag.substr(2) : etag;
+		std::size_t i = 0;
+		while(i < list.size()){
+			char c = list[i];
+			if(c == ' ' || c == '\t' || c == ','){ ++i; continue; }
+			if(c == '*') return true;
+			// a tag is read up to its closing quote, a comma is a valid character inside one
+			bool tagWeak = list.substr(i).starts_with("W/");
+			std::size_t open = tagWeak ? i + 2 : i;
+			if(open >= list.size() || list[open] != '"') return false;
+			std::size_t close = list.find('"', open + 1);
+			if(close == std::string_view::npos) return false;
+			std::string_view opaque = list.substr(open, close - open + 1);
+			if(opaque == etagOpaque && (weak || (!tagWeak && !etagWeak))) return true;
+			i = close + 1;
+		}
+		return false;
+	}
+
+	Precondition validate(const Request& req, const Validators& validators) noexcept {
+		bool safe = req.methodId() == Method::Get || req.methodId() == Method::Head;
+		if(auto ifMatch = req.get(Field::IfMatch)){
+			if(!etagMatches(*ifMatch, validators.etag, false)) return Precondition::Failed;
+		} else if(auto since = req.get(Field::IfUnmodifiedSince)){
+			auto date = parseDate(*since);
+			if(date && validators.lastModified && *validators.lastModified > *date) return Precondition::Failed;
+		}
+		if(auto ifNoneMatch = req.get(Field::IfNoneMatch)){
+			if(etagMatches(*ifNoneMatch, validators.etag, true)) return safe ? Precondition::NotModified : Precondition::Failed;
+		} else if(auto since = req.get(Field::IfModifiedSince); since && safe){
+			auto date = parseDate(*since);
+			if(date && validators.lastModified && *validators.lastModified <= *date) return Precondition::NotModified;
+		}
+		return Precondition::Proceed;
+	}
+
+	/*~~~~~~~~~~~~~~~~~~~~~~~RESPONSE TEMPLATE~~~~~~~~~~~~~~~~~~~~~~~*/
+	ResponseTemplate::ResponseTemplate(Http::Status status):
+		header_(statusLines_[static_cast<std::size_t>(status)].view())
+	{}
+	ResponseTemplate::ResponseTemplate(std::pair<int, std::string_view> status){
+		char buf[10];
+		auto [ptr, ec] = std::to_chars(buf, buf + sizeof(buf), status.first);
+		header_.append("HTTP/1.1 ").append(buf, ptr).append(" ").append(status.second).append("\r\n");
+	}
+	void ResponseTemplate::set(Http::Field field, std::string_view value){
+		if(field == Http::Field::ContentType) hasContentType_ = true;
+		else if(field == Http::Field::Connection) hasConnection_ = true;
+		else if(field == Http::Field::Date) hasDate_ = true;
+		header_.append(fieldStrArr_[static_cast<std::size_t>(field)]).append(": ");
+		if(field == Http::Field::Connection){
+			connectionIdx_ = header_.size();
+			connectionSize_ = value.size();
+		}
+		header_.append(value).append("\r\n");
+	}
+	void ResponseTemplate::set(std::string_view field, std::string_view value){
+		if(auto known = fieldFromName(field)) return set(*known, value);
+		header_.append(field).append(": ").append(value).append("\r\n");
+	}
+
 	/*~~~~~~~~~~~~~~~~~~~~~~~RESPONSE~~~~~~~~~~~~~~~~~~~~~~~*/
+	static constexpr bool isBodiless_(std::string_view status) noexcept {
+		return status.size() == 3 && (status[0] == '1' || status == "204" || status == "304");
+	}
+
 	void Response::init_(std::string_view status, std::string_view reason, std::string_view version){
 		if(version == "1.0") defaultKeepAlive_ = false;
+		bodiless_ = isBodiless_(status);
+		switching_ = status == "101";
+		omitBody_ = bodiless_;
 
 		static constexpr std::string_view first{"HTTP/"};
 		static constexpr std::string_view rn{"\r\n"};
@@ -539,23 +1718,61 @@ namespace Http{
 		std::memcpy(headerBuffer_.data() + headerBufferIdx_, rn.data(), rn.size()); headerBufferIdx_ += rn.size();
 	}
 
+	void Response::init_(Http::Status status, std::string_view version){
+		bodiless_ = isBodiless_(std::get<1>(statusStrArr_[static_cast<std::size_t>(status)]));
+		switching_ = status == Http::Status::SwitchingProtocols;
+		omitBody_ = bodiless_;
+		if(version != "1.1" && version != "1.0"){
+			const auto& [intStatus, strStatus, reason] = statusStrArr_[static_cast<std::size_t>(status)];
+			init_(strStatus, reason, version);
+			return;
+		}
+		auto line = statusLines_[static_cast<std::size_t>(status)].view();
+		alloc_(line.size());
+		std::memcpy(headerBuffer_.data() + headerBufferIdx_, line.data(), line.size());
+		if(version == "1.0"){
+			headerBuffer_[headerBufferIdx_ + statusLineMinorIdx_] = std::byte{'0'};
+			defaultKeepAlive_ = false;
+		}
+		headerBufferIdx_ += line.size();
+	}
+	void Response::init_(const ResponseTemplate& tmpl, std::string_view version){
+		alloc_(tmpl.header_.size());
+		std::memcpy(headerBuffer_.data() + headerBufferIdx_, tmpl.header_.data(), tmpl.header_.size());
+		if(version == "1.0"){
+			headerBuffer_[headerBufferIdx_ + statusLineMinorIdx_] = std::byte{'0'};
+			defaultKeepAlive_ = false;
+		}
+		headerBufferIdx_ += tmpl.header_.size();
+		// the code sits right after "HTTP/1.1 "
+		bodiless_ = isBodiless_(std::string_view{tmpl.header_}.substr(9, 3));
+		switching_ = std::string_view{tmpl.header_}.substr(9, 3) == "101";
+		omitBody_ = bodiless_;
+		hasContentType_ = tmpl.hasContentType_;
+		hasConnection_ = tmpl.hasConnection_;
+		hasDate_ = tmpl.hasDate_;
+		if(tmpl.connectionSize_ > 0){
+			connectionIdx_ = headerBufferIdx_ - tmpl.header_.size() + tmpl.connectionIdx_;
+			connectionSize_ = tmpl.connectionSize_;
+		}
+	}
+
 	void Response::alloc_(std::size_t num){
 		if(headerBuffer_.size() <= headerBufferIdx_ + num){
 			const std::size_t newSize = std::max(
 				headerBuffer_.size() + (headerBuffer_.size() >> 1) + 1,
 				headerBufferIdx_ + num
 			);
-			std::vector<std::byte> newBuf;
-			newBuf.reserve(newSize);
-			std::memcpy(newBuf.data(), headerBuffer_.data(), headerBufferIdx_);
-			headerBufferOptionalData_.swap(newBuf);
-			headerBuffer_ = std::span<std::byte>(headerBufferOptionalData_.data(), headerBufferOptionalData_.capacity());
+			PoolBlock newBlock{newSize};
+			if(headerBufferIdx_ > 0) std::memcpy(newBlock.data(), headerBuffer_.data(), headerBufferIdx_);
+			headerBlock_ = std::move(newBlock);
+			headerBuffer_ = headerBlock_.span();
 		}
 	}
 
 	bool Response::serialize_(){
 		serialized_ = true;
-		bool hasBody = (body_.size() + stringBody_.size()) > 0;
+		bool hasBody = !bodiless_ && (stream_ || fileBody_.file || !parts_.empty() || (body_.size() + stringBody_.size() + sharedBody_.size()) > 0);
 		if(!hasContentType_ && hasBody){
 			if(isBodyString_) set(Http::Field::ContentType, "text/plain");
 			else set(Http::Field::ContentType, "application/octet-stream");
@@ -565,10 +1782,19 @@ namespace Http{
 			if(defaultKeepAlive_) set(Http::Field::Connection, "keep-alive");
 			else set(Http::Field::Connection, "close");
 		}
+		if(!hasDate_) set(Http::Field::Date, DateCache::local().value());
 
-		if(/*hasBody && */contentLength_ == 0){
+		if(bodiless_){
+		} else if(stream_){
+			if(chunked()) set(Http::Field::TransferEncoding, "chunked");
+		} else if(/*hasBody && */contentLength_ == 0){
 			char buf[32];
 			if(isBodyString_) contentLength_ = stringBody_.size();
+			else if(sharedBody_) contentLength_ = sharedBody_.size();
+			else if(fileBody_.file) contentLength_ = fileBody_.length;
+			else if(!parts_.empty()){
+				for(const auto& part : parts_) contentLength_ += part.header.size() + (part.file.file ? part.file.length : part.bytes.size());
+			}
 			else contentLength_ = body_.size();
 			auto [ptr, ec] = std::to_chars(buf, buf + sizeof(buf), contentLength_);
 			set(Http::Field::ContentLength, {buf, static_cast<std::size_t>(ptr - buf)});
@@ -581,8 +1807,7 @@ namespace Http{
 	}
 	Response::Response(Http::Status status, std::string_view version, std::span<std::byte> headerBuffer) noexcept{
 		headerBuffer_ = headerBuffer;
-		const auto& [intStatus, strStatus, reason] = statusStrArr_[static_cast<std::size_t>(status)];
-		init_(strStatus, reason, version);
+		init_(status, version);
 	}
 	Response::Response(std::pair<int, std::string_view> status, std::string_view version, std::span<std::byte> headerBuffer) noexcept{
 		headerBuffer_ = headerBuffer;
@@ -591,20 +1816,28 @@ namespace Http{
 		init_({buf, static_cast<std::size_t>(ptr - buf)}, status.second, version);
 	}
 	Response::Response(Http::Status status, std::string_view version){
-		alloc_(4096);
-		const auto& [intStatus, strStatus, reason] = statusStrArr_[static_cast<std::size_t>(status)];
-		init_(strStatus, reason, version);
+		alloc_(BufferPool::sizeClasses.front());
+		init_(status, version);
 	}
 	Response::Response(std::pair<int, std::string_view> status, std::string_view version){
-		alloc_(4096);
+		alloc_(BufferPool::sizeClasses.front());
 		char buf[10];
 		auto [ptr, ec] = std::to_chars(buf, buf + sizeof(buf), status.first);
 		init_({buf, static_cast<std::size_t>(ptr - buf)}, status.second, version);
 	}
+	Response::Response(const ResponseTemplate& tmpl, std::string_view version, std::span<std::byte> headerBuffer) noexcept{
+		headerBuffer_ = headerBuffer;
+		init_(tmpl, version);
+	}
+	Response::Response(const ResponseTemplate& tmpl, std::string_view version){
+		alloc_(std::max(tmpl.header_.size() + 128, BufferPool::sizeClasses.front()));
+		init_(tmpl, version);
+	}
 
 	void Response::set(Http::Field field, std::string_view value){
 		if(field == Http::Field::ContentType) hasContentType_ = true;
 		else if(field == Http::Field::Connection) hasConnection_ = true;
+		else if(field == Http::Field::Date) hasDate_ = true;
 		else if(field == Http::Field::ContentLength) {
 			std::from_chars(value.data(), value.data() + value.size(), contentLength_);
 		}
@@ -618,13 +1851,19 @@ namespace Http{
 
 		std::memcpy(headerBuffer_.data() + headerBufferIdx_, fieldStr.data(), fieldStr.size()); headerBufferIdx_ += fieldStr.size();
 		std::memcpy(headerBuffer_.data() + headerBufferIdx_, colon.data(), colon.size()); headerBufferIdx_ += colon.size();
+		if(field == Http::Field::Connection){
+			connectionIdx_ = headerBufferIdx_;
+			connectionSize_ = value.size();
+		}
 		std::memcpy(headerBuffer_.data() + headerBufferIdx_, value.data(), value.size()); headerBufferIdx_ += value.size();
 		std::memcpy(headerBuffer_.data() + headerBufferIdx_, rn.data(), rn.size());headerBufferIdx_ += rn.size();
 	}
 	void Response::set(std::string_view field, std::string_view value){
-		if((field == "Content-Type") || (field == "content-type")) hasContentType_ = true;
-		else if((field == "Connection") || (field == "connection")) hasConnection_ = true;
-		else if((field == "Content-Length") || (field == "content-length")){
+		auto known = fieldFromName(field);
+		if(known == Http::Field::ContentType) hasContentType_ = true;
+		else if(known == Http::Field::Connection) hasConnection_ = true;
+		else if(known == Http::Field::Date) hasDate_ = true;
+		else if(known == Http::Field::ContentLength){
 			std::from_chars(value.data(), value.data() + value.size(), contentLength_);
 		}
 
@@ -636,30 +1875,121 @@ namespace Http{
 
 		std::memcpy(headerBuffer_.data() + headerBufferIdx_, field.data(), field.size()); headerBufferIdx_ += field.size();
 		std::memcpy(headerBuffer_.data() + headerBufferIdx_, colon.data(), colon.size()); headerBufferIdx_ += colon.size();
+		if(known == Http::Field::Connection){
+			connectionIdx_ = headerBufferIdx_;
+			connectionSize_ = value.size();
+		}
 		std::memcpy(headerBuffer_.data() + headerBufferIdx_, value.data(), value.size()); headerBufferIdx_ += value.size();
 		std::memcpy(headerBuffer_.data() + headerBufferIdx_, rn.data(), rn.size());headerBufferIdx_ += rn.size();
 	}
 
-	void Response::setBody(std::span<const std::byte> data){
+	void Response::closeConnection(){
+		static constexpr std::string_view close{"close"};
+		close_ = true;
+		if(serialized_) return;
+		if(connectionSize_ >= close.size()){
+			// what is left of the old value becomes trailing whitespace, which the field may end with
+			auto* value = headerBuffer_.data() + connectionIdx_;
+			std::memcpy(value, close.data(), close.size());
+			std::memset(value + close.size(), ' ', connectionSize_ - close.size());
+			return;
+		}
+		// a field line of its own, several Connection fields read as one list
+		set(Http::Field::Connection, close);
+	}
+
+	void Response::setValidators(const Validators& validators){
+		if(!validators.etag.empty()) set(Http::Field::ETag, validators.etag);
+		if(validators.lastModified){
+			auto date = formatDate(*validators.lastModified);
+			set(Http::Field::LastModified, {date.data(), date.size()});
+		}
+	}
+
+	void Response::clearBody_() noexcept {
+		body_.clear();
 		stringBody_.clear();
-		body_ = std::vector<std::byte>(data.begin(), data.end());
+		sharedBody_ = {};
+		stream_ = nullptr;
+		fileBody_ = {};
+		parts_.clear();
 		isBodyString_ = false;
 	}
+
+	void Response::setBody(std::span<const std::byte> data){
+		std::vector<std::byte> bytes(data.begin(), data.end());
+		clearBody_();
+		body_ = std::move(bytes);
+	}
 	void Response::setBody(std::vector<std::byte>&& data){
-		stringBody_.clear();
+		clearBody_();
 		body_ = std::move(data);
-		isBodyString_ = false;
 	}
 	void Response::setBody(const std::string& data){
-		body_.clear();
+		clearBody_();
 		stringBody_ = data;
 		isBodyString_ = true;
 	}
 	void Response::setBody(std::string&& data){
-		body_.clear();
+		clearBody_();
 		stringBody_ = std::move(data);
 		isBodyString_ = true;
 	}
+	void Response::setBody(SharedBuffer data){
+		clearBody_();
+		sharedBody_ = std::move(data);
+	}
+	void Response::setBody(std::unique_ptr<BodyStream> stream){
+		clearBody_();
+		stream_ = std::move(stream);
+	}
+
+	void Response::setBody(FileRange range){
+		clearBody_();
+		fileBody_ = std::move(range);
+	}
+
+	Error Response::setRanges(std::span<const ByteRange> ranges, std::string_view contentType){
+		if(stream_ || !parts_.empty()) return ErrorCode::INVALID_STATE;
+		if(!fileBody_.file && !sharedBody_){
+			if(isBodyString_) setBody(SharedBuffer{std::move(stringBody_)});
+			else setBody(SharedBuffer{std::move(body_)});
+		}
+		std::uint64_t size = fileBody_.file ? fileBody_.length : sharedBody_.size();
+		for(const auto& range : ranges){
+			if(range.first > range.last || range.last >= size) return ErrorCode::INVALID_STATE;
+		}
+		if(ranges.empty()) return ErrorCode::INVALID_STATE;
+
+		auto slice = [&](const ByteRange& range, BodyPart& part){
+			if(fileBody_.file) part.file = {fileBody_.file, fileBody_.offset + range.first, range.length()};
+			else part.bytes = sharedBody_.slice(static_cast<std::size_t>(range.first), static_cast<std::size_t>(range.length()));
+		};
+		if(ranges.size() == 1){
+			BodyPart part;
+			slice(ranges[0], part);
+			if(fileBody_.file) fileBody_ = std::move(part.file);
+			else sharedBody_ = std::move(part.bytes);
+			set(Http::Field::ContentType, contentType);
+			set(Http::Field::ContentRange, std::format("bytes {}-{}/{}", ranges[0].first, ranges[0].last, size));
+			return {};
+		}
+
+		// random enough that it does not turn up in the body, see RFC 2046 section 5.1.1
+		thread_local std::mt19937_64 random{std::random_device{}()};
+		auto boundary = std::format("{:016x}{:016x}", random(), random());
+		parts_.resize(ranges.size() + 1);
+		for(std::size_t i = 0; i < ranges.size(); ++i){
+			parts_[i].header = std::format("{}--{}\r\nContent-Type: {}\r\nContent-Range: bytes {}-{}/{}\r\n\r\n",
+				i == 0 ? "" : "\r\n", boundary, contentType, ranges[i].first, ranges[i].last, size);
+			slice(ranges[i], parts_[i]);
+		}
+		parts_.back().header = std::format("\r\n--{}--\r\n", boundary);
+		fileBody_ = {};
+		sharedBody_ = {};
+		set(Http::Field::ContentType, std::format("multipart/byteranges; boundary={}", boundary));
+		return {};
+	}
 
 	std::tuple<Error, bool, std::size_t> Response::consumeHeaderSome(std::span<const std::byte> data){
 		return {ErrorCode::INVALID_MESSAGE, true, 0};
@@ -688,34 +2018,85 @@ namespace Http{
 		if (finished) headerBufferIdx_ = 0;
 		return {{}, finished, numCopy};
 	}
-	std::tuple<Error, bool, std::size_t> Response::produceBodySome(std::span<std::byte> out){
+	std::span<const std::byte> Response::bodySpan_(){
+		if(sharedBody_) return sharedBody_.span();
 		if(isBodyString_){
 			if((contentLength_ > 0) && (contentLength_ != stringBody_.size())) stringBody_.resize(contentLength_);
-			if(stringBody_.size() == 0) return {{}, true, 0};
-			std::size_t remaining = stringBody_.size() - bodyIdx_;
-			std::size_t numCopy = std::min(out.size(), remaining);
-
-			std::memcpy(out.data(), reinterpret_cast<std::byte*>(stringBody_.data()) + bodyIdx_, numCopy);
-			bodyIdx_ += numCopy;
-
-			bool finished = bodyIdx_ >= stringBody_.size();
+			return std::as_bytes(std::span{stringBody_});
+		}
+		if((contentLength_ > 0) && (contentLength_ != body_.size())) body_.resize(contentLength_);
+		return body_;
+	}
+	std::tuple<Error, bool, std::size_t> Response::produceBodySome(std::span<std::byte> out){
+		if(omitBody_) return {{}, true, 0};
+		if(fileBody_.file){
+			// copied for a connection that cannot send from the file itself
+			std::size_t numCopy = static_cast<std::size_t>(std::min<std::uint64_t>(out.size(), fileBody_.length - bodyIdx_));
+			if(numCopy == 0) return {{}, true, 0};
+			ssize_t n = ::pread(fileBody_.file->fd(), out.data(), numCopy, static_cast<off_t>(fileBody_.offset + bodyIdx_));
+			if(n <= 0) return {ErrorCode::INVALID_STATE, true, 0};
+			bodyIdx_ += static_cast<std::size_t>(n);
+			bool finished = bodyIdx_ >= fileBody_.length;
 			if (finished) bodyIdx_ = 0;
-			return {{}, finished, numCopy};
+			return {{}, finished, static_cast<std::size_t>(n)};
 		}
-		else{
-			if((contentLength_ > 0) && (contentLength_ != body_.size())) body_.resize(contentLength_);
-			if(body_.size() == 0) return {{}, true, 0};
-			std::size_t remaining = body_.size() - bodyIdx_;
-			std::size_t numCopy = std::min(out.size(), remaining);
+		if(!parts_.empty()){
+			auto partSize = [](const BodyPart& part){ return part.header.size() + (part.file.file ? part.file.length : part.bytes.size()); };
+			std::size_t written = 0;
+			while(partIdx_ < parts_.size()){
+				const auto& part = parts_[partIdx_];
+				if(bodyIdx_ >= partSize(part)){
+					++partIdx_;
+					bodyIdx_ = 0;
+					continue;
+				}
+				if(written == out.size()) break;
+				std::size_t numCopy;
+				if(bodyIdx_ < part.header.size()){
+					numCopy = std::min(out.size() - written, part.header.size() - bodyIdx_);
+					std::memcpy(out.data() + written, part.header.data() + bodyIdx_, numCopy);
+				} else if(part.file.file){
+					std::uint64_t offset = bodyIdx_ - part.header.size();
+					numCopy = static_cast<std::size_t>(std::min<std::uint64_t>(out.size() - written, part.file.length - offset));
+					ssize_t n = ::pread(part.file.file->fd(), out.data() + written, numCopy, static_cast<off_t>(part.file.offset + offset));
+					if(n <= 0) return {ErrorCode::INVALID_STATE, true, 0};
+					numCopy = static_cast<std::size_t>(n);
+				} else {
+					std::size_t offset = bodyIdx_ - part.header.size();
+					numCopy = std::min(out.size() - written, part.bytes.size() - offset);
+					std::memcpy(out.data() + written, part.bytes.data() + offset, numCopy);
+				}
+				bodyIdx_ += numCopy;
+				written += numCopy;
+			}
+			bool finished = partIdx_ >= parts_.size();
+			if (finished) partIdx_ = 0;
+			return {{}, finished, written};
+		}
+		auto body = bodySpan_();
+		if(body.size() == 0) return {{}, true, 0};
+		std::size_t remaining = body.size() - bodyIdx_;
+		std::size_t numCopy = std::min(out.size(), remaining);
 
-			std::memcpy(out.data(), body_.data() + bodyIdx_, numCopy);
-			bodyIdx_ += numCopy;
+		std::memcpy(out.data(), body.data() + bodyIdx_, numCopy);
+		bodyIdx_ += numCopy;
 
-			bool finished = bodyIdx_ >= body_.size();
-			if (finished) bodyIdx_ = 0;
-			return {{}, finished, numCopy};
+		bool finished = bodyIdx_ >= body.size();
+		if (finished) bodyIdx_ = 0;
+		return {{}, finished, numCopy};
+	}
+	std::tuple<Error, std::size_t> Response::produceBuffers(std::span<std::span<const std::byte>> out){
+		if(out.size() < 2) return {ErrorCode::INVALID_STATE, 0};
+		if (!serialized_) {
+			serialize_();
+			headerSize_ = headerBufferIdx_;
+			headerBufferIdx_ = 0;
 		}
-		return {{}, true, 0};
+		out[0] = {headerBuffer_.data(), headerSize_};
+		if(omitBody_ || fileBody_.file || !parts_.empty()) return {Error{}, 1}; // a file or parts follow the header, see file() and parts()
+		auto body = bodySpan_();
+		if(body.empty()) return {Error{}, 1};
+		out[1] = body;
+		return {Error{}, 2};
 	}
 };
-
@@ -0,0 +1,228 @@
+export module staticFiles;
+
+import std;
+import simd;
+import http;
+import compression;
+
+export
+namespace Http {
+	// Open files by path, so a hot file is served without an open() and fstat() per request. An
+	// entry is stat()ed again once it is older than revalidateAfter and reopened when the file
+	// changed, a path that could not be opened is remembered as missing for as long. At most
+	// capacity entries are kept, the least recently used one is closed first.
+	// Shared by every thread, lookups take a short lock and never touch the disk under it.
+	class FileCache{
+		struct Entry{
+			std::shared_ptr<const File> file;
+			std::chrono::steady_clock::time_point checked;
+			std::list<std::string>::iterator lru;
+		};
+		std::mutex mutex_;
+		std::unordered_map<std::string, Entry> entries_;
+		std::list<std::string> lru_; // most recently used first
+		std::size_t capacity_;
+		std::chrono::steady_clock::duration revalidateAfter_;
+	public:
+		FileCache(std::size_t capacity, std::chrono::steady_clock::duration revalidateAfter):
+			capacity_(std::max<std::size_t>(capacity, 1)), revalidateAfter_(revalidateAfter) {}
+
+		// nullptr when path does not name a readable regular file
+		std::shared_ptr<const File> open(const std::string& path){
+			auto now = std::chrono::steady_clock::now();
+			std::shared_ptr<const File> cached;
+			{
+				std::lock_guard lock{mutex_};
+				auto it = entries_.find(path);
+				if(it != entries_.end()){
+					auto& entry = it->second;
+					lru_.splice(lru_.begin(), lru_, entry.lru);
+					if(now - entry.checked < revalidateAfter_) return entry.file;
+					// the requests arriving while this one revalidates take the entry as it is
+					entry.checked = now;
+					cached = entry.file;
+				}
+			}
+
+			// stat()ed and opened outside the lock, a slow disk only holds up this request
+			if(cached && cached->unchanged(path)) return cached;
+			auto file = File::open(path);
+
+			std::lock_guard lock{mutex_};
+			auto [it, inserted] = entries_.try_emplace(path);
+			if(inserted){
+				lru_.push_front(path);
+				it->second.lru = lru_.begin();
+			} else {
+				lru_.splice(lru_.begin(), lru_, it->second.lru);
+			}
+			it->second.file = file;
+			it->second.checked = now;
+			while(entries_.size() > capacity_){
+				entries_.erase(lru_.back());
+				lru_.pop_back();
+			}
+			return file;
+		}
+	};
+
+	// Serves the files under a root directory: 200 with the whole file, 206 for a satisfiable
+	// Range, multipart/byteranges when it names several ranges, 304 or 412 as validate() decides
+	// the conditional headers, 416 for a range past the end and 404 for anything missing or
+	// outside root. Bodies are FileRanges, so the connection sends them straight from the cached
+	// descriptor. With precompressed() set, a sibling such as "app.js.br" is sent in place of
+	// "app.js" to clients that accept its encoding.
+	class StaticFiles{
+		std::string root_;
+		FileCache cache_;
+		std::uint32_t precompressed_ = 0;
+
+		static std::string_view siblingSuffix_(Encoding e) noexcept {
+			switch(e){
+			case Encoding::Gzip: return ".gz";
+			case Encoding::Zstd: return ".zst";
+			case Encoding::Brotli: return ".br";
+			default: return {};
+			}
+		}
+
+		static std::string_view contentType_(std::string_view path) noexcept {
+			static constexpr std::array<std::pair<std::string_view, std::string_view>, 20> types{{
+				{"html", "text/html; charset=utf-8"},
+				{"htm", "text/html; charset=utf-8"},
+				{"css", "text/css; charset=utf-8"},
+				{"js", "text/javascript; charset=utf-8"},
+				{"json", "application/json"},
+				{"txt", "text/plain; charset=utf-8"},
+				{"xml", "application/xml"},
+				{"svg", "image/svg+xml"},
+				{"png", "image/png"},
+				{"jpg", "image/jpeg"},
+				{"jpeg", "image/jpeg"},
+				{"gif", "image/gif"},
+				{"webp", "image/webp"},
+				{"ico", "image/x-icon"},
+				{"tif", "image/tiff"},
+				{"tiff", "image/tiff"},
+				{"pbf", "application/x-protobuf"},
+				{"mvt", "application/vnd.mapbox-vector-tile"},
+				{"wasm", "application/wasm"},
+				{"pdf", "application/pdf"},
+			}};
+			auto dot = path.rfind('.');
+			if(dot == std::string_view::npos || path.find('/', dot) != std::string_view::npos) return "application/octet-stream";
+			auto ext = path.substr(dot + 1);
+			for(const auto& [name, type] : types){
+				if(Simd::equalsIgnoreCase(name, ext)) return type;
+			}
+			return "application/octet-stream";
+		}
+
+		// root_ joined with path, nullopt for a path that could leave root
+		std::optional<std::string> resolve_(std::string_view path) const {
+			std::string full = root_;
+			std::size_t start = 0;
+			while(start <= path.size()){
+				auto slash = path.find('/', start);
+				if(slash == std::string_view::npos) slash = path.size();
+				auto seg = path.substr(start, slash - start);
+				start = slash + 1;
+				if(seg.empty()) continue;
+				if(seg == "." || seg == ".." || seg.find('\0') != std::string_view::npos) return std::nullopt;
+				full += '/';
+				full += seg;
+			}
+			if(full.size() == root_.size()) return std::nullopt;
+			return full;
+		}
+
+		// a Range only applies while If-Range, if sent, still names this file
+		static bool rangeApplies_(const Request& req, const File& file){
+			auto ifRange = req.get(Field::IfRange);
+			if(!ifRange) return true;
+			if(ifRange->starts_with('"')) return *ifRange == file.etag();
+			auto date = parseDate(*ifRange);
+			return date && *date == file.modified();
+		}
+	public:
+		StaticFiles(std::string root, std::size_t maxOpenFiles = 1024,
+					std::chrono::steady_clock::duration revalidateAfter = std::chrono::seconds{1}):
+			root_(std::move(root)), cache_(maxOpenFiles, revalidateAfter)
+		{
+			while(root_.size() > 1 && root_.back() == '/') root_.pop_back();
+		}
+
+		// Encodings to look for precompressed siblings of, gzip, zstd and brotli ones can be used.
+		void precompressed(std::uint32_t encodings) noexcept {
+			precompressed_ = encodings & (encodingBit(Encoding::Gzip) | encodingBit(Encoding::Zstd) | encodingBit(Encoding::Brotli));
+		}
+
+		// Response for path relative to root, e.g. the "*" capture of a route. headerBuffer is
+		// used as by the other Response constructors.
+		Response serve(const Request& req, std::span<std::byte> headerBuffer, std::string_view path){
+			auto full = resolve_(path);
+			std::shared_ptr<const File> file;
+			if(full) file = cache_.open(*full);
+			if(!file) return Response{Status::NotFound, req.version(), headerBuffer};
+
+			Encoding encoding = Encoding::Identity;
+			auto accept = req.get(Field::AcceptEncoding);
+			if(precompressed_ && negotiateEncoding(accept, precompressed_) != Encoding::Identity){
+				// only the siblings that exist take part, the client's order decides among them
+				std::array<std::shared_ptr<const File>, static_cast<std::size_t>(Encoding::_Count)> siblings;
+				std::uint32_t found = 0;
+				for(std::size_t i = 0; i < siblings.size(); ++i){
+					auto e = static_cast<Encoding>(i);
+					if(!(precompressed_ & encodingBit(e))) continue;
+					siblings[i] = cache_.open(*full + std::string{siblingSuffix_(e)});
+					if(siblings[i]) found |= encodingBit(e);
+				}
+				encoding = negotiateEncoding(accept, found);
+				if(encoding != Encoding::Identity) file = siblings[static_cast<std::size_t>(encoding)];
+			}
+
+			auto setValidators = [&](Response& res){
+				res.set(Field::ETag, file->etag());
+				res.set(Field::LastModified, file->lastModified());
+				if(encoding != Encoding::Identity) res.set(Field::ContentEncoding, encodingName(encoding));
+				if(precompressed_) res.set(Field::Vary, "Accept-Encoding");
+			};
+
+			switch(validate(req, {std::string{file->etag()}, file->modified()})){
+			case Precondition::NotModified: {
+				Response res{Status::NotModified, req.version(), headerBuffer};
+				setValidators(res);
+				return res;
+			}
+			case Precondition::Failed:
+				return Response{Status::PreconditionFailed, req.version(), headerBuffer};
+			case Precondition::Proceed:
+				break;
+			}
+
+			auto range = req.get(Field::Range);
+			if(range && req.methodId() == Method::Get && rangeApplies_(req, *file)){
+				auto [status, ranges] = parseRanges(*range, file->size());
+				if(status == RangeStatus::Unsatisfiable){
+					Response res{Status::RangeNotSatisfiable, req.version(), headerBuffer};
+					res.set(Field::ContentRange, std::format("bytes */{}", file->size()));
+					return res;
+				}
+				if(status == RangeStatus::Satisfiable){
+					Response res{Status::PartialContent, req.version(), headerBuffer};
+					setValidators(res);
+					res.setBody(FileRange{file, 0, file->size()});
+					res.setRanges(ranges, contentType_(path));
+					return res;
+				}
+			}
+
+			Response res{Status::OK, req.version(), headerBuffer};
+			setValidators(res);
+			res.set(Field::ContentType, contentType_(path));
+			res.set(Field::AcceptRanges, "bytes");
+			res.setBody(FileRange{file, 0, file->size()});
+			return res;
+		}
+	};
+};
@@ -0,0 +1,630 @@
+module;
+#include <zlib.h>
+
+export module webSocket;
+
+import std;
+import error;
+import buffer;
+import simd;
+import http;
+
+// zlib state for permessage-deflate, raw deflate as RFC 7692 uses it
+struct Deflater_{
+	z_stream stream{};
+	bool ok = false;
+	Deflater_(int level, int windowBits) noexcept { ok = deflateInit2(&stream, level, Z_DEFLATED, -windowBits, 8, Z_DEFAULT_STRATEGY) == Z_OK; }
+	~Deflater_() { if(ok) deflateEnd(&stream); }
+	Deflater_(const Deflater_&) = delete;
+	Deflater_& operator=(const Deflater_&) = delete;
+};
+struct Inflater_{
+	z_stream stream{};
+	bool ok = false;
+	Inflater_() noexcept { ok = inflateInit2(&stream, -15) == Z_OK; }
+	~Inflater_() { if(ok) inflateEnd(&stream); }
+	Inflater_(const Inflater_&) = delete;
+	Inflater_& operator=(const Inflater_&) = delete;
+};
+
+export
+namespace WebSocket {
+	enum class Opcode : std::uint8_t {
+		Continuation = 0x0,
+		Text = 0x1,
+		Binary = 0x2,
+		Close = 0x8,
+		Ping = 0x9,
+		Pong = 0xA,
+	};
+	constexpr bool isControl(Opcode opcode) noexcept { return static_cast<std::uint8_t>(opcode) & 0x8; }
+
+	// status codes of a Close frame, RFC 6455 section 7.4.1
+	enum class CloseCode : std::uint16_t {
+		Normal = 1000,
+		GoingAway = 1001,
+		ProtocolError = 1002,
+		UnsupportedData = 1003,
+		NoStatus = 1005, // never sent, stands for a Close frame without a code
+		Abnormal = 1006, // never sent, the connection ended without a Close frame
+		InvalidPayload = 1007,
+		PolicyViolation = 1008,
+		MessageTooBig = 1009,
+		InternalError = 1011,
+	};
+
+	struct Options{
+		// largest message taken in, counted after inflating
+		std::size_t maxMessageSize = 1024 * 1024;
+		// accept permessage-deflate when the client offers it
+		bool deflate = true;
+		// Keep the compression window from one message to the next. Repetitive small messages
+		// compress better, but every socket then holds its own zlib state of about 300 KiB; without
+		// it the sockets of a thread share one.
+		bool contextTakeover = false;
+		// messages shorter than this go out uncompressed
+		std::size_t deflateMinSize = 128;
+		int deflateLevel = 6;
+		// A peer silent for this long is sent a Ping, and closed with GoingAway when it stays silent
+		// as long again. It takes the place of the idle timeout of the connection, zero leaves that.
+		std::chrono::steady_clock::duration pingInterval = std::chrono::seconds(30);
+	};
+
+	// permessage-deflate as agreed in the handshake, RFC 7692
+	struct Extensions{
+		bool deflate = false;
+		bool serverContextTakeover = true;
+		bool clientContextTakeover = true;
+		int serverMaxWindowBits = 15;
+	};
+
+	// Sec-WebSocket-Accept for the Sec-WebSocket-Key of a handshake
+	std::array<char, 28> acceptKey(std::string_view key) noexcept;
+	// whether req asks for a WebSocket in a way this server can accept, see accept()
+	bool isUpgrade(const Http::Request& req) noexcept;
+	// permessage-deflate from the first offer in req that options allow, deflate false for none
+	Extensions negotiate(const Http::Request& req, const Options& options);
+	// The answer to an upgrade request: 101 with the accept key and the negotiated extensions, 426
+	// naming version 13 to a client of another version and 400 to anything else. A connection
+	// that sent the 101 goes on as a WebSocket::Socket built from the same req and options.
+	Http::Response accept(const Http::Request& req, std::span<std::byte> headerBuffer, const Options& options);
+
+	bool validUtf8(std::span<const std::byte> data) noexcept;
+
+	// payload of a Close frame, reason cut to what fits a control frame
+	SharedBuffer closePayload(CloseCode code, std::string_view reason = {});
+	// Code and reason of a received Close payload, NoStatus for an empty one. nullopt for a payload
+	// the peer may not send: one byte, a reserved code or a reason that is not UTF-8.
+	std::optional<std::tuple<CloseCode, std::string_view>> parseClose(std::span<const std::byte> payload) noexcept;
+
+	// One frame on the server side, read or written through Connection as a message. A frame read
+	// must be masked and is unmasked with SIMD as its payload is taken in, into payload() with
+	// consumeBodySome or right in the read buffer with consumeBodyInPlace. A frame to send keeps
+	// its header of at most 10 bytes and a view of or a share in the payload, which is written
+	// behind the header in one gathered write, never copied.
+	class Frame{
+		std::array<std::byte, 14> header_{};
+		std::size_t headerSize_ = 0;
+		std::size_t headerIdx_ = 0;
+
+		bool fin_ = true;
+		bool rsv1_ = false;
+		Opcode opcode_ = Opcode::Binary;
+		bool masked_ = false;
+		std::array<std::byte, 4> key_{};
+		std::uint64_t length_ = 0;
+		std::uint64_t maxPayload_ = std::numeric_limits<std::uint64_t>::max();
+
+		std::vector<std::byte> payload_;
+		SharedBuffer shared_;
+		std::span<const std::byte> view_;
+		std::uint64_t bodyIdx_ = 0;
+
+		Error parseHeader_() noexcept;
+		void writeHeader_() noexcept;
+		std::span<const std::byte> sendSpan_() const noexcept { return shared_ ? shared_.span() : view_; }
+	public:
+		// a frame to read into
+		Frame() = default;
+		// A frame of payload, which has to outlive the write. compressed sets RSV1 for the first
+		// frame of a message that permessage-deflate compressed.
+		Frame(Opcode opcode, std::span<const std::byte> payload, bool fin = true, bool compressed = false) noexcept;
+		// a frame of shared bytes, e.g. one message sent to many sockets
+		Frame(Opcode opcode, SharedBuffer payload, bool fin = true, bool compressed = false) noexcept;
+
+		// longest payload taken in, a longer frame fails with BODY_TOO_LARGE once its header is read
+		void maxPayload(std::uint64_t size) noexcept { maxPayload_ = size; }
+
+		bool fin() const noexcept { return fin_; }
+		bool compressed() const noexcept { return rsv1_; }
+		Opcode opcode() const noexcept { return opcode_; }
+		std::uint64_t payloadSize() const noexcept { return length_; }
+		// the unmasked payload taken in with consumeBodySome
+		std::span<const std::byte> payload() const noexcept { return payload_; }
+
+		std::tuple<Error, bool, std::size_t> consumeHeaderSome(std::span<const std::byte> data);
+		std::tuple<Error, bool, std::size_t> consumeBodySome(std::span<const std::byte> data);
+		// unmasks the next piece of the payload where it is and hands it out as a view into data
+		std::tuple<Error, bool, std::size_t, std::span<const std::byte>> consumeBodyInPlace(std::span<std::byte> data);
+		std::tuple<Error, bool, std::size_t> produceHeaderSome(std::span<std::byte> out);
+		std::tuple<Error, bool, std::size_t> produceBodySome(std::span<std::byte> out);
+		std::tuple<Error, std::size_t> produceBuffers(std::span<std::span<const std::byte>> out);
+	};
+
+	// permessage-deflate of one socket. Without context takeover in a direction the zlib state of
+	// that direction is the calling thread's, reset for every message.
+	class PerMessageDeflate{
+		Extensions extensions_;
+		int level_;
+		std::unique_ptr<Deflater_> ownDeflater_;
+		std::unique_ptr<Inflater_> ownInflater_;
+
+		Deflater_* deflater_();
+		Inflater_* inflater_();
+	public:
+		PerMessageDeflate(const Extensions& extensions, int level);
+
+		bool enabled() const noexcept { return extensions_.deflate; }
+		// Whether a message compressed on its own with the full window, as a Broadcast is, can go out
+		// as it is. Not when this side keeps its window across messages, the peer's would then hold
+		// bytes this side's does not.
+		bool takesShared() const noexcept {
+			return extensions_.deflate && !extensions_.serverContextTakeover && extensions_.serverMaxWindowBits == 15;
+		}
+		// Compresses a whole message into out, without the 00 00 ff ff that ends every message.
+		Error compress(std::span<const std::byte> message, std::vector<std::byte>& out);
+		// Inflates a whole compressed message and appends it to out, BODY_TOO_LARGE once out would
+		// grow past maxSize.
+		Error decompress(std::span<const std::byte> message, std::vector<std::byte>& out, std::size_t maxSize);
+	};
+};
+
+/*~~~~~~~~~~~~~~~~~~~~~~~HANDSHAKE~~~~~~~~~~~~~~~~~~~~~~~*/
+
+// SHA-1 of a followed by b, only for the accept key, where the hash is a fixed transform and no
+// security property is asked of it
+static std::array<std::uint8_t, 20> sha1_(std::string_view a, std::string_view b) noexcept {
+	std::array<std::uint32_t, 5> h{0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+	std::array<std::uint8_t, 64> block{};
+	std::size_t used = 0;
+	std::uint64_t bits = 0;
+
+	auto compress = [&]{
+		std::array<std::uint32_t, 80> w;
+		for(std::size_t i = 0; i < 16; ++i)
+			w[i] = (std::uint32_t{block[4 * i]} << 24) | (std::uint32_t{block[4 * i + 1]} << 16) | (std::uint32_t{block[4 * i + 2]} << 8) | block[4 * i + 3];
+		for(std::size_t i = 16; i < 80; ++i) w[i] = std::rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+		auto [x0, x1, x2, x3, x4] = h;
+		for(std::size_t i = 0; i < 80; ++i){
+			std::uint32_t f, k;
+			if(i < 20){ f = (x1 & x2) | (~x1 & x3); k = 0x5A827999; }
+			else if(i < 40){ f = x1 ^ x2 ^ x3; k = 0x6ED9EBA1; }
+			else if(i < 60){ f = (x1 & x2) | (x1 & x3) | (x2 & x3); k = 0x8F1BBCDC; }
+			else { f = x1 ^ x2 ^ x3; k = 0xCA62C1D6; }
+			std::uint32_t t = std::rotl(x0, 5) + f + x4 + k + w[i];
+			x4 = x3; x3 = x2; x2 = std::rotl(x1, 30); x1 = x0; x0 = t;
+		}
+		h[0] += x0; h[1] += x1; h[2] += x2; h[3] += x3; h[4] += x4;
+	};
+	auto update = [&](std::string_view data){
+		for(char c : data){
+			block[used++] = static_cast<std::uint8_t>(c);
+			if(used == block.size()){ compress(); used = 0; }
+		}
+		bits += data.size() * 8;
+	};
+	update(a);
+	update(b);
+	std::uint64_t length = bits;
+	block[used++] = 0x80;
+	if(used > 56){
+		std::fill(block.begin() + used, block.end(), 0);
+		compress();
+		used = 0;
+	}
+	std::fill(block.begin() + used, block.begin() + 56, 0);
+	for(std::size_t i = 0; i < 8; ++i) block[63 - i] = static_cast<std::uint8_t>(length >> (8 * i));
+	compress();
+
+	std::array<std::uint8_t, 20> digest;
+	for(std::size_t i = 0; i < 20; ++i) digest[i] = static_cast<std::uint8_t>(h[i / 4] >> (24 - 8 * (i % 4)));
+	return digest;
+}
+
+std::array<char, 28> WebSocket::acceptKey(std::string_view key) noexcept {
+	static constexpr std::string_view guid{"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"};
+	static constexpr std::string_view alphabet{"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"};
+	auto digest = sha1_(key, guid);
+	std::array<char, 28> out;
+	std::size_t o = 0;
+	for(std::size_t i = 0; i < 18; i += 3){
+		std::uint32_t v = (std::uint32_t{digest[i]} << 16) | (std::uint32_t{digest[i + 1]} << 8) | digest[i + 2];
+		out[o++] = alphabet[(v >> 18) & 63];
+		out[o++] = alphabet[(v >> 12) & 63];
+		out[o++] = alphabet[(v >> 6) & 63];
+		out[o++] = alphabet[v & 63];
+	}
+	std::uint32_t v = (std::uint32_t{digest[18]} << 16) | (std::uint32_t{digest[19]} << 8);
+	out[o++] = alphabet[(v >> 18) & 63];
+	out[o++] = alphabet[(v >> 12) & 63];
+	out[o++] = alphabet[(v >> 6) & 63];
+	out[o++] = '=';
+	return out;
+}
+
+static std::string_view trimOws_(std::string_view s) noexcept {
+	while(!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+	while(!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+	return s;
+}
+
+// whether token is an element of the comma separated lists in values
+static bool hasToken_(Http::Request::FieldValues values, std::string_view token) noexcept {
+	for(auto value : values){
+		while(!value.empty()){
+			auto comma = value.find(',');
+			if(Simd::equalsIgnoreCase(trimOws_(value.substr(0, comma)), token)) return true;
+			if(comma == std::string_view::npos) break;
+			value.remove_prefix(comma + 1);
+		}
+	}
+	return false;
+}
+
+// a key is 16 bytes in base64, so 22 characters and "=="
+static bool validKey_(std::string_view key) noexcept {
+	if(key.size() != 24 || !key.ends_with("==")) return false;
+	for(char c : key.substr(0, 22)){
+		if(!std::isalnum(static_cast<unsigned char>(c)) && c != '+' && c != '/') return false;
+	}
+	return true;
+}
+
+bool WebSocket::isUpgrade(const Http::Request& req) noexcept {
+	auto key = req.get(Http::Field::SecWebSocketKey);
+	return req.methodId() == Http::Method::Get && req.version() == "1.1" &&
+		hasToken_(req.getList(Http::Field::Upgrade), "websocket") &&
+		hasToken_(req.getList(Http::Field::Connection), "upgrade") &&
+		req.get(Http::Field::SecWebSocketVersion) == "13" &&
+		key && validKey_(trimOws_(*key));
+}
+
+WebSocket::Extensions WebSocket::negotiate(const Http::Request& req, const Options& options){
+	if(!options.deflate) return {};
+	for(auto value : req.getList(Http::Field::SecWebSocketExtensions)){
+		while(!value.empty()){
+			auto comma = value.find(',');
+			auto offer = value.substr(0, comma);
+			value = comma == std::string_view::npos ? std::string_view{} : value.substr(comma + 1);
+
+			auto semi = offer.find(';');
+			if(trimOws_(offer.substr(0, semi)) != "permessage-deflate") continue;
+			Extensions ext{.deflate = true, .serverContextTakeover = options.contextTakeover, .clientContextTakeover = options.contextTakeover};
+			bool usable = true, seenServerNoTakeover = false, seenClientNoTakeover = false, seenServerBits = false, seenClientBits = false;
+			while(usable && semi != std::string_view::npos){
+				offer.remove_prefix(semi + 1);
+				semi = offer.find(';');
+				auto param = trimOws_(offer.substr(0, semi));
+				auto eq = param.find('=');
+				auto name = trimOws_(param.substr(0, eq));
+				auto arg = eq == std::string_view::npos ? std::string_view{} : trimOws_(param.substr(eq + 1));
+				if(arg.size() >= 2 && arg.front() == '"' && arg.back() == '"') arg = arg.substr(1, arg.size() - 2);
+
+				int bits = 0;
+				if(!arg.empty()){
+					auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), bits);
+					if(ec != std::errc{} || ptr != arg.data() + arg.size() || bits < 8 || bits > 15) usable = false;
+				}
+				if(name == "server_no_context_takeover" && arg.empty() && !std::exchange(seenServerNoTakeover, true)) ext.serverContextTakeover = false;
+				else if(name == "client_no_context_takeover" && arg.empty() && !std::exchange(seenClientNoTakeover, true)) ext.clientContextTakeover = false;
+				// zlib's raw deflate has no 256-byte window, an offer that asks for it is passed over
+				else if(name == "server_max_window_bits" && bits > 8 && !std::exchange(seenServerBits, true)) ext.serverMaxWindowBits = bits;
+				// the inflater always takes a full window, so the client may use any
+				else if(name == "client_max_window_bits" && !std::exchange(seenClientBits, true)) {}
+				else usable = false;
+			}
+			if(usable) return ext;
+		}
+	}
+	return {};
+}
+
+Http::Response WebSocket::accept(const Http::Request& req, std::span<std::byte> headerBuffer, const Options& options){
+	if(!isUpgrade(req)){
+		auto version = req.get(Http::Field::SecWebSocketVersion);
+		if(version && *version != "13"){
+			Http::Response res{Http::Status::UpgradeRequired, req.version(), headerBuffer};
+			res.set(Http::Field::SecWebSocketVersion, "13");
+			return res;
+		}
+		return Http::Response{Http::Status::BadRequest, req.version(), headerBuffer};
+	}
+
+	Http::Response res{Http::Status::SwitchingProtocols, req.version(), headerBuffer};
+	res.set(Http::Field::Upgrade, "websocket");
+	res.set(Http::Field::Connection, "Upgrade");
+	auto key = acceptKey(trimOws_(*req.get(Http::Field::SecWebSocketKey)));
+	res.set(Http::Field::SecWebSocketAccept, {key.data(), key.size()});
+	auto ext = negotiate(req, options);
+	if(ext.deflate){
+		std::string value{"permessage-deflate"};
+		if(!ext.serverContextTakeover) value += "; server_no_context_takeover";
+		if(!ext.clientContextTakeover) value += "; client_no_context_takeover";
+		if(ext.serverMaxWindowBits < 15) value += std::format("; server_max_window_bits={}", ext.serverMaxWindowBits);
+		res.set(Http::Field::SecWebSocketExtensions, value);
+	}
+	return res;
+}
+
+bool WebSocket::validUtf8(std::span<const std::byte> data) noexcept {
+	auto at = [&](std::size_t i){ return std::to_integer<std::uint8_t>(data[i]); };
+	std::size_t i = 0;
+	while((i = Simd::findNonAscii(data, i)) < data.size()){
+		std::uint8_t lead = at(i);
+		std::size_t len;
+		std::uint8_t lo = 0x80, hi = 0xBF; // allowed range of the second byte
+		if(lead >= 0xC2 && lead <= 0xDF) len = 2;
+		else if(lead >= 0xE0 && lead <= 0xEF){
+			len = 3;
+			if(lead == 0xE0) lo = 0xA0; // overlong
+			if(lead == 0xED) hi = 0x9F; // surrogates
+		}
+		else if(lead >= 0xF0 && lead <= 0xF4){
+			len = 4;
+			if(lead == 0xF0) lo = 0x90; // overlong
+			if(lead == 0xF4) hi = 0x8F; // past U+10FFFF
+		}
+		else return false;
+		if(i + len > data.size()) return false;
+		if(at(i + 1) < lo || at(i + 1) > hi) return false;
+		for(std::size_t j = 2; j < len; ++j){
+			if((at(i + j) & 0xC0) != 0x80) return false;
+		}
+		i += len;
+	}
+	return true;
+}
+
+SharedBuffer WebSocket::closePayload(CloseCode code, std::string_view reason){
+	reason = reason.substr(0, 123);
+	// a cut must not leave half a character behind
+	while(!reason.empty() && !validUtf8(std::as_bytes(std::span{reason}))) reason.remove_suffix(1);
+	std::string payload(2 + reason.size(), '\0');
+	auto value = static_cast<std::uint16_t>(code);
+	payload[0] = static_cast<char>(value >> 8);
+	payload[1] = static_cast<char>(value & 0xFF);
+	std::memcpy(payload.data() + 2, reason.data(), reason.size());
+	return SharedBuffer{std::move(payload)};
+}
+
+std::optional<std::tuple<WebSocket::CloseCode, std::string_view>> WebSocket::parseClose(std::span<const std::byte> payload) noexcept {
+	if(payload.empty()) return std::tuple{CloseCode::NoStatus, std::string_view{}};
+	if(payload.size() == 1) return std::nullopt;
+	auto value = static_cast<std::uint16_t>((std::to_integer<std::uint16_t>(payload[0]) << 8) | std::to_integer<std::uint16_t>(payload[1]));
+	bool defined = (value >= 1000 && value <= 1003) || (value >= 1007 && value <= 1011);
+	if(!defined && (value < 3000 || value > 4999)) return std::nullopt;
+	auto reason = payload.subspan(2);
+	if(!validUtf8(reason)) return std::nullopt;
+	return std::tuple{static_cast<CloseCode>(value), std::string_view{reinterpret_cast<const char*>(reason.data()), reason.size()}};
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~FRAME~~~~~~~~~~~~~~~~~~~~~~~*/
+
+WebSocket::Frame::Frame(Opcode opcode, std::span<const std::byte> payload, bool fin, bool compressed) noexcept:
+	fin_(fin), rsv1_(compressed), opcode_(opcode), length_(payload.size()), view_(payload)
+{
+	writeHeader_();
+}
+WebSocket::Frame::Frame(Opcode opcode, SharedBuffer payload, bool fin, bool compressed) noexcept:
+	fin_(fin), rsv1_(compressed), opcode_(opcode), length_(payload.size()), shared_(std::move(payload))
+{
+	writeHeader_();
+}
+
+void WebSocket::Frame::writeHeader_() noexcept {
+	header_[0] = static_cast<std::byte>((fin_ ? 0x80 : 0) | (rsv1_ ? 0x40 : 0) | static_cast<std::uint8_t>(opcode_));
+	if(length_ < 126){
+		header_[1] = static_cast<std::byte>(length_);
+		headerSize_ = 2;
+	} else if(length_ <= 0xFFFF){
+		header_[1] = std::byte{126};
+		header_[2] = static_cast<std::byte>(length_ >> 8);
+		header_[3] = static_cast<std::byte>(length_ & 0xFF);
+		headerSize_ = 4;
+	} else {
+		header_[1] = std::byte{127};
+		for(std::size_t i = 0; i < 8; ++i) header_[2 + i] = static_cast<std::byte>(length_ >> (56 - 8 * i));
+		headerSize_ = 10;
+	}
+}
+
+Error WebSocket::Frame::parseHeader_() noexcept {
+	auto b0 = std::to_integer<std::uint8_t>(header_[0]);
+	auto b1 = std::to_integer<std::uint8_t>(header_[1]);
+	fin_ = b0 & 0x80;
+	rsv1_ = b0 & 0x40;
+	opcode_ = static_cast<Opcode>(b0 & 0x0F);
+	masked_ = b1 & 0x80;
+	if(b0 & 0x30) return ErrorCode::INVALID_MESSAGE; // RSV2 and RSV3 belong to no extension here
+	switch(opcode_){
+	case Opcode::Continuation: case Opcode::Text: case Opcode::Binary:
+	case Opcode::Close: case Opcode::Ping: case Opcode::Pong:
+		break;
+	default:
+		return ErrorCode::INVALID_MESSAGE;
+	}
+	if(!masked_) return ErrorCode::INVALID_MESSAGE; // every frame from a client is masked
+
+	std::size_t idx = 2;
+	length_ = b1 & 0x7F;
+	if(length_ == 126){
+		length_ = (std::to_integer<std::uint64_t>(header_[2]) << 8) | std::to_integer<std::uint64_t>(header_[3]);
+		idx = 4;
+	} else if(length_ == 127){
+		length_ = 0;
+		for(std::size_t i = 0; i < 8; ++i) length_ = (length_ << 8) | std::to_integer<std::uint64_t>(header_[2 + i]);
+		idx = 10;
+		if(length_ >> 63) return ErrorCode::INVALID_MESSAGE;
+	}
+	std::memcpy(key_.data(), header_.data() + idx, key_.size());
+
+	if(isControl(opcode_) && (!fin_ || length_ > 125)) return ErrorCode::INVALID_MESSAGE;
+	if(length_ > maxPayload_) return ErrorCode::BODY_TOO_LARGE;
+	return {};
+}
+
+std::tuple<Error, bool, std::size_t> WebSocket::Frame::consumeHeaderSome(std::span<const std::byte> data){
+	std::size_t consumed = 0;
+	for(;;){
+		std::size_t needed = headerIdx_ < 2 ? 2 : headerSize_;
+		std::size_t numCopy = std::min(data.size() - consumed, needed - headerIdx_);
+		std::memcpy(header_.data() + headerIdx_, data.data() + consumed, numCopy);
+		headerIdx_ += numCopy;
+		consumed += numCopy;
+		if(headerIdx_ < needed) return {{}, false, consumed};
+		if(needed == 2){
+			// the first two bytes tell how long the rest of the header is
+			auto len = std::to_integer<std::uint8_t>(header_[1]) & 0x7F;
+			headerSize_ = 2 + (len == 126 ? 2 : len == 127 ? 8 : 0) + ((std::to_integer<std::uint8_t>(header_[1]) & 0x80) ? 4 : 0);
+			if(headerSize_ > 2) continue;
+		}
+		auto err = parseHeader_();
+		headerIdx_ = 0;
+		bodyIdx_ = 0;
+		return {err, true, consumed};
+	}
+}
+
+std::tuple<Error, bool, std::size_t> WebSocket::Frame::consumeBodySome(std::span<const std::byte> data){
+	if(payload_.size() != length_) payload_.resize(length_);
+	std::size_t numCopy = static_cast<std::size_t>(std::min<std::uint64_t>(data.size(), length_ - bodyIdx_));
+	std::memcpy(payload_.data() + bodyIdx_, data.data(), numCopy);
+	Simd::unmask(std::span{payload_}.subspan(bodyIdx_, numCopy), key_, bodyIdx_);
+	bodyIdx_ += numCopy;
+	return {{}, bodyIdx_ >= length_, numCopy};
+}
+
+std::tuple<Error, bool, std::size_t, std::span<const std::byte>> WebSocket::Frame::consumeBodyInPlace(std::span<std::byte> data){
+	std::size_t n = static_cast<std::size_t>(std::min<std::uint64_t>(data.size(), length_ - bodyIdx_));
+	Simd::unmask(data.first(n), key_, bodyIdx_);
+	bodyIdx_ += n;
+	return {{}, bodyIdx_ >= length_, n, data.first(n)};
+}
+
+std::tuple<Error, bool, std::size_t> WebSocket::Frame::produceHeaderSome(std::span<std::byte> out){
+	std::size_t numCopy = std::min(out.size(), headerSize_ - headerIdx_);
+	std::memcpy(out.data(), header_.data() + headerIdx_, numCopy);
+	headerIdx_ += numCopy;
+	bool finished = headerIdx_ >= headerSize_;
+	if(finished) headerIdx_ = 0;
+	return {{}, finished, numCopy};
+}
+
+std::tuple<Error, bool, std::size_t> WebSocket::Frame::produceBodySome(std::span<std::byte> out){
+	auto body = sendSpan_();
+	std::size_t numCopy = std::min<std::size_t>(out.size(), body.size() - bodyIdx_);
+	std::memcpy(out.data(), body.data() + bodyIdx_, numCopy);
+	bodyIdx_ += numCopy;
+	bool finished = bodyIdx_ >= body.size();
+	if(finished) bodyIdx_ = 0;
+	return {{}, finished, numCopy};
+}
+
+std::tuple<Error, std::size_t> WebSocket::Frame::produceBuffers(std::span<std::span<const std::byte>> out){
+	if(out.size() < 2) return {ErrorCode::INVALID_STATE, 0};
+	out[0] = std::span<const std::byte>{header_.data(), headerSize_};
+	auto body = sendSpan_();
+	if(body.empty()) return {Error{}, 1};
+	out[1] = body;
+	return {Error{}, 2};
+}
+
+/*~~~~~~~~~~~~~~~~~~~~~~~PERMESSAGE-DEFLATE~~~~~~~~~~~~~~~~~~~~~~~*/
+
+WebSocket::PerMessageDeflate::PerMessageDeflate(const Extensions& extensions, int level):
+	extensions_(extensions), level_(level) {}
+
+Deflater_* WebSocket::PerMessageDeflate::deflater_(){
+	if(extensions_.serverContextTakeover){
+		if(!ownDeflater_) ownDeflater_ = std::make_unique<Deflater_>(level_, extensions_.serverMaxWindowBits);
+		return ownDeflater_.get();
+	}
+	// one per level and window size a socket of this thread asked for
+	thread_local std::map<std::pair<int, int>, std::unique_ptr<Deflater_>> shared;
+	auto& d = shared[{level_, extensions_.serverMaxWindowBits}];
+	if(!d) d = std::make_unique<Deflater_>(level_, extensions_.serverMaxWindowBits);
+	return d.get();
+}
+
+Inflater_* WebSocket::PerMessageDeflate::inflater_(){
+	if(extensions_.clientContextTakeover){
+		if(!ownInflater_) ownInflater_ = std::make_unique<Inflater_>();
+		return ownInflater_.get();
+	}
+	thread_local Inflater_ shared;
+	return &shared;
+}
+
+Error WebSocket::PerMessageDeflate::compress(std::span<const std::byte> message, std::vector<std::byte>& out){
+	auto* d = deflater_();
+	if(!d->ok) return ErrorCode::COMPRESSION_ERROR;
+	auto& s = d->stream;
+	s.next_in = reinterpret_cast<Bytef*>(const_cast<std::byte*>(message.data()));
+	s.avail_in = static_cast<uInt>(message.size());
+	out.resize(deflateBound(&s, static_cast<uLong>(message.size())) + 16);
+	std::size_t produced = 0;
+	for(;;){
+		s.next_out = reinterpret_cast<Bytef*>(out.data() + produced);
+		s.avail_out = static_cast<uInt>(out.size() - produced);
+		int ret = deflate(&s, Z_SYNC_FLUSH);
+		produced = out.size() - s.avail_out;
+		if(ret != Z_OK && ret != Z_BUF_ERROR){
+			deflateReset(&s);
+			return ErrorCode::COMPRESSION_ERROR;
+		}
+		if(s.avail_out > 0) break;
+		out.resize(out.size() * 2);
+	}
+	if(!extensions_.serverContextTakeover) deflateReset(&s);
+	// the sync flush ends with an empty stored block, 00 00 ff ff, which the receiver adds back
+	if(produced < 4) return ErrorCode::COMPRESSION_ERROR;
+	out.resize(produced - 4);
+	return {};
+}
+
+Error WebSocket::PerMessageDeflate::decompress(std::span<const std::byte> message, std::vector<std::byte>& out, std::size_t maxSize){
+	static constexpr std::array<std::byte, 4> tail{std::byte{0x00}, std::byte{0x00}, std::byte{0xFF}, std::byte{0xFF}};
+	auto* i = inflater_();
+	if(!i->ok) return ErrorCode::COMPRESSION_ERROR;
+	auto& s = i->stream;
+	Error err;
+	bool ended = false;
+	for(auto in : {message, std::span<const std::byte>{tail}}){
+		s.next_in = reinterpret_cast<Bytef*>(const_cast<std::byte*>(in.data()));
+		s.avail_in = static_cast<uInt>(in.size());
+		while(!ended){
+			// one byte more than allowed tells a message that is too big from one that just fits
+			std::size_t start = out.size();
+			if(start > maxSize){
+				err = ErrorCode::BODY_TOO_LARGE;
+				break;
+			}
+			std::size_t room = std::min<std::size_t>(std::max<std::size_t>(in.size() * 2, 4096), maxSize + 1 - start);
+			out.resize(start + room);
+			s.next_out = reinterpret_cast<Bytef*>(out.data() + start);
+			s.avail_out = static_cast<uInt>(room);
+			int ret = inflate(&s, Z_SYNC_FLUSH);
+			out.resize(out.size() - s.avail_out);
+			if(ret == Z_STREAM_END) ended = true; // a final block, the tail is not needed then
+			else if(ret != Z_OK && ret != Z_BUF_ERROR){
+				err = ErrorCode::COMPRESSION_ERROR;
+				break;
+			}
+			else if(s.avail_out > 0) break; // input used up and nothing held back
+		}
+		if(err || ended) break;
+	}
+	if(!err && out.size() > maxSize) err = ErrorCode::BODY_TOO_LARGE;
+	if(err || ended || !extensions_.clientContextTakeover) inflateReset(&s);
+	return err;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "asio/awaitable.hpp"
+#include "asio/co_spawn.hpp"
+#include "asio/execution_context.hpp"
+#include "asio/execution.hpp"
+#include "asio/use_awaitable.hpp"
+
+import std;
+import taskPool;
+
+// Runs f on executor, e.g. that of a ComputePool, and resumes the awaiting coroutine on its own
+// executor with what f returned, so CPU-bound work such as compressing a large body stays off
+// the I/O threads. An exception thrown by f is rethrown in the awaiting coroutine.
+// export
+template <typename Executor, typename F>
+requires std::invocable<F&>
+asio::awaitable<std::invoke_result_t<F&>> offload(Executor executor, F f){
+	co_return co_await asio::co_spawn(executor, [f = std::move(f)]() mutable -> asio::awaitable<std::invoke_result_t<F&>> {
+		co_return f();
+	}, asio::use_awaitable);
+}
+
+// The same for a coroutine, e.g. a whole route handler: it runs on executor, every operation it
+// awaits completes there, and the awaiting coroutine is resumed on its own executor with its
+// result. It must not touch a socket of the awaiting one.
+// export
+template <typename Executor, typename T>
+asio::awaitable<T> offload(Executor executor, asio::awaitable<T> work){
+	return asio::co_spawn(executor, std::move(work), asio::use_awaitable);
+}
+
+// An asio execution context whose work runs on a work-stealing TaskPool, next to the
+// single-threaded io_contexts of a Server. By default it takes the cores the I/O threads leave
+// over: its workers run niced, a busy pool slows the event loops as little as possible.
+// export
+class ComputePool : public asio::execution_context {
+	TaskPool tasks_;
+public:
+	class executor_type;
+
+	explicit ComputePool(std::size_t threads = std::max(1u, std::thread::hardware_concurrency()), int nice = 10):
+		tasks_(threads, nice) {}
+	ComputePool(const ComputePool&) = delete;
+	ComputePool& operator=(const ComputePool&) = delete;
+	// the workers finish what is queued before the services, and the handlers they hold, go
+	~ComputePool(){
+		tasks_.join();
+		shutdown();
+		destroy();
+	}
+
+	executor_type get_executor() noexcept;
+	TaskPool::Stats stats() const noexcept { return tasks_.stats(); }
+	std::size_t size() const noexcept { return tasks_.size(); }
+};
+
+// Never runs work inline, it always goes on a deque of the pool.
+class ComputePool::executor_type{
+	ComputePool* pool_;
+public:
+	explicit executor_type(ComputePool& pool) noexcept: pool_(&pool) {}
+
+	template <typename F>
+	void execute(F&& f) const {
+		pool_->tasks_.submit(std::forward<F>(f));
+	}
+
+	ComputePool& query(asio::execution::context_t) const noexcept { return *pool_; }
+	static constexpr asio::execution::blocking_t query(asio::execution::blocking_t) noexcept { return asio::execution::blocking.never; }
+	executor_type require(asio::execution::blocking_t::never_t) const noexcept { return *this; }
+
+	bool running_in_this_thread() const noexcept { return pool_->tasks_.runningInThisThread(); }
+	bool operator==(const executor_type&) const noexcept = default;
+};
+
+inline ComputePool::executor_type ComputePool::get_executor() noexcept {
+	return executor_type{*this};
+}
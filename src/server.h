@@ -4,9 +4,23 @@
 #include <asio/io_context.hpp>
 #include <asio/co_spawn.hpp>
 #include <asio/detached.hpp>
+#include <asio/steady_timer.hpp>
+#include <asio/signal_set.hpp>
+#include <asio/post.hpp>
+
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <pthread.h>
+#include <sched.h>
 
 import std;
 import http;
+import error;
+import handoff;
+import timerWheel;
+import buffer;
 
 template<typename T>
 concept ConnectionHandler =
@@ -16,27 +30,400 @@ requires(T t, Connection c) {
 	{ t.connect(std::move(c)) } -> std::same_as<asio::awaitable<void>>; // member function
 };
 
+// export
+struct AdmissionOptions{
+	// connections open at once on one thread and on all of them, 0 is no limit; a connection over
+	// either is answered with 503 and closed right after it is accepted
+	std::size_t maxConnectionsPerThread = 0;
+	std::size_t maxConnections = 0;
+	// A thread pauses accepting while it has more requests in flight or its event loop lags more
+	// than this, 0 is no limit. It resumes once both are back under 3/4 of these.
+	std::size_t maxInFlight = 0;
+	std::chrono::steady_clock::duration maxLoopLag = std::chrono::milliseconds(50);
+	// after pausing for this long, the connections waiting meanwhile are answered with 503
+	std::chrono::steady_clock::duration maxPause = std::chrono::milliseconds(500);
+	std::chrono::seconds retryAfter{1};
+};
+
+// The load of this thread that admission control looks at: its connections, the requests they
+// read and did not answer yet, and how late its event loop runs timers. Every io_context runs
+// on its own thread, so this needs no locking.
+// export
+class Admission{
+	std::size_t connections_ = 0;
+	std::size_t inFlight_ = 0;
+	std::chrono::steady_clock::duration lag_{};
+	// read by Server::coreLoads from other threads
+	std::atomic<std::uint64_t> accepted_{0};
+	std::atomic<std::uint64_t> steered_{0};
+	std::atomic<std::uint64_t> answered_{0};
+	// the timers of this thread's acceptors that stopped accepting, each waits until it is
+	// cancelled once the load is under the resume limits of options_, or until it is time to shed
+	std::vector<asio::steady_timer*> paused_;
+	const AdmissionOptions* options_ = nullptr;
+
+	friend class Server;
+	static void count_(std::atomic<std::uint64_t>& counter, std::uint64_t n) noexcept {
+		// only this thread writes it
+		counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+	// jumps to a stall at once and decays over a few samples after it
+	void sampleLag_(std::chrono::steady_clock::duration lag) noexcept {
+		lag_ = std::max(lag, lag_ * 3 / 4);
+		resumeIfUnder_();
+	}
+	void resumeIfUnder_() noexcept {
+		if(!paused_.empty() && !overloaded(*options_, true)) resumeAll_();
+	}
+	void resumeAll_() noexcept {
+		for(auto* timer : paused_) timer->cancel();
+	}
+public:
+	static Admission& local(){
+		thread_local Admission admission;
+		return admission;
+	}
+
+	std::size_t connections() const noexcept { return connections_; }
+	std::size_t inFlight() const noexcept { return inFlight_; }
+	std::chrono::steady_clock::duration lag() const noexcept { return lag_; }
+
+	// whether this thread has more than it can take, with paused for the lower resume limits
+	bool overloaded(const AdmissionOptions& options, bool paused) const noexcept {
+		auto limit = [paused](auto max){ return paused ? max - max / 4 : max; };
+		return (options.maxInFlight && inFlight_ > limit(options.maxInFlight)) ||
+			(options.maxLoopLag > std::chrono::steady_clock::duration::zero() && lag_ > limit(options.maxLoopLag));
+	}
+
+	// The requests of one connection that were read and not answered yet, held by its handler.
+	// Whatever is left is taken off the count when the connection ends.
+	class InFlight{
+		std::size_t count_ = 0;
+	public:
+		InFlight() = default;
+		InFlight(const InFlight&) = delete;
+		InFlight& operator=(const InFlight&) = delete;
+		~InFlight() { done(count_); }
+
+		void add(std::size_t n = 1) noexcept {
+			count_ += n;
+			local().inFlight_ += n;
+		}
+		void done(std::size_t n) noexcept {
+			n = std::min(n, count_);
+			count_ -= n;
+			// a connection left over when its io_context stopped ends on another thread
+			auto& admission = local();
+			admission.inFlight_ -= std::min(n, admission.inFlight_);
+			admission.answered_.fetch_add(n, std::memory_order_relaxed);
+			admission.resumeIfUnder_();
+		}
+	};
+};
+
+// Where the threads of a Server run, see Server::placement.
+// export
+struct Placement{
+	// thread i runs only on the i-th CPU this process may run on
+	bool pin = false;
+	// With pin, a connection is accepted by the thread pinned to the CPU that took its packets,
+	// where they are still in cache, by a BPF program on the SO_REUSEPORT group of the listening
+	// sockets. CPUs without a thread fall back to spreading by CPU number.
+	bool steer = false;
+	// blocks of every BufferPool size class each thread allocates up front, with pin they are
+	// on the NUMA node of its CPU
+	std::size_t prefill = 0;
+};
+
 class Server{
 	asio::ip::tcp::endpoint endpoint;
 	std::vector<std::jthread> threads;
 	std::vector<std::unique_ptr<asio::io_context>> contexts;
 	std::vector<asio::executor_work_guard<asio::io_context::executor_type>> workGuards;
+	// acceptor i runs on context i % contexts.size(), there are more than contexts only when more
+	// were inherited
 	std::vector<asio::ip::tcp::acceptor> acceptors;
+	Transport transport;
+
+	std::atomic<std::size_t> connections{0};
+	// signalled when the last connection ends, for drain()
+	std::mutex drainMutex;
+	std::condition_variable drained;
+	std::atomic<bool> draining{false};
+	std::chrono::steady_clock::duration drainDeadline = std::chrono::seconds(30);
+	std::string handoffPath;
+	Handoff::Offer handoff;
+	// the server the listening sockets were taken from, told once every thread accepts on them
+	Handoff::Taken predecessor;
+	std::atomic<std::size_t> unstarted{0};
+	std::jthread handoffThread;
+	std::jthread drainThread;
+	Timeouts timeouts;
+	AdmissionOptions admission;
+	// the 503 of a shed connection, around the Date header of its thread
+	static constexpr std::string_view shedHead = "HTTP/1.1 503 Service Unavailable\r\nDate: ";
+	std::string shedTail;
+	std::atomic<std::uint64_t> shed{0};
+	Placement place;
+	// the CPU of each thread once pinned, -1 where it is not
+	std::vector<int> cpus;
+	// the Admission of each running thread, for coreLoads()
+	std::vector<std::atomic<Admission*>> loads;
+
+	// keeps this thread's Date header current, waking just after each wall-clock second
+	static asio::awaitable<void> refreshDate(){
+		asio::steady_timer timer{co_await asio::this_coro::executor};
+		for(;;){
+			Http::DateCache::local().refresh();
+			auto sinceSecond = std::chrono::system_clock::now().time_since_epoch() % std::chrono::seconds(1);
+			timer.expires_after(std::chrono::seconds(1) - sinceSecond);
+			auto [ec] = co_await timer.async_wait(asio::as_tuple(asio::use_awaitable));
+			if(ec) co_return;
+		}
+	}
+
+	// advances this thread's TimerWheel, whose deadlines end the connections that stall
+	static asio::awaitable<void> advanceTimers(){
+		asio::steady_timer timer{co_await asio::this_coro::executor};
+		auto& wheel = TimerWheel::local();
+		for(;;){
+			timer.expires_after(wheel.tick());
+			auto [ec] = co_await timer.async_wait(asio::as_tuple(asio::use_awaitable));
+			if(ec) co_return;
+			wheel.advance(std::chrono::steady_clock::now());
+		}
+	}
+
+	static std::vector<int> allowedCpus(){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		std::vector<int> out;
+		if(::sched_getaffinity(0, sizeof(set), &set) != 0) return out;
+		for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+			if(CPU_ISSET(cpu, &set)) out.push_back(cpu);
+		return out;
+	}
+
+	static int bpf(int cmd, bpf_attr& attr) noexcept {
+		return static_cast<int>(::syscall(__NR_bpf, cmd, &attr, sizeof(attr)));
+	}
+
+	// An eBPF program that looks the CPU a connection came in on up in a REUSEPORT_SOCKARRAY,
+	// whose slot for every CPU holds the listener to take it. The map names the sockets
+	// themselves, whatever their order in the SO_REUSEPORT group.
+	bool steerBySockArray(std::size_t n){
+		int numCpus = static_cast<int>(::sysconf(_SC_NPROCESSORS_CONF));
+		bpf_attr attr{};
+		attr.map_type = BPF_MAP_TYPE_REUSEPORT_SOCKARRAY;
+		attr.key_size = sizeof(std::uint32_t);
+		attr.value_size = sizeof(int);
+		attr.max_entries = static_cast<std::uint32_t>(std::max(numCpus, 1));
+		int map = bpf(BPF_MAP_CREATE, attr);
+		if(map < 0) return false;
+		for(int cpu = 0; cpu < numCpus; ++cpu){
+			auto pinned = std::ranges::find(cpus.begin(), cpus.begin() + n, cpu);
+			std::size_t i = pinned != cpus.begin() + n ? pinned - cpus.begin() : cpu % n;
+			std::uint32_t key = static_cast<std::uint32_t>(cpu);
+			int fd = acceptors[i].native_handle();
+			attr = {};
+			attr.map_fd = static_cast<std::uint32_t>(map);
+			attr.key = reinterpret_cast<std::uint64_t>(&key);
+			attr.value = reinterpret_cast<std::uint64_t>(&fd);
+			attr.flags = BPF_ANY;
+			if(bpf(BPF_MAP_UPDATE_ELEM, attr) != 0){
+				::close(map);
+				return false;
+			}
+		}
+
+		auto insn = [](std::uint8_t code, std::uint8_t dst, std::uint8_t src, std::int16_t off, std::int32_t imm){
+			bpf_insn in{};
+			in.code = code;
+			in.dst_reg = dst;
+			in.src_reg = src;
+			in.off = off;
+			in.imm = imm;
+			return in;
+		};
+		std::array code{
+			insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+			// the key is the CPU running the program, the one the packet is handled on
+			insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_smp_processor_id),
+			insn(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_0, -4, 0),
+			insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+			insn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, map),
+			insn(0, 0, 0, 0, 0),
+			insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+			insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -4),
+			insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+			insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_select_reuseport),
+			// when nothing was selected the kernel picks by hash as without a program
+			insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+			insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		};
+		static constexpr char license[] = "Dual MIT/GPL";
+		attr = {};
+		attr.prog_type = BPF_PROG_TYPE_SK_REUSEPORT;
+		attr.insns = reinterpret_cast<std::uint64_t>(code.data());
+		attr.insn_cnt = static_cast<std::uint32_t>(code.size());
+		attr.license = reinterpret_cast<std::uint64_t>(license);
+		int prog = bpf(BPF_PROG_LOAD, attr);
+		// the program holds on to the map, and the group to the program
+		::close(map);
+		if(prog < 0) return false;
+		bool attached = ::setsockopt(acceptors[0].native_handle(), SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF, &prog, sizeof(prog)) == 0;
+		::close(prog);
+		return attached;
+	}
+
+	// Picks the listener of the thread on the CPU a connection came in on, see steerBySockArray.
+	// Without eBPF, e.g. when unprivileged, a classic program returns the index of the listener in
+	// the SO_REUSEPORT group instead, which is the order the sockets were bound in.
+	void steerByCpu(){
+		std::size_t n = std::min(contexts.size(), acceptors.size());
+		if(n < 2) return;
+		if(steerBySockArray(n)){
+			setIncomingCpu(n);
+			return;
+		}
+		// inherited sockets were bound by a predecessor, in an order this server cannot know
+		if(!predecessor.fds.empty()){
+			std::println("cannot steer inherited listening sockets by cpu without eBPF");
+			return;
+		}
+		if(2 * n + 3 > BPF_MAXINSNS) return;
+		std::vector<sock_filter> code;
+		code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<std::uint32_t>(SKF_AD_OFF + SKF_AD_CPU)));
+		for(std::size_t i = 0; i < n; ++i){
+			code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<std::uint32_t>(cpus[i]), 0, 1));
+			code.push_back(BPF_STMT(BPF_RET | BPF_K, static_cast<std::uint32_t>(i)));
+		}
+		code.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<std::uint32_t>(n)));
+		code.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+		sock_fprog prog{static_cast<unsigned short>(code.size()), code.data()};
+		if(::setsockopt(acceptors[0].native_handle(), SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0){
+			std::println("cannot steer connections by cpu: {}", std::strerror(errno));
+			return;
+		}
+		setIncomingCpu(n);
+	}
+
+	void setIncomingCpu(std::size_t n){
+		for(std::size_t i = 0; i < n; ++i)
+			::setsockopt(acceptors[i].native_handle(), SOL_SOCKET, SO_INCOMING_CPU, &cpus[i], sizeof(int));
+	}
+
+	// samples how late this thread's event loop runs a timer, for Admission
+	static asio::awaitable<void> measureLag(){
+		asio::steady_timer timer{co_await asio::this_coro::executor};
+		for(;;){
+			timer.expires_after(std::chrono::milliseconds(20));
+			auto [ec] = co_await timer.async_wait(asio::as_tuple(asio::use_awaitable));
+			if(ec) co_return;
+			Admission::local().sampleLag_(std::chrono::steady_clock::now() - timer.expiry());
+		}
+	}
+
+	bool overCap(){
+		return (admission.maxConnectionsPerThread && Admission::local().connections() >= admission.maxConnectionsPerThread) ||
+			(admission.maxConnections && connections.load(std::memory_order_relaxed) >= admission.maxConnections);
+	}
+
+	// Answers 503 with one write from the preformatted response and closes, without a coroutine,
+	// buffers or the router. What the client sent already is read first, closing on unread bytes
+	// would reset the connection and could lose the answer.
+	void shedConnection(asio::ip::tcp::socket& socket){
+		int fd = socket.native_handle();
+		auto date = Http::DateCache::local().value();
+		std::array<iovec, 3> iov{{
+			{const_cast<char*>(shedHead.data()), shedHead.size()},
+			{const_cast<char*>(date.data()), date.size()},
+			{shedTail.data(), shedTail.size()},
+		}};
+		msghdr msg{};
+		msg.msg_iov = iov.data();
+		msg.msg_iovlen = iov.size();
+		::sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		::shutdown(fd, SHUT_WR);
+		std::array<std::byte, 4096> discard;
+		while(::recv(fd, discard.data(), discard.size(), MSG_DONTWAIT) > 0) {}
+		std::error_code ec;
+		socket.close(ec);
+		shed.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void connectionEnded(){
+		if(connections.fetch_sub(1, std::memory_order_relaxed) != 1) return;
+		std::lock_guard lock{drainMutex};
+		drained.notify_all();
+	}
 
 	template<typename ConnectionHandler>
 	asio::awaitable<void> listen(int i, ConnectionHandler&& handler){
-		auto& executor = *contexts[i];
+		auto& executor = *contexts[i % contexts.size()];
 		// auto executor = co_await asio::this_coro::executor;
 		auto& acceptor = acceptors[i];
+		auto& load = Admission::local();
+		asio::steady_timer pause{executor};
+		bool paused = false;
+		std::chrono::steady_clock::time_point pausedSince;
 
 		for(;;)
 		{
-			Connection conn{ co_await acceptor.async_accept(executor) };
+			// An overloaded thread leaves new connections in the accept queue until it catches up,
+			// or for so long that they are better off told to come back later.
+			bool shedding = false;
+			if(load.overloaded(admission, paused)){
+				auto now = std::chrono::steady_clock::now();
+				if(!paused){
+					paused = true;
+					pausedSince = now;
+				}
+				if(now - pausedSince < admission.maxPause){
+					// Admission cancels the wait once the load is back under the resume limits
+					pause.expires_at(pausedSince + admission.maxPause);
+					load.options_ = &admission;
+					load.paused_.push_back(&pause);
+					co_await pause.async_wait(asio::as_tuple(asio::use_awaitable));
+					std::erase(load.paused_, &pause);
+					if(!acceptor.is_open()) co_return;
+					continue;
+				}
+				shedding = true;
+			} else {
+				paused = false;
+			}
+
+			auto [ec, socket] = co_await acceptor.async_accept(executor, asio::as_tuple(asio::use_awaitable));
+			if(ec){
+				if(!acceptor.is_open()) co_return; // closed by drain()
+				std::println("accept error: {}", ec.message());
+				continue;
+			}
+			if(shedding || overCap()){
+				shedConnection(socket);
+				continue;
+			}
+			Admission::count_(load.accepted_, 1);
+			if(place.pin){
+				int cpu = -1;
+				socklen_t len = sizeof(cpu);
+				if(::getsockopt(socket.native_handle(), SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 && cpu == cpus[i % contexts.size()])
+					Admission::count_(load.steered_, 1);
+			}
+			Connection conn = transport == Transport::IO_URING ?
+				Connection{UringSocket{executor, socket.release()}} :
+				Connection{std::move(socket)};
+			conn.timeouts(timeouts);
+			connections.fetch_add(1, std::memory_order_relaxed);
+			++load.connections_;
 			if constexpr (requires { handler(std::move(conn)); }) {
 				asio::co_spawn(
 					executor,
 					handler(std::move(conn)),
-					[](std::exception_ptr e) {
+					[this](std::exception_ptr e) {
+						connectionEnded();
+						--Admission::local().connections_;
 						if(!e) return;
 						try
 						{
@@ -52,7 +439,9 @@ class Server{
 				asio::co_spawn(
 					executor,
 					handler.connect(std::move(conn)),
-					[](std::exception_ptr e) {
+					[this](std::exception_ptr e) {
+						connectionEnded();
+						--Admission::local().connections_;
 						if(!e) return;
 						try
 						{
@@ -68,15 +457,32 @@ class Server{
 		}
 	}
 public:
-	Server(std::string address, std::uint16_t port, std::size_t numThreads):
-		endpoint(asio::ip::tcp::endpoint{asio::ip::make_address(address), port})
+	// inherited are listening sockets a predecessor handed over (see Handoff::take), used in place
+	// of binding new ones. Threads beyond them bind their own, with SO_REUSEPORT they share the port.
+	// The predecessor drains once run() accepts on them.
+	Server(std::string address, std::uint16_t port, std::size_t numThreads, Transport transport = Transport::REACTOR, Handoff::Taken inherited = {}):
+		endpoint(asio::ip::tcp::endpoint{asio::ip::make_address(address), port}),
+		transport(transport),
+		predecessor(std::move(inherited)),
+		cpus(numThreads, -1),
+		loads(numThreads)
 	{
+		admissionControl(admission);
+		if(transport == Transport::IO_URING && !UringService::supported()){
+			std::println("io_uring not available, falling back to the reactor transport");
+			this->transport = Transport::REACTOR;
+		}
+
 		// create io_contexts
 		for (auto i = 0u; i < numThreads; ++i) {
 			contexts.emplace_back(std::make_unique<asio::io_context>(1));
 			workGuards.emplace_back(asio::make_work_guard(*contexts[i]));
 			auto& acc = acceptors.emplace_back(*contexts[i]);
 
+			if(i < predecessor.fds.size()){
+				acc.assign(endpoint.protocol(), predecessor.fds[i]);
+				continue;
+			}
 			acc.open(endpoint.protocol());
 			// acc.set_option(asio::socket_base::reuse_address(true));
 			int yes = 1;
@@ -85,19 +491,98 @@ public:
 			acc.bind(endpoint);
 			acc.listen();
 		}
+		// connections queued on every inherited socket are still to be taken, so none is closed
+		for (auto i = numThreads; i < predecessor.fds.size(); ++i)
+			acceptors.emplace_back(*contexts[i % numThreads]).assign(endpoint.protocol(), predecessor.fds[i]);
+	}
+
+	// How long drain() waits for connections when SIGINT or SIGTERM starts it.
+	void drainAfterSignal(std::chrono::steady_clock::duration deadline){
+		drainDeadline = deadline;
+	}
+
+	// While running, hands the listening sockets to a successor that asks on path and drains once
+	// it accepts on them, so a new build takes over the port without refusing a connection.
+	Error handoffOn(std::string path){
+		handoffPath = std::move(path);
+		return handoff.open(handoffPath);
+	}
+
+	// The timeouts of every connection accepted from now on, a handler may still change them.
+	void connectionTimeouts(const Timeouts& t){
+		timeouts = t;
+	}
+
+	// Where the threads run and their buffers live, see Placement. Takes effect in run().
+	void placement(const Placement& p){
+		place = p;
+	}
+
+	struct CoreLoad{
+		int cpu; // -1 when not pinned
+		std::uint64_t accepted;
+		std::uint64_t steered; // accepted on the CPU that took their packets
+		std::uint64_t answered; // requests, as counted by Admission::InFlight
+	};
+	// what each thread did so far, while run() runs
+	std::vector<CoreLoad> coreLoads() const {
+		std::vector<CoreLoad> out;
+		for(std::size_t i = 0; i < loads.size(); ++i){
+			auto* load = loads[i].load(std::memory_order_acquire);
+			if(!load) continue;
+			out.push_back({cpus[i], load->accepted_.load(std::memory_order_relaxed), load->steered_.load(std::memory_order_relaxed), load->answered_.load(std::memory_order_relaxed)});
+		}
+		return out;
+	}
+
+	// Limits on the connections taken from now on, see AdmissionOptions.
+	void admissionControl(const AdmissionOptions& options){
+		admission = options;
+		shedTail = std::format("\r\nRetry-After: {}\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", options.retryAfter.count());
+	}
+	// connections answered with 503 so far
+	std::uint64_t shedConnections() const noexcept { return shed.load(std::memory_order_relaxed); }
+
+	// Stops accepting and ends idle connections at once, lets the others finish what they are
+	// in the middle of, answering with Connection: close, for up to deadline and then stops
+	// every io_context, which makes run() return. Blocks until then; safe from any thread but
+	// the server's own.
+	void drain(std::chrono::steady_clock::duration deadline){
+		if(draining.exchange(true)) return;
+		handoff.stop();
+		for(std::size_t i = 0; i < contexts.size(); ++i){
+			asio::post(*contexts[i], [this, i]{
+				for(std::size_t a = i; a < acceptors.size(); a += contexts.size()){
+					std::error_code ec;
+					acceptors[a].close(ec);
+				}
+				Drain::local().start();
+				// a paused acceptor finds its socket closed
+				Admission::local().resumeAll_();
+			});
+		}
+		std::unique_lock lock{drainMutex};
+		drained.wait_for(lock, deadline, [this]{ return connections.load(std::memory_order_relaxed) == 0; });
+		lock.unlock();
+		for(auto& context : contexts) context->stop();
 	}
 
 	template<typename ConnectionHandler>
 	void run(ConnectionHandler&& handler){
 		for(int i = 0; i < contexts.size(); ++i){
+			asio::co_spawn(*contexts[i], refreshDate(), asio::detached);
+			asio::co_spawn(*contexts[i], advanceTimers(), asio::detached);
+			asio::co_spawn(*contexts[i], measureLag(), asio::detached);
+		}
+		for(int i = 0; i < acceptors.size(); ++i){
 			asio::co_spawn(
-				*contexts[i],
+				*contexts[i % contexts.size()],
 				listen(i, std::forward<ConnectionHandler>(handler)),
 				[](std::exception_ptr e)
 				{
-					std::println("error");
 					if(e)
 					{
+						std::println("error");
 						try
 						{
 							std::rethrow_exception(e);
@@ -111,16 +596,61 @@ public:
 			);
 		}
 
-		// create worker threads
+		// drain() blocks, so it gets a thread of its own instead of an io_context's
+		asio::signal_set signals{*contexts[0], SIGINT, SIGTERM};
+		signals.async_wait([this](std::error_code ec, int){
+			if(ec) return;
+			std::println("draining...");
+			drainThread = std::jthread([this]{ drain(drainDeadline); });
+		});
+		if(!handoffPath.empty()){
+			handoffThread = std::jthread([this]{
+				std::vector<int> fds;
+				for(auto& acceptor : acceptors) fds.push_back(acceptor.native_handle());
+				if(handoff.serve(fds)) return; // stopped by a drain
+				std::println("listening sockets handed off, draining...");
+				drain(drainDeadline);
+			});
+		}
+		// posted behind the first accept of each thread
+		if(!predecessor.fds.empty()){
+			unstarted = contexts.size();
+			for(auto& context : contexts){
+				asio::post(*context, [this]{
+					if(unstarted.fetch_sub(1) != 1) return;
+					if(auto err = predecessor.ack()) std::println("cannot tell the predecessor to drain: {}", err.what());
+				});
+			}
+		}
+
+		if(place.pin){
+			auto allowed = allowedCpus();
+			for(std::size_t i = 0; i < cpus.size() && !allowed.empty(); ++i) cpus[i] = allowed[i % allowed.size()];
+			if(place.steer) steerByCpu();
+		}
+
+		// create worker threads, each pinned before it allocates anything of its own
 		for (auto i = 0u; i < contexts.size(); ++i) {
 			threads.emplace_back([this, i]{
+				if(cpus[i] >= 0){
+					cpu_set_t set;
+					CPU_ZERO(&set);
+					CPU_SET(cpus[i], &set);
+					if(::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) != 0) std::println("cannot pin thread {} to cpu {}", i, cpus[i]);
+				}
+				if(place.prefill) BufferPool::local().prefill(place.prefill);
+				loads[i].store(&Admission::local(), std::memory_order_release);
 				contexts[i]->run();
+				loads[i].store(nullptr, std::memory_order_release);
 			});
-			// set_affinity(threads[i], i);
 		}
 
 		for (std::size_t i = 0; i < threads.size(); ++i)
 			threads[i].join();
-
+		if(handoffThread.joinable()){
+			handoff.stop();
+			handoffThread.join();
+		}
+		if(drainThread.joinable()) drainThread.join();
 	}
 };
@@ -0,0 +1,220 @@
+module;
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86_ 1
+#include <immintrin.h>
+#endif
+
+export module simd;
+
+import std;
+
+// Byte scanning helpers with SSE2/AVX2 paths, picked once at runtime from what the CPU supports.
+// Other architectures get the scalar versions.
+
+static std::size_t findHeaderEndScalar_(const char* p, std::size_t len, std::size_t from) noexcept {
+	for(std::size_t i = from; i + 4 <= len; ++i){
+		if(p[i] == '\r' && p[i + 1] == '\n' && p[i + 2] == '\r' && p[i + 3] == '\n') return i + 4;
+	}
+	return std::string_view::npos;
+}
+
+#ifdef SIMD_X86_
+// compares four shifted loads so every set bit is a full "\r\n\r\n", no candidates to verify
+__attribute__((target("sse2")))
+static std::size_t findHeaderEndSse2_(const char* p, std::size_t len, std::size_t from) noexcept {
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+	std::size_t i = from;
+	for(; i + 16 + 3 <= len; i += 16){
+		__m128i a = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)), cr);
+		__m128i b = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 1)), lf);
+		__m128i c = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 2)), cr);
+		__m128i d = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 3)), lf);
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), _mm_and_si128(c, d)));
+		if(mask) return i + std::countr_zero(mask) + 4;
+	}
+	return findHeaderEndScalar_(p, len, i);
+}
+
+__attribute__((target("avx2")))
+static std::size_t findHeaderEndAvx2_(const char* p, std::size_t len, std::size_t from) noexcept {
+	const __m256i cr = _mm256_set1_epi8('\r');
+	const __m256i lf = _mm256_set1_epi8('\n');
+	std::size_t i = from;
+	for(; i + 32 + 3 <= len; i += 32){
+		__m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i)), cr);
+		__m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i + 1)), lf);
+		__m256i c = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i + 2)), cr);
+		__m256i d = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i + 3)), lf);
+		unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, d))));
+		if(mask) return i + std::countr_zero(mask) + 4;
+	}
+	return findHeaderEndSse2_(p, len, i);
+}
+
+// folds 'A'-'Z' of 16 bytes to lowercase, the other bytes are left as they are
+__attribute__((target("sse2")))
+static __m128i toLower16_(__m128i x) noexcept {
+	__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('Z' + 1)));
+	return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+// XORs p with the 4-byte pattern key, which is in memory order and already rotated to p[0]
+static void xorKeyScalar_(std::byte* p, std::size_t len, std::uint32_t key) noexcept {
+	std::size_t i = 0;
+	std::uint64_t wide = (std::uint64_t{key} << 32) | key;
+	for(; i + 8 <= len; i += 8){
+		std::uint64_t v;
+		std::memcpy(&v, p + i, 8);
+		v ^= wide;
+		std::memcpy(p + i, &v, 8);
+	}
+	for(; i < len; ++i){
+		std::uint8_t k;
+		std::memcpy(&k, reinterpret_cast<const std::byte*>(&key) + i % 4, 1);
+		p[i] ^= std::byte{k};
+	}
+}
+
+#ifdef SIMD_X86_
+__attribute__((target("sse2")))
+static void xorKeySse2_(std::byte* p, std::size_t len, std::uint32_t key) noexcept {
+	const __m128i k = _mm_set1_epi32(static_cast<int>(key));
+	std::size_t i = 0;
+	for(; i + 16 <= len; i += 16){
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(p + i), _mm_xor_si128(v, k));
+	}
+	xorKeyScalar_(p + i, len - i, key);
+}
+
+__attribute__((target("avx2")))
+static void xorKeyAvx2_(std::byte* p, std::size_t len, std::uint32_t key) noexcept {
+	const __m256i k = _mm256_set1_epi32(static_cast<int>(key));
+	std::size_t i = 0;
+	for(; i + 32 <= len; i += 32){
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(p + i), _mm256_xor_si256(v, k));
+	}
+	xorKeySse2_(p + i, len - i, key);
+}
+
+#endif
+
+// index of the first byte at or after from with the high bit set, len if there is none
+static std::size_t findNonAsciiScalar_(const char* p, std::size_t len, std::size_t from) noexcept {
+	for(std::size_t i = from; i < len; ++i){
+		if(static_cast<unsigned char>(p[i]) >= 0x80) return i;
+	}
+	return len;
+}
+
+#ifdef SIMD_X86_
+__attribute__((target("sse2")))
+static std::size_t findNonAsciiSse2_(const char* p, std::size_t len, std::size_t from) noexcept {
+	std::size_t i = from;
+	for(; i + 16 <= len; i += 16){
+		unsigned mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)));
+		if(mask) return i + std::countr_zero(mask);
+	}
+	return findNonAsciiScalar_(p, len, i);
+}
+
+__attribute__((target("avx2")))
+static std::size_t findNonAsciiAvx2_(const char* p, std::size_t len, std::size_t from) noexcept {
+	std::size_t i = from;
+	for(; i + 32 <= len; i += 32){
+		unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i))));
+		if(mask) return i + std::countr_zero(mask);
+	}
+	return findNonAsciiSse2_(p, len, i);
+}
+#endif
+
+using FindHeaderEndFn = std::size_t(*)(const char*, std::size_t, std::size_t) noexcept;
+using XorKeyFn = void(*)(std::byte*, std::size_t, std::uint32_t) noexcept;
+using FindNonAsciiFn = std::size_t(*)(const char*, std::size_t, std::size_t) noexcept;
+
+static FindHeaderEndFn selectFindHeaderEnd_() noexcept {
+#ifdef SIMD_X86_
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) return findHeaderEndAvx2_;
+	if(__builtin_cpu_supports("sse2")) return findHeaderEndSse2_;
+#endif
+	return findHeaderEndScalar_;
+}
+
+static XorKeyFn selectXorKey_() noexcept {
+#ifdef SIMD_X86_
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) return xorKeyAvx2_;
+	if(__builtin_cpu_supports("sse2")) return xorKeySse2_;
+#endif
+	return xorKeyScalar_;
+}
+
+static FindNonAsciiFn selectFindNonAscii_() noexcept {
+#ifdef SIMD_X86_
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) return findNonAsciiAvx2_;
+	if(__builtin_cpu_supports("sse2")) return findNonAsciiSse2_;
+#endif
+	return findNonAsciiScalar_;
+}
+
+export
+namespace Simd {
+	// Position just past the first "\r\n\r\n" in data at or after from, npos if there is none.
+	// A caller that gets npos can resume at data.size() - 3 once more bytes are appended.
+	std::size_t findHeaderEnd(std::span<const std::byte> data, std::size_t from = 0) noexcept {
+		static const FindHeaderEndFn fn = selectFindHeaderEnd_();
+		return fn(reinterpret_cast<const char*>(data.data()), data.size(), from);
+	}
+
+	// XORs data with the 4-byte WebSocket masking key, as if data started offset bytes into the
+	// payload, so a payload can be unmasked piece by piece as it arrives.
+	void unmask(std::span<std::byte> data, std::array<std::byte, 4> key, std::size_t offset = 0) noexcept {
+		static const XorKeyFn fn = selectXorKey_();
+		std::array<std::byte, 4> rotated;
+		for(std::size_t i = 0; i < 4; ++i) rotated[i] = key[(offset + i) % 4];
+		std::uint32_t pattern;
+		std::memcpy(&pattern, rotated.data(), 4);
+		fn(data.data(), data.size(), pattern);
+	}
+
+	// Position of the first byte at or after from that is not ASCII, data.size() if there is none.
+	std::size_t findNonAscii(std::span<const std::byte> data, std::size_t from = 0) noexcept {
+		static const FindNonAsciiFn fn = selectFindNonAscii_();
+		return fn(reinterpret_cast<const char*>(data.data()), data.size(), from);
+	}
+
+	// ASCII case-insensitive equality. Strings of 16 bytes or more are folded 16 at a time, the
+	// tail by one overlapping load.
+	bool equalsIgnoreCase(std::string_view a, std::string_view b) noexcept {
+		if(a.size() != b.size()) return false;
+		std::size_t len = a.size();
+#ifdef SIMD_X86_
+		if(len < 16){
+#endif
+			for(std::size_t i = 0; i < len; ++i){
+				char x = a[i], y = b[i];
+				if(x >= 'A' && x <= 'Z') x = static_cast<char>(x | 0x20);
+				if(y >= 'A' && y <= 'Z') y = static_cast<char>(y | 0x20);
+				if(x != y) return false;
+			}
+			return true;
+#ifdef SIMD_X86_
+		}
+		auto eq16 = [&](std::size_t i){
+			__m128i x = toLower16_(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a.data() + i)));
+			__m128i y = toLower16_(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b.data() + i)));
+			return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) == 0xFFFF;
+		};
+		for(std::size_t i = 0; i + 16 <= len; i += 16){
+			if(!eq16(i)) return false;
+		}
+		return len % 16 == 0 || eq16(len - 16);
+#endif
+	}
+};
@@ -0,0 +1,141 @@
+module;
+#include <sys/resource.h>
+#include <unistd.h>
+
+export module taskPool;
+
+import std;
+
+// Threads for CPU-bound work, kept off the io_contexts. Every worker has a deque of its own: it
+// takes its newest task first, while its data is still in cache, and an idle worker steals the
+// oldest task of another, so a burst submitted to one worker spreads over all of them. Tasks are
+// coarse, e.g. rendering a tile, so a mutex per deque costs nothing next to them.
+export
+class TaskPool final {
+public:
+	using Task = std::move_only_function<void() &&>;
+
+	struct Stats{
+		std::uint64_t executed = 0;
+		std::uint64_t stolen = 0;
+	};
+
+	// Workers run at nice, above 0 the scheduler favours the I/O threads over them when the
+	// cores are busy, so the event loops stay responsive while the pool saturates the rest.
+	explicit TaskPool(std::size_t threads, int nice = 0){
+		threads = std::max<std::size_t>(threads, 1);
+		for(std::size_t i = 0; i < threads; ++i) workers_.push_back(std::make_unique<Worker_>());
+		for(std::size_t i = 0; i < threads; ++i){
+			threads_.emplace_back([this, i, nice]{
+				if(nice != 0) ::setpriority(PRIO_PROCESS, static_cast<id_t>(::gettid()), nice);
+				run_(i);
+			});
+		}
+	}
+	TaskPool(const TaskPool&) = delete;
+	TaskPool& operator=(const TaskPool&) = delete;
+	~TaskPool() { join(); }
+
+	// Runs what is queued, then ends the workers. Tasks submitted after it never run.
+	void join(){
+		{
+			std::lock_guard lock{parkMutex_};
+			stopping_ = true;
+		}
+		park_.notify_all();
+		threads_.clear();
+	}
+
+	// From a worker of this pool the task goes on its own deque, from anywhere else on the next
+	// worker's in turn.
+	void submit(Task task){
+		std::size_t i = current_ == this ? index_ : next_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+		{
+			std::lock_guard lock{workers_[i]->mutex};
+			workers_[i]->tasks.push_back(std::move(task));
+		}
+		queued_.fetch_add(1);
+		if(sleeping_.load() > 0){
+			std::lock_guard lock{parkMutex_};
+			park_.notify_one();
+		}
+	}
+
+	std::size_t size() const noexcept { return workers_.size(); }
+	// whether the calling thread is one of the workers
+	bool runningInThisThread() const noexcept { return current_ == this; }
+	Stats stats() const noexcept {
+		return {executed_.load(std::memory_order_relaxed), stolen_.load(std::memory_order_relaxed)};
+	}
+
+private:
+	// a cache line each, workers locking their own deques do not contend
+	struct alignas(64) Worker_{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	std::vector<std::unique_ptr<Worker_>> workers_;
+	std::vector<std::jthread> threads_;
+	std::atomic<std::size_t> next_{0};
+	// tasks on all deques, workers sleep only while it is 0
+	std::atomic<std::size_t> queued_{0};
+	std::atomic<std::size_t> sleeping_{0};
+	std::mutex parkMutex_;
+	std::condition_variable park_;
+	bool stopping_ = false;
+	std::atomic<std::uint64_t> executed_{0};
+	std::atomic<std::uint64_t> stolen_{0};
+
+	static inline thread_local TaskPool* current_ = nullptr;
+	static inline thread_local std::size_t index_ = 0;
+
+	bool take_(std::size_t i, Task& out){
+		{
+			auto& own = *workers_[i];
+			std::lock_guard lock{own.mutex};
+			if(!own.tasks.empty()){
+				out = std::move(own.tasks.back());
+				own.tasks.pop_back();
+				return true;
+			}
+		}
+		for(std::size_t n = 1; n < workers_.size(); ++n){
+			auto& victim = *workers_[(i + n) % workers_.size()];
+			std::lock_guard lock{victim.mutex};
+			if(!victim.tasks.empty()){
+				out = std::move(victim.tasks.front());
+				victim.tasks.pop_front();
+				stolen_.fetch_add(1, std::memory_order_relaxed);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void run_(std::size_t i){
+		current_ = this;
+		index_ = i;
+		Task task;
+		for(;;){
+			if(take_(i, task)){
+				queued_.fetch_sub(1);
+				try{
+					std::move(task)();
+				} catch(const std::exception& e) {
+					std::println("task error: {}", e.what());
+				} catch(...) {
+					std::println("task error");
+				}
+				task = nullptr;
+				executed_.fetch_add(1, std::memory_order_relaxed);
+				continue;
+			}
+			std::unique_lock lock{parkMutex_};
+			if(stopping_ && queued_.load() == 0) return;
+			sleeping_.fetch_add(1);
+			park_.wait(lock, [this]{ return queued_.load() > 0 || stopping_; });
+			sleeping_.fetch_sub(1);
+		}
+	}
+};
@@ -0,0 +1,162 @@
+export module timerWheel;
+
+import std;
+
+// Deadlines of many connections on one thread. A hierarchical timing wheel: level 0 has a slot
+// per tick, every level above a slot per full turn of the one below, so arming and cancelling a
+// timer is O(1) whatever the number of timers, and a timer moves down at most once per level on
+// its way to expiring. Timers are intrusive, arming one allocates nothing.
+export
+class TimerWheel final {
+	// a link of the circular list of a slot, whose head is a bare Node_
+	struct Node_{
+		Node_* prev_ = this;
+		Node_* next_ = this;
+
+		Node_() = default;
+		Node_(const Node_&) = delete;
+		Node_& operator=(const Node_&) = delete;
+
+		bool empty() const noexcept { return next_ == this; }
+		void unlink_() noexcept {
+			prev_->next_ = next_;
+			next_->prev_ = prev_;
+			prev_ = next_ = this;
+		}
+		void pushBack_(Node_& node) noexcept {
+			node.prev_ = prev_;
+			node.next_ = this;
+			prev_->next_ = &node;
+			prev_ = &node;
+		}
+	};
+
+public:
+	using Clock = std::chrono::steady_clock;
+	using Callback = void(*)(void* ctx);
+
+	// A deadline, armed on the wheel of the thread it runs on. It is disarmed when it fires, when
+	// it is cancelled and when it is destroyed.
+	class Timer final : Node_ {
+		friend class TimerWheel;
+		TimerWheel* wheel_ = nullptr;
+		std::uint64_t expiry_ = 0;
+		Callback fn_;
+		void* ctx_;
+	public:
+		Timer(Callback fn, void* ctx) noexcept: fn_(fn), ctx_(ctx) {}
+		~Timer() { cancel(); }
+
+		bool armed() const noexcept { return wheel_ != nullptr; }
+		void cancel() noexcept {
+			if(!wheel_) return;
+			unlink_();
+			--wheel_->size_;
+			wheel_ = nullptr;
+		}
+	};
+
+	static constexpr std::size_t levels = 4;
+	static constexpr std::size_t slotBits = 6;
+	static constexpr std::size_t slots = std::size_t{1} << slotBits;
+	// the furthest a timer is armed in ticks, later deadlines are cut to it
+	static constexpr std::uint64_t maxTicks = (std::uint64_t{1} << (levels * slotBits)) - 1;
+
+	static TimerWheel& local() {
+		thread_local TimerWheel wheel;
+		return wheel;
+	}
+
+	explicit TimerWheel(Clock::duration tick = std::chrono::milliseconds(100), Clock::time_point start = Clock::now()) noexcept:
+		tick_(tick), start_(start) {}
+	TimerWheel(const TimerWheel&) = delete;
+	TimerWheel& operator=(const TimerWheel&) = delete;
+	// timers may outlive the wheel, e.g. those of connections destroyed after their thread ended
+	~TimerWheel(){
+		for(auto& level : slots_)
+			for(auto& head : level)
+				while(!head.empty()) static_cast<Timer*>(head.next_)->cancel();
+	}
+
+	Clock::duration tick() const noexcept { return tick_; }
+	// the time the wheel has advanced to, at most a tick behind, without reading the clock
+	Clock::time_point time() const noexcept { return start_ + tick_ * static_cast<Clock::rep>(current_); }
+	std::size_t size() const noexcept { return size_; }
+
+	// fires timer once after has passed, rounded up to whole ticks
+	void arm(Timer& timer, Clock::duration after) noexcept {
+		timer.cancel();
+		Clock::rep ticks = after / tick_ + (after % tick_ > Clock::duration::zero());
+		timer.expiry_ = current_ + static_cast<std::uint64_t>(std::clamp<Clock::rep>(ticks, 1, maxTicks));
+		timer.wheel_ = this;
+		++size_;
+		insert_(timer);
+	}
+	void armAt(Timer& timer, Clock::time_point at) noexcept {
+		arm(timer, at - time());
+	}
+
+	// Fires every timer due by now. Callbacks may arm and cancel timers, their own included.
+	void advance(Clock::time_point now){
+		std::uint64_t target = static_cast<std::uint64_t>(std::max<Clock::rep>((now - start_) / tick_, 0));
+		while(current_ < target){
+			// nothing to fire on the way
+			if(size_ == 0){
+				current_ = target;
+				return;
+			}
+			++current_;
+			// a level that finished a turn spreads the next slot of the level above over the ones below
+			for(std::size_t level = 1; level < levels; ++level){
+				if(((current_ >> ((level - 1) * slotBits)) & (slots - 1)) != 0) break;
+				cascade_(slots_[level][(current_ >> (level * slotBits)) & (slots - 1)]);
+			}
+			fire_(slots_[0][current_ & (slots - 1)]);
+		}
+	}
+
+private:
+	Clock::duration tick_;
+	Clock::time_point start_;
+	std::uint64_t current_ = 0;
+	std::size_t size_ = 0;
+	std::array<std::array<Node_, slots>, levels> slots_;
+
+	void insert_(Timer& timer) noexcept {
+		std::uint64_t delta = timer.expiry_ > current_ ? timer.expiry_ - current_ : 0;
+		std::size_t level = 0;
+		while(level + 1 < levels && delta >= (std::uint64_t{1} << ((level + 1) * slotBits))) ++level;
+		slots_[level][(timer.expiry_ >> (level * slotBits)) & (slots - 1)].pushBack_(timer);
+	}
+
+	void cascade_(Node_& head) noexcept {
+		Node_ moving;
+		splice_(head, moving);
+		while(!moving.empty()){
+			auto& timer = *static_cast<Timer*>(moving.next_);
+			timer.unlink_();
+			insert_(timer);
+		}
+	}
+
+	void fire_(Node_& head){
+		// taken off the slot first, a callback arming a timer a full turn ahead puts it back there
+		Node_ due;
+		splice_(head, due);
+		while(!due.empty()){
+			auto& timer = *static_cast<Timer*>(due.next_);
+			timer.cancel();
+			timer.fn_(timer.ctx_);
+		}
+	}
+
+	// moves the list of from to the empty to
+	static void splice_(Node_& from, Node_& to) noexcept {
+		if(from.empty()) return;
+		to.next_ = from.next_;
+		to.prev_ = from.prev_;
+		to.next_->prev_ = &to;
+		to.prev_->next_ = &to;
+		from.prev_ = from.next_ = &from;
+	}
+};
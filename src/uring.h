@@ -0,0 +1,500 @@
+#pragma once
+
+#include <liburing.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "asio/io_context.hpp"
+#include "asio/async_result.hpp"
+#include "asio/any_completion_handler.hpp"
+#include "asio/associated_cancellation_slot.hpp"
+#include "asio/append.hpp"
+#include "asio/buffer.hpp"
+#include "asio/error.hpp"
+#include "asio/post.hpp"
+#include "asio/posix/stream_descriptor.hpp"
+
+import std;
+
+// State of one socket driven by a UringService. Lives on the heap and is freed by the
+// service once the owning UringSocket is gone and no more completions can reference it.
+struct UringSocketState;
+
+struct UringOp {
+	enum class Kind : std::uint8_t { RECV, SEND };
+	Kind kind;
+	UringSocketState* owner;
+};
+
+struct UringSocketState {
+	int fd = -1;
+	UringOp recvOp{UringOp::Kind::RECV, this};
+	UringOp sendOp{UringOp::Kind::SEND, this};
+	std::size_t inFlight = 0;
+	bool recvArmed = false;
+	bool starved = false; // the buffer ring ran dry, the recv is re-armed once a buffer comes back
+	bool closed = false;
+	bool destroyed = false; // freed once the completions being reaped are all handled
+	bool eof = false;
+	int error = 0;
+
+	// provided buffers filled by the multishot recv that have not been read yet: {bufferId, length}
+	std::deque<std::pair<std::uint16_t, std::uint32_t>> received;
+	std::size_t receivedOffset = 0;
+
+	asio::mutable_buffer readTarget;
+	asio::any_completion_handler<void(std::error_code, std::size_t)> readHandler;
+	asio::any_completion_handler<void(std::error_code, std::size_t)> writeHandler;
+	asio::any_completion_handler<void(std::error_code)> waitHandler;
+
+	static constexpr std::size_t maxIov = 64;
+	std::array<iovec, maxIov> iov{};
+	msghdr msg{};
+
+	UringSocketState* prev = nullptr;
+	UringSocketState* next = nullptr;
+};
+
+// One io_uring per io_context. Receives use a multishot recv per socket that fills buffers
+// from a provided-buffer ring, so a keep-alive socket costs no syscall per read. The kernel
+// only ever writes into that ring: a socket that finds it empty waits for a buffer to be
+// recycled rather than receiving into the caller's buffer, which a cancelled read would leave
+// the kernel writing into.
+// SQEs prepared while a handler runs are submitted together by a single io_uring_enter,
+// and completions are picked up through an eventfd watched by the io_context itself.
+// Operations honour the cancellation slot of their handler: a cancelled read or wait completes
+// with operation_aborted and leaves the recv armed, what arrives is kept for the next read. A
+// slot handler left behind by a completed operation finds nothing to cancel.
+class UringService : public asio::execution_context::service {
+public:
+	static inline asio::execution_context::id id;
+
+	static constexpr unsigned numEntries = 4096;
+	static constexpr unsigned numBuffers = 1024; // must be a power of 2
+	static constexpr std::size_t bufferSize = 4096;
+	static constexpr std::size_t maxPendingBuffers = 16; // per socket, before the recv is paused
+	static constexpr int bufferGroup = 0;
+
+	static bool supported() noexcept {
+		io_uring ring;
+		if(io_uring_queue_init(2, &ring, 0) < 0) return false;
+		io_uring_queue_exit(&ring);
+		return true;
+	}
+
+	explicit UringService(asio::io_context& ctx):
+		asio::execution_context::service(ctx),
+		ctx_(ctx),
+		eventFd_(ctx)
+	{
+		io_uring_params params{};
+		params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+		if(io_uring_queue_init_params(numEntries, &ring_, &params) < 0){
+			params = {};
+			int ret = io_uring_queue_init_params(numEntries, &ring_, &params);
+			if(ret < 0) throw std::system_error(-ret, std::system_category(), "io_uring_queue_init");
+		}
+
+		int ret = 0;
+		bufRing_ = io_uring_setup_buf_ring(&ring_, numBuffers, bufferGroup, 0, &ret);
+		if(!bufRing_) throw std::system_error(-ret, std::system_category(), "io_uring_setup_buf_ring");
+		bufSlab_ = std::make_unique<std::byte[]>(numBuffers * bufferSize);
+		for(unsigned i = 0; i < numBuffers; ++i)
+			io_uring_buf_ring_add(bufRing_, bufSlab_.get() + i * bufferSize, bufferSize, i, io_uring_buf_ring_mask(numBuffers), i);
+		io_uring_buf_ring_advance(bufRing_, numBuffers);
+
+		int efd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(efd < 0) throw std::system_error(errno, std::system_category(), "eventfd");
+		eventFd_.assign(efd);
+		io_uring_register_eventfd(&ring_, efd);
+		wait_();
+	}
+
+	~UringService() override {
+		io_uring_free_buf_ring(&ring_, bufRing_, numBuffers, bufferGroup);
+		io_uring_queue_exit(&ring_);
+	}
+
+	asio::io_context& context() noexcept { return ctx_; }
+
+	UringSocketState* open(int fd){
+		auto* s = new UringSocketState{};
+		s->fd = fd;
+		s->next = sockets_;
+		if(sockets_) sockets_->prev = s;
+		sockets_ = s;
+		return s;
+	}
+
+	void close(UringSocketState* s){
+		if(shuttingDown_) return; // the state is freed by shutdown()
+		s->closed = true;
+		if(s->starved){
+			std::erase(starved_, s);
+			s->starved = false;
+		}
+		if(s->readHandler) complete_(s->readHandler, true, asio::error::operation_aborted, 0);
+		if(s->waitHandler) complete_(s->waitHandler, true, asio::error::operation_aborted);
+		if(s->recvArmed){
+			auto* sqe = sqe_();
+			io_uring_prep_cancel(sqe, &s->recvOp, 0);
+			io_uring_sqe_set_data(sqe, nullptr);
+			scheduleSubmit_();
+		}
+		if(s->inFlight) ::shutdown(s->fd, SHUT_RDWR);
+		tryDestroy_(s);
+	}
+
+	void startRead(UringSocketState* s, asio::mutable_buffer target, asio::any_completion_handler<void(std::error_code, std::size_t)> handler){
+		if(!s->received.empty() || s->eof || s->error){
+			// data already arrived with an earlier multishot completion
+			std::size_t n = copyReceived_(s, target);
+			if(n > 0) complete_(handler, true, std::error_code{}, n);
+			else if(s->error) complete_(handler, true, std::error_code(s->error, std::system_category()), 0);
+			else complete_(handler, true, asio::error::eof, 0);
+			return;
+		}
+		auto slot = asio::get_associated_cancellation_slot(handler);
+		s->readTarget = target;
+		s->readHandler = std::move(handler);
+		if(slot.is_connected()) slot.assign([this, s](asio::cancellation_type){
+			if(s->readHandler) complete_(s->readHandler, true, asio::error::operation_aborted, 0);
+		});
+		if(!s->recvArmed && !s->starved) armRecv_(s);
+	}
+
+	// completes once a read would not block, without holding a buffer of the caller meanwhile
+	void startWait(UringSocketState* s, asio::any_completion_handler<void(std::error_code)> handler){
+		if(!s->received.empty() || s->eof || s->error){
+			complete_(handler, true, std::error_code{});
+			return;
+		}
+		auto slot = asio::get_associated_cancellation_slot(handler);
+		s->waitHandler = std::move(handler);
+		if(slot.is_connected()) slot.assign([this, s](asio::cancellation_type){
+			if(s->waitHandler) complete_(s->waitHandler, true, asio::error::operation_aborted);
+		});
+		if(!s->recvArmed && !s->starved) armRecv_(s);
+	}
+
+	template <typename ConstBufferSequence>
+	void startWrite(UringSocketState* s, const ConstBufferSequence& buffers, asio::any_completion_handler<void(std::error_code, std::size_t)> handler){
+		std::size_t count = 0;
+		for(auto it = asio::buffer_sequence_begin(buffers); it != asio::buffer_sequence_end(buffers) && count < s->iov.size(); ++it){
+			asio::const_buffer b{*it};
+			if(b.size() == 0) continue;
+			s->iov[count++] = {const_cast<void*>(b.data()), b.size()};
+		}
+		if(count == 0){
+			complete_(handler, true, std::error_code{}, 0);
+			return;
+		}
+
+		auto slot = asio::get_associated_cancellation_slot(handler);
+		s->writeHandler = std::move(handler);
+		// the send then completes with ECANCELED, or with what it sent if it got that far
+		if(slot.is_connected()) slot.assign([this, s](asio::cancellation_type){
+			if(!s->writeHandler || s->closed) return;
+			auto* sqe = sqe_();
+			io_uring_prep_cancel(sqe, &s->sendOp, 0);
+			io_uring_sqe_set_data(sqe, nullptr);
+			scheduleSubmit_();
+		});
+		auto* sqe = sqe_();
+		if(count == 1){
+			io_uring_prep_send(sqe, s->fd, s->iov[0].iov_base, s->iov[0].iov_len, MSG_NOSIGNAL);
+		} else {
+			s->msg = {};
+			s->msg.msg_iov = s->iov.data();
+			s->msg.msg_iovlen = count;
+			io_uring_prep_sendmsg(sqe, s->fd, &s->msg, MSG_NOSIGNAL);
+		}
+		io_uring_sqe_set_data(sqe, &s->sendOp);
+		++s->inFlight;
+		scheduleSubmit_();
+	}
+
+private:
+	asio::io_context& ctx_;
+	io_uring ring_;
+	io_uring_buf_ring* bufRing_ = nullptr;
+	std::unique_ptr<std::byte[]> bufSlab_;
+	asio::posix::stream_descriptor eventFd_;
+	bool submitScheduled_ = false;
+	bool multishot_ = true;
+	bool shuttingDown_ = false;
+	UringSocketState* sockets_ = nullptr;
+	// sockets whose recv ended with ENOBUFS, in the order they ran dry
+	std::deque<UringSocketState*> starved_;
+	std::vector<std::tuple<UringOp*, int, unsigned>> completions_;
+	// Completions found while reaping resume their coroutines inline, which may close and
+	// destroy the socket while its state is still used further down, or by a later completion
+	// of the same batch. States that die meanwhile are freed after the batch.
+	bool reaping_ = false;
+	std::vector<UringSocketState*> dead_;
+
+	void shutdown() override {
+		shuttingDown_ = true;
+		eventFd_.close();
+		// drop the handlers so suspended coroutines are destroyed, the states themselves die with the ring
+		for(auto* s = sockets_; s;){
+			auto* next = s->next;
+			s->readHandler = {};
+			s->writeHandler = {};
+			s->waitHandler = {};
+			if(s->fd >= 0) ::close(s->fd);
+			delete s;
+			s = next;
+		}
+		sockets_ = nullptr;
+		starved_.clear();
+	}
+
+	io_uring_sqe* sqe_(){
+		auto* sqe = io_uring_get_sqe(&ring_);
+		while(!sqe){ // submission queue full, flush it now instead of waiting for the batch
+			io_uring_submit(&ring_);
+			sqe = io_uring_get_sqe(&ring_);
+		}
+		return sqe;
+	}
+
+	void scheduleSubmit_(){
+		if(submitScheduled_) return;
+		submitScheduled_ = true;
+		asio::post(ctx_, [this]{ flush_(); });
+	}
+
+	void flush_(){
+		submitScheduled_ = false;
+		if(io_uring_sq_ready(&ring_) > 0) io_uring_submit(&ring_);
+	}
+
+	void wait_(){
+		eventFd_.async_wait(asio::posix::stream_descriptor::wait_read, [this](std::error_code ec){
+			if(ec) return;
+			std::uint64_t value;
+			while(::read(eventFd_.native_handle(), &value, sizeof(value)) > 0);
+			reap_();
+			wait_();
+		});
+	}
+
+	void reap_(){
+		completions_.clear();
+		io_uring_cqe* cqe;
+		unsigned head;
+		unsigned count = 0;
+		io_uring_for_each_cqe(&ring_, head, cqe){
+			completions_.emplace_back(static_cast<UringOp*>(io_uring_cqe_get_data(cqe)), cqe->res, cqe->flags);
+			++count;
+		}
+		io_uring_cq_advance(&ring_, count);
+
+		reaping_ = true;
+		for(auto [op, res, flags] : completions_){
+			if(!op) continue; // cancel requests
+			if(op->kind == UringOp::Kind::RECV) onRecv_(op->owner, res, flags);
+			else onSend_(op->owner, res);
+		}
+		reaping_ = false;
+		for(auto* s : dead_) delete s;
+		dead_.clear();
+		flush_();
+	}
+
+	void armRecv_(UringSocketState* s){
+		auto* sqe = sqe_();
+		if(multishot_) io_uring_prep_recv_multishot(sqe, s->fd, nullptr, 0, 0);
+		else io_uring_prep_recv(sqe, s->fd, nullptr, 0, 0);
+		sqe->flags |= IOSQE_BUFFER_SELECT;
+		sqe->buf_group = bufferGroup;
+		io_uring_sqe_set_data(sqe, &s->recvOp);
+		s->recvArmed = true;
+		++s->inFlight;
+		scheduleSubmit_();
+	}
+
+	void onRecv_(UringSocketState* s, int res, unsigned flags){
+		bool more = flags & IORING_CQE_F_MORE;
+		if(!more){
+			s->recvArmed = false;
+			--s->inFlight;
+		}
+
+		if(res > 0 && (flags & IORING_CQE_F_BUFFER)) s->received.emplace_back(flags >> IORING_CQE_BUFFER_SHIFT, res);
+		else if(res == 0) s->eof = true;
+		else if(res == -ENOBUFS && !s->closed && !s->starved){
+			s->starved = true;
+			starved_.push_back(s);
+		}
+		else if(res == -EINVAL && multishot_) multishot_ = false; // kernel without multishot recv
+		else if(res != -ECANCELED) s->error = -res;
+
+		if(s->closed){
+			recycleAll_(s);
+			tryDestroy_(s);
+			return;
+		}
+
+		if(s->readHandler){
+			if(std::size_t n = copyReceived_(s, s->readTarget); n > 0) complete_(s->readHandler, false, std::error_code{}, n);
+			else if(s->error) complete_(s->readHandler, false, std::error_code(s->error, std::system_category()), 0);
+			else if(s->eof) complete_(s->readHandler, false, asio::error::eof, 0);
+			else if(!s->recvArmed && !s->starved) armRecv_(s);
+		}
+		else if(s->waitHandler){
+			if(!s->received.empty() || s->eof || s->error) complete_(s->waitHandler, false, std::error_code{});
+			else if(!s->recvArmed && !s->starved) armRecv_(s);
+		}
+		// the handler just resumed may have closed the socket
+		if(s->closed) return;
+
+		// a peer that sends faster than we read must not drain the shared ring
+		if(s->recvArmed && s->received.size() >= maxPendingBuffers){
+			auto* sqe = sqe_();
+			io_uring_prep_cancel(sqe, &s->recvOp, 0);
+			io_uring_sqe_set_data(sqe, nullptr);
+			scheduleSubmit_();
+		}
+	}
+
+	void onSend_(UringSocketState* s, int res){
+		--s->inFlight;
+		if(s->closed){
+			s->writeHandler = {};
+			tryDestroy_(s);
+			return;
+		}
+		if(res < 0) complete_(s->writeHandler, false, std::error_code(-res, std::system_category()), 0);
+		else complete_(s->writeHandler, false, std::error_code{}, static_cast<std::size_t>(res));
+	}
+
+	std::size_t copyReceived_(UringSocketState* s, asio::mutable_buffer target){
+		std::size_t copied = 0;
+		auto* out = static_cast<std::byte*>(target.data());
+		while(!s->received.empty() && copied < target.size()){
+			auto [bid, len] = s->received.front();
+			std::size_t numCopy = std::min<std::size_t>(len - s->receivedOffset, target.size() - copied);
+			std::memcpy(out + copied, bufSlab_.get() + bid * bufferSize + s->receivedOffset, numCopy);
+			copied += numCopy;
+			s->receivedOffset += numCopy;
+			if(s->receivedOffset == len){
+				recycle_(bid);
+				s->received.pop_front();
+				s->receivedOffset = 0;
+			}
+		}
+		return copied;
+	}
+
+	void recycle_(std::uint16_t bid){
+		io_uring_buf_ring_add(bufRing_, bufSlab_.get() + bid * bufferSize, bufferSize, bid, io_uring_buf_ring_mask(numBuffers), 0);
+		io_uring_buf_ring_advance(bufRing_, 1);
+		resumeStarved_();
+	}
+
+	// a buffer is back in the ring, the socket that waited longest for one receives again; one
+	// that nobody reads from is armed by its next read or wait
+	void resumeStarved_(){
+		if(starved_.empty()) return;
+		auto* s = starved_.front();
+		starved_.pop_front();
+		s->starved = false;
+		if((s->readHandler || s->waitHandler) && !s->recvArmed) armRecv_(s);
+	}
+
+	void recycleAll_(UringSocketState* s){
+		for(auto [bid, len] : s->received) recycle_(bid);
+		s->received.clear();
+		s->receivedOffset = 0;
+	}
+
+	void tryDestroy_(UringSocketState* s){
+		if(!s->closed || s->destroyed || s->inFlight > 0) return;
+		s->destroyed = true;
+		recycleAll_(s);
+		::close(s->fd);
+		if(s->prev) s->prev->next = s->next;
+		else sockets_ = s->next;
+		if(s->next) s->next->prev = s->prev;
+		if(reaping_) dead_.push_back(s);
+		else delete s;
+	}
+
+	// Completions found while reaping run inline, those known at initiation are posted so a handler
+	// never runs inside the call that started its operation.
+	template <typename Handler, typename... Args>
+	void complete_(Handler& handler, bool post, Args... args){
+		auto h = std::move(handler);
+		handler = {};
+		if(post) asio::post(ctx_, asio::append(std::move(h), args...));
+		else std::move(h)(args...);
+	}
+};
+
+// Socket whose reads and writes go through the UringService of its io_context. Provides the
+// async_read_some/async_write_some pair of an asio stream so composed operations work on it.
+class UringSocket {
+	UringService* service_ = nullptr;
+	UringSocketState* state_ = nullptr;
+public:
+	using executor_type = asio::io_context::executor_type;
+
+	UringSocket(asio::io_context& ctx, int fd):
+		service_(&asio::use_service<UringService>(ctx)),
+		state_(service_->open(fd))
+	{}
+
+	UringSocket(const UringSocket&) = delete;
+	UringSocket& operator=(const UringSocket&) = delete;
+	UringSocket(UringSocket&& other) noexcept:
+		service_(std::exchange(other.service_, nullptr)),
+		state_(std::exchange(other.state_, nullptr))
+	{}
+	UringSocket& operator=(UringSocket&& other) noexcept {
+		if(this != &other){
+			if(state_) service_->close(state_);
+			service_ = std::exchange(other.service_, nullptr);
+			state_ = std::exchange(other.state_, nullptr);
+		}
+		return *this;
+	}
+	~UringSocket(){
+		if(state_) service_->close(state_);
+	}
+
+	executor_type get_executor() noexcept { return service_->context().get_executor(); }
+	int native_handle() const noexcept { return state_->fd; }
+
+	template <typename MutableBufferSequence, typename CompletionToken>
+	auto async_read_some(const MutableBufferSequence& buffers, CompletionToken&& token){
+		return asio::async_initiate<CompletionToken, void(std::error_code, std::size_t)>(
+			[this](auto handler, asio::mutable_buffer target){
+				service_->startRead(state_, target, std::move(handler));
+			},
+			token, asio::mutable_buffer(*asio::buffer_sequence_begin(buffers))
+		);
+	}
+
+	template <typename CompletionToken>
+	auto async_wait(asio::socket_base::wait_type, CompletionToken&& token){
+		return asio::async_initiate<CompletionToken, void(std::error_code)>(
+			[this](auto handler){
+				service_->startWait(state_, std::move(handler));
+			},
+			token
+		);
+	}
+
+	template <typename ConstBufferSequence, typename CompletionToken>
+	auto async_write_some(const ConstBufferSequence& buffers, CompletionToken&& token){
+		return asio::async_initiate<CompletionToken, void(std::error_code, std::size_t)>(
+			[this](auto handler, const ConstBufferSequence& buffers){
+				service_->startWrite(state_, buffers, std::move(handler));
+			},
+			token, buffers
+		);
+	}
+};
@@ -0,0 +1,280 @@
+#pragma once
+
+#include "connection.h"
+#include "asio/steady_timer.hpp"
+
+import webSocket;
+import error;
+import buffer;
+import http;
+import std;
+
+namespace WebSocket {
+
+// A Connection after the 101 of WebSocket::accept, speaking frames instead of HTTP. read() puts
+// fragmented messages together, inflates permessage-deflate and answers Ping and Close frames on
+// its own. It takes one read at a time; writes, the answers read() sends among them, wait for
+// each other, so one coroutine can read while another writes.
+// export
+class Socket{
+	Connection& conn_;
+	Options options_;
+	PerMessageDeflate deflate_;
+
+	std::vector<std::byte> message_; // the message read last, unless it was handed out in place
+	std::vector<std::byte> compressed_; // deflated bytes of the message being read
+	std::vector<std::byte> outgoing_; // deflated bytes of the message being written, by the writer holding the turn
+	std::array<std::byte, 125> controlPayload_;
+	bool closeSent_ = false;
+	bool writing_ = false;
+	// never expires, cancelled to wake the writes waiting for the one in flight
+	asio::steady_timer writeDone_;
+	bool closeReceived_ = false;
+	CloseCode closeCode_ = CloseCode::Abnormal;
+	// a Ping went out because the peer was silent, and nothing came back since
+	bool pingSent_ = false;
+
+	// buffers past this are given back after their message, an idle socket holds next to nothing
+	static constexpr std::size_t retainedCapacity_ = 4096;
+
+	// Waits for the write in flight and takes the next turn. False if a Close went out meanwhile,
+	// after which only that Close may be written.
+	asio::awaitable<bool> lock_(Opcode opcode){
+		while(writing_) co_await writeDone_.async_wait(asio::as_tuple(asio::use_awaitable));
+		if(closeSent_ && opcode != Opcode::Close) co_return false;
+		writing_ = true;
+		co_return true;
+	}
+	void unlock_(){
+		writing_ = false;
+		writeDone_.cancel();
+	}
+
+	// writes frame once no other write is in flight, a Pong that comes too late is dropped
+	asio::awaitable<Error> send_(Frame& frame){
+		if(!co_await lock_(frame.opcode()))
+			co_return frame.opcode() == Opcode::Pong ? Error{} : Error{ErrorCode::CONNECTION_ENDED};
+		auto err = co_await conn_.write(frame);
+		unlock_();
+		co_return err;
+	}
+
+	// closes with code because of something the peer did, read() then fails with INVALID_MESSAGE
+	asio::awaitable<Error> fail_(CloseCode code, Error err = ErrorCode::INVALID_MESSAGE){
+		if(!closeSent_) co_await close(code);
+		closeCode_ = code;
+		co_return err;
+	}
+
+	// reads the rest of a control frame and answers it, CONNECTION_ENDED after a Close
+	asio::awaitable<Error> control_(Frame& frame){
+		std::size_t size = 0;
+		for(bool last = false; !last;){
+			auto [err, piece, isLast] = co_await conn_.readBodySome(frame);
+			if(err) co_return err;
+			std::memcpy(controlPayload_.data() + size, piece.data(), piece.size());
+			size += piece.size();
+			last = isLast;
+		}
+		auto payload = std::span<const std::byte>{controlPayload_.data(), size};
+
+		switch(frame.opcode()){
+		case Opcode::Ping: {
+			if(closeSent_) co_return Error{};
+			Frame pong{Opcode::Pong, payload};
+			co_return co_await send_(pong);
+		}
+		case Opcode::Close: {
+			closeReceived_ = true;
+			auto parsed = parseClose(payload);
+			if(!parsed) co_return co_await fail_(CloseCode::ProtocolError, ErrorCode::CONNECTION_ENDED);
+			closeCode_ = std::get<0>(*parsed);
+			if(!closeSent_){
+				// the answer repeats the code, a Close without one is answered without one
+				Frame reply{Opcode::Close, payload.first(std::min<std::size_t>(payload.size(), 2))};
+				closeSent_ = true;
+				auto err = co_await send_(reply);
+				if(err) co_return err;
+			}
+			co_return Error{ErrorCode::CONNECTION_ENDED};
+		}
+		default: // Pong
+			co_return Error{};
+		}
+	}
+public:
+	// req is the request that was answered with accept(req, ..., options)
+	Socket(Connection& conn, const Http::Request& req, const Options& options = {}):
+		conn_(conn), options_(options), deflate_(negotiate(req, options), options.deflateLevel),
+		writeDone_(conn.executor(), asio::steady_timer::time_point::max())
+	{
+		if(options.pingInterval > std::chrono::steady_clock::duration::zero()){
+			auto timeouts = conn.timeouts();
+			timeouts.idle = options.pingInterval;
+			conn.timeouts(timeouts);
+		}
+	}
+
+	Socket(const Socket&) = delete;
+	Socket& operator=(const Socket&) = delete;
+
+	asio::any_io_executor executor(){ return conn_.executor(); }
+	bool deflate() const noexcept { return deflate_.enabled(); }
+	// whether the deflated form of a Broadcast can be sent to this socket as it is
+	bool takesShared() const noexcept { return deflate_.takesShared(); }
+	// whether a Close went either way, nothing can be written once one was sent
+	bool closed() const noexcept { return closeSent_ || closeReceived_; }
+	// the code the peer closed with, or the one this side failed the connection with
+	CloseCode closeCode() const noexcept { return closeCode_; }
+
+	// The next Text or Binary message. The payload is valid until the next read; a message that
+	// came in one uncompressed frame is a view right into the read buffer, never copied. Fails
+	// with CONNECTION_ENDED once the peer closed, after the Close was answered.
+	asio::awaitable<std::tuple<Error, Opcode, std::span<const std::byte>>> read(){
+		using Result = std::tuple<Error, Opcode, std::span<const std::byte>>;
+		if(closeReceived_) co_return Result{ErrorCode::CONNECTION_ENDED, Opcode::Close, {}};
+		if(message_.capacity() > retainedCapacity_) message_ = {};
+		if(compressed_.capacity() > retainedCapacity_) compressed_ = {};
+		message_.clear();
+		compressed_.clear();
+
+		bool inMessage = false;
+		bool compressed = false;
+		Opcode type = Opcode::Binary;
+		for(;;){
+			Frame frame;
+			frame.maxPayload(options_.maxMessageSize - (compressed ? compressed_.size() : message_.size()));
+			auto err = co_await conn_.readHeader(frame);
+			// a client that only listens stays connected as long as it answers Pings
+			if(err == ErrorCode::TIMED_OUT && conn_.awaitingMessage() && !closeSent_
+				&& options_.pingInterval > std::chrono::steady_clock::duration::zero()){
+				if(pingSent_) co_return Result{co_await fail_(CloseCode::GoingAway, err), type, {}};
+				pingSent_ = true;
+				err = co_await ping();
+				if(!err) continue;
+			}
+			if(err == ErrorCode::BODY_TOO_LARGE) co_return Result{co_await fail_(CloseCode::MessageTooBig), type, {}};
+			if(err == ErrorCode::INVALID_MESSAGE) co_return Result{co_await fail_(CloseCode::ProtocolError), type, {}};
+			// the server drains, the client is told to come back rather than left with a dead socket
+			if(err == ErrorCode::CONNECTION_ENDED && conn_.drained()) co_return Result{co_await fail_(CloseCode::GoingAway, err), type, {}};
+			if(err) co_return Result{err, type, {}};
+			pingSent_ = false;
+
+			if(isControl(frame.opcode())){
+				if(frame.compressed()) co_return Result{co_await fail_(CloseCode::ProtocolError), type, {}};
+				err = co_await control_(frame);
+				if(err) co_return Result{err, Opcode::Close, {}};
+				continue;
+			}
+			bool first = frame.opcode() != Opcode::Continuation;
+			// a data frame starts a message only between messages, a continuation only inside one,
+			// and only the first frame of a message says whether it is compressed
+			if(first == inMessage || (frame.compressed() && (!first || !deflate_.enabled())))
+				co_return Result{co_await fail_(CloseCode::ProtocolError), type, {}};
+			if(first){
+				inMessage = true;
+				type = frame.opcode();
+				compressed = frame.compressed();
+			}
+
+			for(bool last = false, whole = true; !last; whole = false){
+				auto [bodyErr, piece, isLast] = co_await conn_.readBodySome(frame);
+				if(bodyErr) co_return Result{bodyErr, type, {}};
+				last = isLast;
+				if(whole && last && first && frame.fin() && !compressed){
+					// the whole message is in the read buffer, hand it out from there
+					if(type == Opcode::Text && !validUtf8(piece)) co_return Result{co_await fail_(CloseCode::InvalidPayload), type, {}};
+					co_return Result{Error{}, type, piece};
+				}
+				auto& into = compressed ? compressed_ : message_;
+				into.insert(into.end(), piece.begin(), piece.end());
+			}
+			if(!frame.fin()) continue;
+
+			if(compressed){
+				err = deflate_.decompress(compressed_, message_, options_.maxMessageSize);
+				if(err == ErrorCode::BODY_TOO_LARGE) co_return Result{co_await fail_(CloseCode::MessageTooBig), type, {}};
+				if(err) co_return Result{co_await fail_(CloseCode::InvalidPayload), type, {}};
+			}
+			if(type == Opcode::Text && !validUtf8(message_)) co_return Result{co_await fail_(CloseCode::InvalidPayload), type, {}};
+			co_return Result{Error{}, type, std::span<const std::byte>{message_}};
+		}
+	}
+
+	// Sends payload as one Text or Binary message, compressed when deflate was agreed on and it is
+	// long enough to be worth it. It is deflated once this write has its turn, so the messages
+	// go out in the order their bytes went through the shared compression context.
+	asio::awaitable<Error> write(Opcode opcode, std::span<const std::byte> payload){
+		if(closeSent_) co_return Error{ErrorCode::CONNECTION_ENDED};
+		if(deflate_.enabled() && payload.size() >= options_.deflateMinSize){
+			if(!co_await lock_(opcode)) co_return Error{ErrorCode::CONNECTION_ENDED};
+			auto err = deflate_.compress(payload, outgoing_);
+			if(!err){
+				Frame frame{opcode, std::span<const std::byte>{outgoing_}, true, true};
+				err = co_await conn_.write(frame);
+			}
+			if(outgoing_.capacity() > retainedCapacity_) outgoing_ = {};
+			unlock_();
+			co_return err;
+		}
+		Frame frame{opcode, payload};
+		co_return co_await send_(frame);
+	}
+	asio::awaitable<Error> write(std::string_view text){
+		return write(Opcode::Text, std::as_bytes(std::span{text}));
+	}
+	// Sends a frame as it is, e.g. one whose shared payload goes to many sockets. Its RSV1 must
+	// match what was agreed on, a compressed frame only goes to a socket with deflate().
+	asio::awaitable<Error> write(Frame& frame){
+		if(closeSent_) co_return Error{ErrorCode::CONNECTION_ENDED};
+		co_return co_await send_(frame);
+	}
+
+	asio::awaitable<Error> ping(std::span<const std::byte> payload = {}){
+		if(closeSent_) co_return Error{ErrorCode::CONNECTION_ENDED};
+		Frame frame{Opcode::Ping, payload.first(std::min<std::size_t>(payload.size(), 125))};
+		co_return co_await send_(frame);
+	}
+
+	// Starts the closing handshake, read() returns CONNECTION_ENDED once the peer answered.
+	asio::awaitable<Error> close(CloseCode code = CloseCode::Normal, std::string_view reason = {}){
+		if(closeSent_) co_return Error{};
+		closeSent_ = true;
+		Frame frame{Opcode::Close, closePayload(code, reason)};
+		co_return co_await send_(frame);
+	}
+
+	// Ends the connection without a closing handshake, e.g. to a peer that stopped reading. The
+	// read and write in flight fail, and so does everything after them.
+	void terminate() noexcept {
+		closeSent_ = true;
+		conn_.shutdown();
+	}
+};
+
+// Runs session on a Socket of the connection, see accept() below.
+template <typename Session>
+class SessionUpgrade final : public ConnectionUpgrade {
+	Options options_;
+	Session session_;
+public:
+	SessionUpgrade(const Options& options, Session session): options_(options), session_(std::move(session)) {}
+
+	asio::awaitable<void> run(Connection& conn, const Http::Request& req) override {
+		Socket ws{conn, req, options_};
+		co_await session_(ws);
+	}
+};
+
+// accept() for a route that also says what the WebSocket is for: once its 101 went out, the
+// connection runs session(Socket&), an asio::awaitable<void>, on a Socket with options.
+// export
+template <typename Session>
+requires std::same_as<std::invoke_result_t<Session&, Socket&>, asio::awaitable<void>>
+Http::Response accept(const Http::Request& req, std::span<std::byte> headerBuffer, const Options& options, Session session){
+	auto res = accept(req, headerBuffer, options);
+	if(res.switchingProtocols()) res.upgrade(std::make_unique<SessionUpgrade<Session>>(options, std::move(session)));
+	return res;
+}
+
+}
@@ -14,7 +14,25 @@ target("picohttpparser")
 target("ASIOServer")
     set_kind("binary")
     add_files("src/**.cpp")
-    add_packages("asio", "glaze", "gdal")
+    add_packages("asio", "glaze", "gdal", "liburing", "zlib", "zstd", "brotli")
+    -- the compression module builds in the optional encoders that were found
+    if has_package("zstd") then add_defines("CO_SERVER_ZSTD") end
+    if has_package("brotli") then add_defines("CO_SERVER_BROTLI") end
     add_includedirs("lib")
     add_deps("picohttpparser")
     set_policy("build.c++.modules", true)
+
+-- one binary per file in bench/, built on request: xmake build -g bench, then xmake run <name>
+for _, file in ipairs(os.files("bench/*.cpp")) do
+    target(path.basename(file))
+        set_kind("binary")
+        set_group("bench")
+        set_default(false)
+        add_files(file, "src/**.cpp|main.cpp")
+        add_packages("asio", "glaze", "liburing", "zlib", "zstd", "brotli")
+        if has_package("zstd") then add_defines("CO_SERVER_ZSTD") end
+        if has_package("brotli") then add_defines("CO_SERVER_BROTLI") end
+        add_includedirs("lib", "src")
+        add_deps("picohttpparser")
+        set_policy("build.c++.modules", true)
+end